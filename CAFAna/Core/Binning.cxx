@@ -7,12 +7,33 @@
 #include "TObjString.h"
 #include "TVectorD.h"
 
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <tuple>
+
 namespace ana
 {
+  //----------------------------------------------------------------------
+  std::shared_ptr<const Binning::Impl> Binning::PlaceholderImpl(int nbins)
+  {
+    auto ret = std::make_shared<Impl>();
+    ret->nbins = nbins;
+    ret->min = ret->max = 0;
+    ret->isSimple = false;
+    return ret;
+  }
+
   //----------------------------------------------------------------------
   Binning::Binning()
-    : fNBins(-1) // need a non-zero value so we count as constructed
   {
+    // need a non-zero number of bins so we count as constructed
+    static const std::shared_ptr<const Impl> kDefault = PlaceholderImpl(-1);
+    fImpl = kDefault;
+
     // Don't want children copying from us at this point. Only when we're
     // "fully constructed". So I inserted explicit calls in Simple() and
     // Custom() instead.
@@ -31,21 +52,14 @@ namespace ana
   {
     if(&b == this) return;
 
-    if(b.fNBins){
-      fEdges = b.fEdges;
-      fLabels = b.fLabels;
-      fNBins = b.fNBins;
-      fMin = b.fMin;
-      fMax = b.fMax;
-      fIsSimple = b.fIsSimple;
+    if(b.IsConstructed()){
+      fImpl = b.fImpl;
 
       DepMan<Binning>::Instance().RegisterConstruction(this);
     }
     else{
-      fNBins = 0;
-      fMin = 0;
-      fMax = 0;
-      fIsSimple = false;
+      static const std::shared_ptr<const Impl> kUnconstructed = PlaceholderImpl(0);
+      fImpl = kUnconstructed;
 
       // If we are copying from a Binning with zero bins, that is probably
       // because it is all zero because it hasn't been statically constructed
@@ -53,27 +67,20 @@ namespace ana
       DepMan<Binning>::Instance().RegisterDependency(&b, this);
     }
   }
-  
+
   //----------------------------------------------------------------------
   Binning& Binning::operator=(const Binning& b)
   {
     if(&b == this) return *this;
 
-    if(b.fNBins){
-      fEdges = b.fEdges;
-      fLabels = b.fLabels;
-      fNBins = b.fNBins;
-      fMin = b.fMin;
-      fMax = b.fMax;
-      fIsSimple = b.fIsSimple;
+    if(b.IsConstructed()){
+      fImpl = b.fImpl;
 
       DepMan<Binning>::Instance().RegisterConstruction(this);
     }
     else{
-      fNBins = 0;
-      fMin = 0;
-      fMax = 0;
-      fIsSimple = false;
+      static const std::shared_ptr<const Impl> kUnconstructed = PlaceholderImpl(0);
+      fImpl = kUnconstructed;
 
       // If we are copying from a Binning with zero bins, that is probably
       // because it is all zero because it hasn't been statically constructed
@@ -85,20 +92,57 @@ namespace ana
   }
 
   //----------------------------------------------------------------------
-  Binning Binning::SimpleHelper(int n, double lo, double hi,
-                                const std::vector<std::string>& labels)
+  Binning Binning::Intern(Impl&& impl)
+  {
+    // Binnings are identical if they'll behave identically. For simple
+    // binnings the edges follow from the rest.
+    typedef std::tuple<bool, int, double, double, std::vector<double>, std::vector<std::string>> Key;
+    Key key = impl.isSimple ?
+      Key(true, impl.nbins, impl.min, impl.max, {}, impl.labels) :
+      Key(false, impl.nbins, impl.min, impl.max, impl.edges, impl.labels);
+
+    // Entries only keep the contents alive as long as some Binning uses them
+    static std::mutex mutex;
+    static std::map<Key, std::weak_ptr<const Impl>> registry;
+    static size_t purgeSize = 1024;
+
+    Binning ret;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::weak_ptr<const Impl>& entry = registry[std::move(key)];
+    ret.fImpl = entry.lock();
+    if(!ret.fImpl){
+      ret.fImpl = std::make_shared<const Impl>(std::move(impl));
+      entry = ret.fImpl;
+    }
+
+    // Don't let binnings that are long gone pile up
+    if(registry.size() > purgeSize){
+      for(auto it = registry.begin(); it != registry.end();){
+        if(it->second.expired()) it = registry.erase(it); else ++it;
+      }
+      purgeSize = std::max(purgeSize, 2*registry.size());
+    }
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  Binning::Impl Binning::SimpleHelper(int n, double lo, double hi,
+                                      const std::vector<std::string>& labels)
   {
     assert(labels.empty() || int(labels.size()) == n);
 
-    Binning bins;
-    bins.fNBins = n;
-    bins.fMin = lo;
-    bins.fMax = hi;
-    bins.fEdges.resize(n+1);
+    Impl bins;
+    bins.nbins = n;
+    bins.min = lo;
+    bins.max = hi;
+    bins.edges.resize(n+1);
     for (int i = 0; i <= n; i++)
-      bins.fEdges[i] = lo + i*(hi-lo)/n;
-    bins.fLabels = labels;
-    bins.fIsSimple = true;
+      bins.edges[i] = lo + i*(hi-lo)/n;
+    bins.labels = labels;
+    bins.isSimple = true;
 
     return bins;
   }
@@ -107,7 +151,7 @@ namespace ana
   Binning Binning::Simple(int n, double lo, double hi,
                           const std::vector<std::string>& labels)
   {
-    Binning bins = SimpleHelper(n, lo, hi, labels);
+    Binning bins = Intern(SimpleHelper(n, lo, hi, labels));
 
     DepMan<Binning>::Instance().RegisterConstruction(&bins);
 
@@ -123,28 +167,74 @@ namespace ana
       if (i == 0) edges[i] = lo;
       else        edges[i] = logSpacing*edges[i-1];
     }
-    return Custom(edges);
+
+    Impl impl = CustomHelper(edges);
+
+    // One bucket per bin in log space is an (almost) exact analytic lookup,
+    // up to rounding in the edges computed above
+    if(lo > 0) impl.BuildAccelerator(true, n);
+
+    Binning bins = Intern(std::move(impl));
+
+    DepMan<Binning>::Instance().RegisterConstruction(&bins);
+
+    return bins;
   }
 
   //----------------------------------------------------------------------
-  Binning Binning::CustomHelper(const std::vector<double>& edges)
+  Binning::Impl Binning::CustomHelper(const std::vector<double>& edges)
   {
     assert(edges.size() > 1);
 
-    Binning bins;
-    bins.fEdges = edges;
-    bins.fNBins = edges.size()-1;
-    bins.fMin = edges.front();
-    bins.fMax = edges.back();
-    bins.fIsSimple = false;
+    Impl bins;
+    bins.edges = edges;
+    bins.nbins = edges.size()-1;
+    bins.min = edges.front();
+    bins.max = edges.back();
+    bins.isSimple = false;
+
+    // Enough buckets that each one typically contains at most one edge, but
+    // don't let a single very narrow bin blow up the table size.
+    double minWidth = bins.max - bins.min;
+    for(unsigned int i = 1; i < edges.size(); ++i){
+      if(edges[i] > edges[i-1]) minWidth = std::min(minWidth, edges[i]-edges[i-1]);
+    }
+    const double nideal = std::ceil((bins.max - bins.min) / minWidth);
+    if(std::isfinite(nideal))
+      bins.BuildAccelerator(false, std::min(nideal, 16.*bins.nbins));
 
     return bins;
   }
 
+  //----------------------------------------------------------------------
+  void Binning::Impl::BuildAccelerator(bool logSpace, int nbuckets)
+  {
+    accel.clear();
+    accelLog = logSpace;
+
+    const double lo = logSpace ? log(min) : min;
+    const double hi = logSpace ? log(max) : max;
+
+    // Fall back to the binary search for infinite edges and the like
+    if(!std::isfinite(lo) || !std::isfinite(hi) || !(hi > lo) || nbuckets < 1) return;
+
+    accelLo = lo;
+    accelScale = nbuckets / (hi - lo);
+
+    accel.resize(nbuckets);
+    for(int i = 0; i < nbuckets; ++i){
+      const double u = lo + i / accelScale;
+      const double x = logSpace ? exp(u) : u;
+      // Number of edges <= x is exactly what FindBin() would return
+      const int bin = std::upper_bound(edges.begin(), edges.end(), x) - edges.begin();
+      accel[i] = std::max(1, std::min(bin, nbins));
+    }
+  }
+
   //----------------------------------------------------------------------
   Binning Binning::Custom(const std::vector<double>& edges)
   {
-    Binning bins = CustomHelper(edges);
+    Binning bins = Intern(CustomHelper(edges));
 
     DepMan<Binning>::Instance().RegisterConstruction(&bins);
 
@@ -154,21 +244,66 @@ namespace ana
   //----------------------------------------------------------------------
   int Binning::FindBin(double x) const
   {
-    // Treat anything outside [fMin, fMax) as Underflow / Overflow
-    if (x <  fMin) return 0;               // Underflow
-    if (x >= fMax) return fEdges.size();   // Overflow
+    const Impl& b = *fImpl;
+
+    // Treat anything outside [min, max) as Underflow / Overflow. NaN is
+    // underflow, as the binary search below has always made it
+    if (!(x >= b.min)) return 0;            // Underflow
+    if (x >= b.max) return b.edges.size();  // Overflow
 
     // Follow ROOT convention, first bin of histogram is bin 1
 
-    if(IsSimple()) return fNBins * (x - fMin) / (fMax - fMin) +1;
+    if(b.isSimple) return b.nbins * (x - b.min) / (b.max - b.min) +1;
+
+    if(!b.accel.empty()){
+      const double u = b.accelLog ? log(x) : x;
+      const unsigned int bucket = std::max(0., (u - b.accelLo) * b.accelScale);
+      int bin = b.accel[std::min(bucket, (unsigned int)b.accel.size()-1)];
+
+      // The table only gives a starting guess (rounding can put us one bucket
+      // off). Walk to the answer. Both loops terminate because min <= x <
+      // max.
+      while(b.edges[bin] <= x) ++bin;
+      while(b.edges[bin-1] > x) --bin;
+      // Like the binary search, a value on a repeated edge goes in the first
+      // bin starting there, even if that bin has zero width
+      while(bin > 1 && b.edges[bin-2] == x) --bin;
+      return bin;
+    }
 
     int bin =
-      std::lower_bound(fEdges.begin(), fEdges.end(), x) - fEdges.begin();
-    if (x == fEdges[bin]) bin++;
-    assert(bin >= 0 && bin < (int)fEdges.size());
+      std::lower_bound(b.edges.begin(), b.edges.end(), x) - b.edges.begin();
+    if (x == b.edges[bin]) bin++;
+    assert(bin >= 0 && bin < (int)b.edges.size());
     return bin;
   }
 
+  //----------------------------------------------------------------------
+  void Binning::FindBins(const std::vector<double>& xs,
+                         std::vector<int>& bins) const
+  {
+    bins.resize(xs.size());
+
+    if(!IsSimple()){
+      for(unsigned int i = 0; i < xs.size(); ++i) bins[i] = FindBin(xs[i]);
+      return;
+    }
+
+    // For simple binnings the whole batch is one multiply-add per lane, which
+    // Eigen will vectorize for us.
+    const Eigen::Map<const Eigen::ArrayXd> x(xs.data(), xs.size());
+    Eigen::Map<Eigen::ArrayXi> ret(bins.data(), bins.size());
+
+    // Clamp before converting so that the int conversion is defined for the
+    // lanes that are about to be discarded as underflow/overflow. The
+    // arithmetic is exactly the same as FindBin() so results are identical.
+    const double lo = fImpl->min, hi = fImpl->max;
+    const int n = fImpl->nbins;
+    const auto inbin = (double(n) * (x.max(lo).min(hi) - lo) / (hi - lo) + 1).cast<int>();
+
+    ret = (x >= lo).select((x >= hi).select(n+1, inbin), 0);
+  }
+
   //----------------------------------------------------------------------
   Binning Binning::FromTAxis(const TAxis* ax)
   {
@@ -176,7 +311,7 @@ namespace ana
 
     // Evenly spaced binning
     if(!ax->GetXbins()->GetArray()){
-      bins = SimpleHelper(ax->GetNbins(), ax->GetXmin(), ax->GetXmax());
+      bins = Intern(SimpleHelper(ax->GetNbins(), ax->GetXmin(), ax->GetXmax()));
     }
     else{
       std::vector<double> edges(ax->GetNbins()+1);
@@ -201,24 +336,26 @@ namespace ana
 
     TVectorD nminmax(3);
 
-    nminmax[0] = fNBins;
-    nminmax[1] = fMin;
-    nminmax[2] = fMax;
+    nminmax[0] = NBins();
+    nminmax[1] = Min();
+    nminmax[2] = Max();
 
     nminmax.Write("nminmax");
 
     TVectorD issimple(1);
-    issimple[0] = fIsSimple;
+    issimple[0] = IsSimple();
     issimple.Write("issimple");
 
-    TVectorD edges(fEdges.size());
-    for(unsigned int i = 0; i < fEdges.size(); ++i)
-      edges[i] = fEdges[i];
+    const std::vector<double>& e = Edges();
+    TVectorD edges(e.size());
+    for(unsigned int i = 0; i < e.size(); ++i)
+      edges[i] = e[i];
 
     edges.Write("edges");
 
-    for(unsigned int i = 0; i < fLabels.size(); ++i)
-      TObjString(fLabels[i].c_str()).Write(TString::Format("label%d", i).Data());
+    const std::vector<std::string>& labels = Labels();
+    for(unsigned int i = 0; i < labels.size(); ++i)
+      TObjString(labels[i].c_str()).Write(TString::Format("label%d", i).Data());
 
     dir->Write();
     delete dir;
@@ -255,10 +392,17 @@ namespace ana
       ret = Binning::Custom(edges);
     }
 
+    std::vector<std::string> labels;
     for(unsigned int i = 0; ; ++i){
       TObjString* s = (TObjString*)dir->Get(TString::Format("label%d", i).Data());
       if(!s) break;
-      ret.fLabels.push_back(s->GetString().Data());
+      labels.push_back(s->GetString().Data());
+    }
+
+    if(!labels.empty()){
+      Impl impl = *ret.fImpl;
+      impl.labels = labels;
+      ret = Intern(std::move(impl));
     }
 
     delete dir;
@@ -269,24 +413,32 @@ namespace ana
   //----------------------------------------------------------------------
   bool Binning::operator==(const Binning& rhs) const
   {
-    if(fIsSimple != rhs.fIsSimple) return false;
-    if(fIsSimple){
-      return fNBins == rhs.fNBins && fMin == rhs.fMin && fMax == rhs.fMax;
+    if(fImpl == rhs.fImpl) return true;
+
+    const Impl& a = *fImpl;
+    const Impl& b = *rhs.fImpl;
+    if(a.isSimple != b.isSimple) return false;
+    if(a.isSimple){
+      return a.nbins == b.nbins && a.min == b.min && a.max == b.max;
     }
     else{
-      return fEdges == rhs.fEdges;
+      return a.edges == b.edges;
     }
   }
 
   //----------------------------------------------------------------------
   bool Binning::operator<(const Binning& rhs) const
   {
-    if(fIsSimple != rhs.fIsSimple) return fIsSimple < rhs.fIsSimple;
-    if(fIsSimple){
-      return std::make_tuple(fNBins, fMin, fMax) < std::make_tuple(rhs.fNBins, rhs.fMin, rhs.fMax);
+    if(fImpl == rhs.fImpl) return false;
+
+    const Impl& a = *fImpl;
+    const Impl& b = *rhs.fImpl;
+    if(a.isSimple != b.isSimple) return a.isSimple < b.isSimple;
+    if(a.isSimple){
+      return std::make_tuple(a.nbins, a.min, a.max) < std::make_tuple(b.nbins, b.min, b.max);
     }
     else{
-      return fEdges < rhs.fEdges;
+      return a.edges < b.edges;
     }
   }
 
@@ -26,37 +26,83 @@ namespace ana
     Binning& operator=(const Binning& b);
     ~Binning();
 
-    int NBins() const {return fNBins;}
-    double Min() const {return fMin;}
-    double Max() const {return fMax;}
+    int NBins() const {return fImpl->nbins;}
+    double Min() const {return fImpl->min;}
+    double Max() const {return fImpl->max;}
     int FindBin(double x) const;
-    bool IsSimple() const {return fIsSimple;}
+    /// \brief Batch version of \ref FindBin
+    ///
+    /// Vectorized for simple binnings. \a bins is resized to match \a xs
+    void FindBins(const std::vector<double>& xs, std::vector<int>& bins) const;
+    bool IsSimple() const {return fImpl->isSimple;}
     const std::vector<double>& Edges() const
     {
-      return fEdges;
+      return fImpl->edges;
     }
 
-    const std::vector<std::string>& Labels() const {return fLabels;}
+    const std::vector<std::string>& Labels() const {return fImpl->labels;}
 
     void SaveTo(TDirectory* dir, const std::string& name) const;
     static std::unique_ptr<Binning> LoadFrom(TDirectory* dir, const std::string& name);
 
+    /// Binnings made the same way share their contents, in which case this
+    /// is a pointer comparison
     bool operator==(const Binning& rhs) const;
     bool operator<(const Binning& rhs) const;
 
   protected:
+    friend class LabelsAndBins;
+
     Binning();
 
-    static Binning SimpleHelper(int n, double lo, double hi,
-                                const std::vector<std::string>& labels = {});
+    /// \brief The contents of a Binning, which never change once made
+    ///
+    /// Identical ones are shared between all the Binnings that use them, so
+    /// copying a Binning is cheap and many copies take little memory.
+    struct Impl
+    {
+      std::vector<double> edges;
+      std::vector<std::string> labels;
+      int nbins;
+      double min, max;
+      bool isSimple;
+
+      /// \brief Lookup table for FindBin() with non-simple binnings
+      ///
+      /// The range is divided into equal-sized buckets (in x, or log(x) for
+      /// LogUniform binnings) and each entry holds the bin that the low edge
+      /// of that bucket falls in. FindBin() then only has to step over the
+      /// handful of edges inside one bucket. Empty if no accelerator could be
+      /// built.
+      std::vector<int> accel;
+      double accelLo = 0, accelScale = 0;
+      bool accelLog = false;
+
+      /// Fill \ref accel. Buckets are uniform in log(x) if \a logSpace
+      void BuildAccelerator(bool logSpace, int nbuckets);
+    };
+
+    static Impl SimpleHelper(int n, double lo, double hi,
+                             const std::vector<std::string>& labels = {});
+
+    static Impl CustomHelper(const std::vector<double>& edges);
+
+    /// Binning sharing the contents of any identical one that exists already
+    static Binning Intern(Impl&& impl);
+
+    /// \brief Contents with \a nbins bins and no edges
+    ///
+    /// For default-constructed Binnings (-1) and copies of ones that haven't
+    /// been constructed yet (0)
+    static std::shared_ptr<const Impl> PlaceholderImpl(int nbins);
 
-    static Binning CustomHelper(const std::vector<double>& edges);
+    /// \brief Whether we have been constructed
+    ///
+    /// Statics that haven't been constructed yet are all zero, and copies of
+    /// them have no bins. See \ref DepMan.
+    bool IsConstructed() const {return fImpl && fImpl->nbins != 0;}
 
-    std::vector<double> fEdges;
-    std::vector<std::string> fLabels;
-    int fNBins;
-    double fMin, fMax;
-    bool fIsSimple;
+    std::shared_ptr<const Impl> fImpl;
   };
 
 }
@@ -78,7 +78,16 @@ namespace ana
     /// Allows a cut to be called with bool result = myCut(rec) syntax
     bool operator()(const RecT* rec) const
     {
-      return fFunc(rec);
+      return CutBase::operator()(rec);
+    }
+
+    /// \brief Evaluate for many records at once
+    ///
+    /// \a pass is resized to match \a recs, and set to 1 or 0 for each
+    void Eval(const std::vector<const RecT*>& recs, std::vector<char>& pass) const
+    {
+      pass.resize(recs.size());
+      EvalBatch((const void* const*)recs.data(), recs.size(), pass.data());
     }
 
     /// Provide a Livetime function if your cut is a timing cut etc
@@ -103,6 +112,19 @@ namespace ana
     _Cut operator||(const _Cut& c) const {return CutBase::operator||(c);}
     _Cut operator!() const {return CutBase::operator!();}
 
+    /// \brief \a chain, a sequence of && or of ||, with the operands
+    /// evaluated in whichever order turns out fastest
+    ///
+    /// eg Adaptive(kIsFid && kHasTrack && kEnergyCut). The first \a nsamples
+    /// records are used to measure the cost and pass rate of each
+    /// operand. Only use this if all the operands can be safely evaluated in
+    /// any order (ie none relies on an earlier one to guard against eg a
+    /// missing object).
+    friend _Cut Adaptive(const _Cut& chain, int nsamples = 1000)
+    {
+      return _Cut(CutBase::Adaptive(chain, nsamples));
+    }
+
     // Python doesn't allow overloading and/or/not, but &/|/~ are
     // available. Don't expose these publicly to C++ users though.
     // This #define is set in Dict/classes.h
@@ -118,6 +140,7 @@ namespace ana
 
   protected:
     friend class _Var<RecT>;
+    friend class ExprProgram;
     _Cut(const CutBase& c) : CutBase(c) {}
   };
 
@@ -2,12 +2,47 @@
 
 #include "CAFAna/Core/DepMan.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
-#include <map>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
+namespace
+{
+  /// Results memoized inside CutCacheScope, for one thread
+  struct CutCache
+  {
+    /// Incremented for each new record, making all the old entries stale
+    unsigned int gen = 0;
+
+    /// Indexed by Cut ID. Entries are only valid if their stamp is gen
+    std::vector<bool> vals;
+    std::vector<unsigned int> stamps;
+
+    void NewRecord()
+    {
+      if(++gen == 0){
+        // Wrapped around. Make sure no ancient entries can match
+        std::fill(stamps.begin(), stamps.end(), 0);
+        gen = 1;
+      }
+    }
+  };
+
+  thread_local CutCache gCutCache;
+}
 
 namespace ana
 {
-  int CutBase::fgNextID = 0;
+  std::atomic<int> CutBase::fgNextID(0);
+
+  thread_local const void* CutBase::fgCacheRec = 0;
 
   //----------------------------------------------------------------------
   CutBase::CutBase(const std::function<VoidCutFunc_t>& func,
@@ -15,11 +50,43 @@ namespace ana
                    const std::function<VoidExpoFunc_t>& potfunc,
                    int id)
     : fFunc(func), fLiveFunc(livefunc), fPOTFunc(potfunc),
-      fID((id >= 0) ? id : fgNextID++)
+      fID((id >= 0) ? id : InternID({ExprGraph::kLeaf, -1, -1, 0}))
+  {
+    DepMan<CutBase>::Instance().RegisterConstruction(this);
+  }
+
+  //----------------------------------------------------------------------
+  CutBase::CutBase(const std::function<VoidCutFunc_t>& func,
+                   const std::function<VoidBatchCutFunc_t>& batchfunc,
+                   const std::function<VoidExpoFunc_t>& livefunc,
+                   const std::function<VoidExpoFunc_t>& potfunc,
+                   int id)
+    : fFunc(func), fBatchFunc(batchfunc),
+      fLiveFunc(livefunc), fPOTFunc(potfunc),
+      fID((id >= 0) ? id : InternID({ExprGraph::kLeaf, -1, -1, 0}))
   {
     DepMan<CutBase>::Instance().RegisterConstruction(this);
   }
 
+  //----------------------------------------------------------------------
+  CutBase::CutBase(const std::function<VoidCutFunc_t>& func,
+                   const std::function<VoidBatchCutFunc_t>& batchfunc,
+                   const std::function<VoidExpoFunc_t>& livefunc,
+                   const std::function<VoidExpoFunc_t>& potfunc,
+                   const ExprGraph::Node& node)
+    : fFunc(func), fBatchFunc(batchfunc),
+      fLiveFunc(livefunc), fPOTFunc(potfunc),
+      fID(InternID(node))
+  {
+    DepMan<CutBase>::Instance().RegisterConstruction(this);
+  }
+
+  //----------------------------------------------------------------------
+  int CutBase::InternID(const ExprGraph::Node& node)
+  {
+    return ExprGraph::Instance().InternCut(node, fgNextID);
+  }
+
   //----------------------------------------------------------------------
   CutBase::~CutBase()
   {
@@ -29,12 +96,13 @@ namespace ana
 
   //----------------------------------------------------------------------
   CutBase::CutBase(const CutBase& c)
-    : fFunc(0), fLiveFunc(0), fPOTFunc(0), fID(-1)
+    : fFunc(0), fBatchFunc(0), fLiveFunc(0), fPOTFunc(0), fID(-1)
   {
     if(&c == this) return;
 
     if(c.fFunc){
       fFunc = c.fFunc;
+      fBatchFunc = c.fBatchFunc;
       fLiveFunc = c.fLiveFunc;
       fPOTFunc = c.fPOTFunc;
       fID = c.fID;
@@ -56,6 +124,7 @@ namespace ana
 
     if(c.fFunc){
       fFunc = c.fFunc;
+      fBatchFunc = c.fBatchFunc;
       fLiveFunc = c.fLiveFunc;
       fPOTFunc = c.fPOTFunc;
       fID = c.fID;
@@ -64,6 +133,7 @@ namespace ana
     }
     else{
       fFunc = 0;
+      fBatchFunc = 0;
       fLiveFunc = 0;
       fPOTFunc = 0;
       fID = -1;
@@ -109,60 +179,362 @@ namespace ana
   }
 
   //----------------------------------------------------------------------
-  CutBase CutBase::operator&&(const CutBase& c) const
+  void CutBase::EvalBatch(const void* const* recs, int n, char* pass) const
   {
-    // The same pairs of cuts are frequently and-ed together. Make sure those
-    // duplicates get the same IDs by remembering what we've done in the past.
-    static std::map<std::pair<int, int>, int> ids;
-    const std::pair<int, int> key(ID(), c.ID());
+    if(fBatchFunc){
+      fBatchFunc(recs, n, pass);
+    }
+    else{
+      for(int i = 0; i < n; ++i) pass[i] = (*this)(recs[i]);
+    }
+  }
 
-    struct And
+  //----------------------------------------------------------------------
+  void CutBase::EvalBatchShortCircuit(const CutBase& a, const CutBase& b,
+                                      bool isAnd,
+                                      const void* const* recs, int n,
+                                      char* pass)
+  {
+    a.EvalBatch(recs, n, pass);
+
+    // b only needs evaluating where a didn't already decide the result
+    std::vector<const void*> sub;
+    std::vector<int> idxs;
+    sub.reserve(n);
+    idxs.reserve(n);
+    for(int i = 0; i < n; ++i){
+      if(bool(pass[i]) == isAnd){
+        sub.push_back(recs[i]);
+        idxs.push_back(i);
+      }
+    }
+    if(sub.empty()) return;
+
+    std::vector<char> subpass(sub.size());
+    b.EvalBatch(sub.data(), sub.size(), subpass.data());
+    for(unsigned int j = 0; j < sub.size(); ++j) pass[idxs[j]] = subpass[j];
+  }
+
+  /// a && b, or a || b, with short-circuiting
+  class CutBase::ShortCircuit
+  {
+  public:
+    ShortCircuit(const CutBase& _a, const CutBase& _b, bool _isAnd)
+      : a(_a), b(_b), isAnd(_isAnd)
+    {
+    }
+
+    bool operator()(const void* rec) const
     {
-      const CutBase a, b;
-      bool operator()(const void* rec) const {return a(rec) && b(rec);}
+      return isAnd ? (a(rec) && b(rec)) : (a(rec) || b(rec));
+    }
+
+    void operator()(const void* const* recs, int n, char* pass) const
+    {
+      EvalBatchShortCircuit(a, b, isAnd, recs, n, pass);
+    }
+
+    const CutBase a, b;
+    const bool isAnd;
+  };
+
+  /// !a
+  class CutBase::Not
+  {
+  public:
+    Not(const CutBase& _a) : a(_a) {}
+
+    bool operator()(const void* rec) const {return !a(rec);}
+
+    void operator()(const void* const* recs, int n, char* pass) const
+    {
+      a.EvalBatch(recs, n, pass);
+      for(int i = 0; i < n; ++i) pass[i] = !pass[i];
+    }
+
+    const CutBase a;
+  };
+
+  /// \brief && or || of several cuts, evaluated in whichever order is
+  /// fastest on average
+  ///
+  /// For the first few records every operand is evaluated and timed, so that
+  /// their pass rates are measured without bias. After that && evaluates
+  /// them in increasing order of time per rejection, and || in increasing
+  /// order of time per acceptance, with the usual short-circuiting. The
+  /// result for each record is the same either way.
+  class CutBase::AdaptiveChain
+  {
+  public:
+    /// \a chain must be built by && or ||. Operands that are themselves the
+    /// same kind of chain are flattened into this one, so that any operand
+    /// can move to the front, not just one of the last pair.
+    AdaptiveChain(const ShortCircuit& chain, int nsamples)
+    {
+      std::vector<CutCopy> cuts;
+      AppendOperands(chain.a, chain.isAnd, cuts);
+      AppendOperands(chain.b, chain.isAnd, cuts);
+      fState = std::make_shared<State>(std::move(cuts), chain.isAnd, nsamples);
+    }
+
+    bool operator()(const void* rec) const
+    {
+      const State& s = *fState;
+      if(!s.ordered.load(std::memory_order_acquire)) return Sample(rec);
+
+      // && fails at the first false, || passes at the first true
+      for(int i: s.order) if(s.cuts[i](rec) != s.isAnd) return !s.isAnd;
+      return s.isAnd;
+    }
+
+    void operator()(const void* const* recs, int n, char* pass) const
+    {
+      const State& s = *fState;
+      if(!s.ordered.load(std::memory_order_acquire)){
+        for(int i = 0; i < n; ++i) pass[i] = Sample(recs[i]);
+        return;
+      }
+
+      // Each operand only sees the records still undecided by the earlier ones
+      std::fill(pass, pass+n, s.isAnd);
+      std::vector<const void*> sub(recs, recs+n);
+      std::vector<int> idxs(n);
+      std::iota(idxs.begin(), idxs.end(), 0);
+      std::vector<char> subpass(n);
+      for(int i: s.order){
+        if(sub.empty()) return;
+        s.cuts[i].EvalBatch(sub.data(), sub.size(), subpass.data());
+        unsigned int nkeep = 0;
+        for(unsigned int j = 0; j < sub.size(); ++j){
+          if(bool(subpass[j]) == s.isAnd){
+            sub[nkeep] = sub[j];
+            idxs[nkeep] = idxs[j];
+            ++nkeep;
+          }
+          else{
+            pass[idxs[j]] = !s.isAnd;
+          }
+        }
+        sub.resize(nkeep);
+        idxs.resize(nkeep);
+      }
+    }
+
+  protected:
+    /// CutBase's copy constructor isn't public, so can't go in a std::vector
+    /// directly
+    struct CutCopy: public CutBase
+    {
+      CutCopy(const CutBase& c) : CutBase(c) {}
     };
 
-    if(ids.count(key) == 0) ids[key] = fgNextID++;
-    return CutBase(And{*this, c},
+    static void AppendOperands(const CutBase& c, bool isAnd,
+                               std::vector<CutCopy>& cuts)
+    {
+      const ShortCircuit* sc = c.fFunc.target<ShortCircuit>();
+      const AdaptiveChain* chain = c.fFunc.target<AdaptiveChain>();
+      if(sc && sc->isAnd == isAnd){
+        AppendOperands(sc->a, isAnd, cuts);
+        AppendOperands(sc->b, isAnd, cuts);
+      }
+      else if(chain && chain->fState->isAnd == isAnd){
+        cuts.insert(cuts.end(), chain->fState->cuts.begin(), chain->fState->cuts.end());
+      }
+      else{
+        cuts.emplace_back(c);
+      }
+    }
+
+    struct State
+    {
+      State(std::vector<CutCopy>&& c, bool a, int ns)
+        : cuts(std::move(c)), isAnd(a), nsamples(ns),
+          nanos(cuts.size(), 0), npass(cuts.size(), 0), nseen(0),
+          ordered(false)
+      {
+      }
+
+      const std::vector<CutCopy> cuts;
+      const bool isAnd;
+      const int nsamples; ///< Number of records to profile on
+
+      std::mutex mutex; ///< Protects the statistics
+      std::vector<double> nanos; ///< Total time spent in each operand
+      std::vector<long> npass; ///< Number of records each operand passed
+      long nseen;
+
+      /// Only valid once \a ordered is set
+      std::vector<int> order;
+      std::atomic<bool> ordered;
+    };
+
+    bool Sample(const void* rec) const
+    {
+      State& s = *fState;
+
+      const unsigned int N = s.cuts.size();
+      std::vector<double> nanos(N);
+      std::vector<bool> pass(N);
+      for(unsigned int i = 0; i < N; ++i){
+        const auto t0 = std::chrono::steady_clock::now();
+        pass[i] = s.cuts[i](rec);
+        const auto t1 = std::chrono::steady_clock::now();
+        nanos[i] = std::chrono::duration<double, std::nano>(t1-t0).count();
+      }
+
+      std::lock_guard<std::mutex> lock(s.mutex);
+      if(!s.ordered.load(std::memory_order_relaxed)){
+        for(unsigned int i = 0; i < N; ++i){
+          s.nanos[i] += nanos[i];
+          s.npass[i] += pass[i];
+        }
+        if(++s.nseen >= s.nsamples) Reorder();
+      }
+
+      if(s.isAnd) return std::find(pass.begin(), pass.end(), false) == pass.end();
+      return std::find(pass.begin(), pass.end(), true) != pass.end();
+    }
+
+    /// Fix the order from the statistics so far. Must hold the mutex
+    void Reorder() const
+    {
+      State& s = *fState;
+
+      // Expected cost of evaluating an operand per record that it decides
+      // the result for. Evaluating in increasing order of this is optimal
+      // for independent operands.
+      std::vector<double> cost(s.cuts.size());
+      for(unsigned int i = 0; i < s.cuts.size(); ++i){
+        const long ndecide = s.isAnd ? s.nseen - s.npass[i] : s.npass[i];
+        cost[i] = (ndecide > 0) ? s.nanos[i] / ndecide : std::numeric_limits<double>::infinity();
+      }
+
+      s.order.resize(s.cuts.size());
+      std::iota(s.order.begin(), s.order.end(), 0);
+      // Stable, so operands never seen to decide anything keep the user's order
+      std::stable_sort(s.order.begin(), s.order.end(),
+                       [&cost](int a, int b){return cost[a] < cost[b];});
+
+      s.ordered.store(true, std::memory_order_release);
+    }
+
+    std::shared_ptr<State> fState;
+  };
+
+  //----------------------------------------------------------------------
+  CutBase CutBase::Adaptive(const CutBase& chain, int nsamples)
+  {
+    const ShortCircuit* sc = chain.fFunc.target<ShortCircuit>();
+    if(!sc || nsamples <= 0) return chain;
+
+    // Same result for every record, so keep the same ID
+    const AdaptiveChain f(*sc, nsamples);
+    return CutBase(f, f, chain.fLiveFunc, chain.fPOTFunc, chain.fID);
+  }
+
+  //----------------------------------------------------------------------
+  CutBase CutBase::operator&&(const CutBase& c) const
+  {
+    // The same pairs of cuts are frequently and-ed together. Those duplicates
+    // get the same IDs from the ExprGraph.
+    const ExprGraph::Node node = (ID() >= 0 && c.ID() >= 0) ?
+      ExprGraph::Node{ExprGraph::kAnd, ID(), c.ID(), 0} :
+      ExprGraph::Node{ExprGraph::kLeaf, -1, -1, 0};
+
+    const ShortCircuit f(*this, c, true);
+    return CutBase(f, f,
                    CombineExposures(fLiveFunc, c.fLiveFunc),
                    CombineExposures(fPOTFunc, c.fPOTFunc),
-                   ids[key]);
+                   node);
   }
 
   //----------------------------------------------------------------------
   CutBase CutBase::operator||(const CutBase& c) const
   {
-    static std::map<std::pair<int, int>, int> ids;
-    const std::pair<int, int> key(ID(), c.ID());
+    const ExprGraph::Node node = (ID() >= 0 && c.ID() >= 0) ?
+      ExprGraph::Node{ExprGraph::kOr, ID(), c.ID(), 0} :
+      ExprGraph::Node{ExprGraph::kLeaf, -1, -1, 0};
 
-    struct Or
-    {
-      const CutBase a, b;
-      bool operator()(const void* rec) const {return a(rec) || b(rec);}
-    };
-
-    if(ids.count(key) == 0) ids[key] = fgNextID++;
-    return CutBase(Or{*this, c},
+    const ShortCircuit f(*this, c, false);
+    return CutBase(f, f,
                    CombineExposures(fLiveFunc, c.fLiveFunc),
                    CombineExposures(fPOTFunc, c.fPOTFunc),
-                   ids[key]);
+                   node);
   }
 
   //----------------------------------------------------------------------
   CutBase CutBase::operator!() const
   {
-    static std::map<int, int> ids;
+    const Not f(*this);
+    const ExprGraph::Node node = (ID() >= 0) ?
+      ExprGraph::Node{ExprGraph::kNot, ID(), -1, 0} :
+      ExprGraph::Node{ExprGraph::kLeaf, -1, -1, 0};
+    return CutBase(f, f, 0, 0, node);
+  }
 
-    struct Not
-    {
-      const CutBase a;
-      bool operator()(const void* rec) const {return !a(rec);}
-    };
 
-    if(ids.count(ID()) == 0) ids[ID()] = fgNextID++;
-    return CutBase(Not{*this}, 0, 0, ids[ID()]);
+  //----------------------------------------------------------------------
+  bool CutBase::Operands(const CutBase& c, const CutBase*& a, const CutBase*& b)
+  {
+    if(const ShortCircuit* f = c.fFunc.target<ShortCircuit>()){
+      a = &f->a;
+      b = &f->b;
+      return true;
+    }
+    if(const Not* f = c.fFunc.target<Not>()){
+      a = &f->a;
+      b = 0;
+      return true;
+    }
+    return false;
   }
 
+  //----------------------------------------------------------------------
+  bool CutBase::CachedValue(const void* rec) const
+  {
+    CutCache& cache = gCutCache;
+    if(fID >= int(cache.vals.size())){
+      const int n = std::max(fID, MaxID())+1;
+      cache.vals.resize(n);
+      cache.stamps.resize(n, 0);
+    }
+
+    if(cache.stamps[fID] == cache.gen) return cache.vals[fID];
+
+    // Composite cuts evaluate their operands, which can resize the cache
+    const bool val = fFunc(rec);
+    cache.vals[fID] = val;
+    cache.stamps[fID] = cache.gen;
+    return val;
+  }
+
+  //----------------------------------------------------------------------
+  void CutBase::SetCacheRecord(const void* rec)
+  {
+    fgCacheRec = rec;
+    gCutCache.NewRecord();
+  }
+
+  //----------------------------------------------------------------------
+  CutCacheScope::CutCacheScope(const void* rec)
+    : fPrevRec(CutBase::fgCacheRec)
+  {
+    CutBase::SetCacheRecord(rec);
+  }
+
+  //----------------------------------------------------------------------
+  CutCacheScope::~CutCacheScope()
+  {
+    // The inner record may have overwritten the outer one's results, or been
+    // a shifted version of the same record
+    CutBase::SetCacheRecord(fPrevRec);
+  }
+
+  //----------------------------------------------------------------------
+  void CutCacheScope::Invalidate()
+  {
+    gCutCache.NewRecord();
+  }
 
   //----------------------------------------------------------------------
   CutBase::operator bool() const
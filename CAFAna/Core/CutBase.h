@@ -1,5 +1,8 @@
 #pragma once
 
+#include "CAFAna/Core/ExprGraph.h"
+
+#include <atomic>
 #include <functional>
 
 namespace ana
@@ -14,9 +17,13 @@ namespace ana
   public:
     typedef bool (VoidCutFunc_t)(const void* sr);
     typedef double (VoidExpoFunc_t)(const void* sr);
+    /// Evaluate for \a n records at once, writing 0 or 1 to \a pass
+    typedef void (VoidBatchCutFunc_t)(const void* const* recs, int n, char* pass);
 
     friend class DepMan<CutBase>;
     friend class VarBase;
+    friend class CutCacheScope;
+    friend class ExprProgram;
 
     ~CutBase();
 
@@ -26,6 +33,21 @@ namespace ana
             const std::function<VoidExpoFunc_t>& potfunc,
             int id = -1);
 
+    /// \param batchfunc Optional faster implementation of \a func for many
+    ///                  records at once
+    CutBase(const std::function<VoidCutFunc_t>& func,
+            const std::function<VoidBatchCutFunc_t>& batchfunc,
+            const std::function<VoidExpoFunc_t>& livefunc,
+            const std::function<VoidExpoFunc_t>& potfunc,
+            int id);
+
+    /// A composite, given the same ID as any other with the same \a node
+    CutBase(const std::function<VoidCutFunc_t>& func,
+            const std::function<VoidBatchCutFunc_t>& batchfunc,
+            const std::function<VoidExpoFunc_t>& livefunc,
+            const std::function<VoidExpoFunc_t>& potfunc,
+            const ExprGraph::Node& node);
+
     CutBase(const CutBase& c);
 
     CutBase& operator=(const CutBase& c);
@@ -42,9 +64,23 @@ namespace ana
 
     bool operator()(const void* rec) const
     {
+      if(rec && rec == fgCacheRec && fID >= 0) return CachedValue(rec);
       return fFunc(rec);
     }
 
+    /// \brief Evaluate for \a n records at once, into \a pass
+    ///
+    /// Uses the batch implementation if there is one, otherwise evaluates
+    /// each record in turn. The operands of && and || are only evaluated for
+    /// the records that need them, as for a single record.
+    void EvalBatch(const void* const* recs, int n, char* pass) const;
+
+    /// Batch evaluation of a && b (or a || b if not \a isAnd)
+    static void EvalBatchShortCircuit(const CutBase& a, const CutBase& b,
+                                      bool isAnd,
+                                      const void* const* recs, int n,
+                                      char* pass);
+
     std::function<VoidExpoFunc_t>
     CombineExposures(const std::function<VoidExpoFunc_t>& a,
                      const std::function<VoidExpoFunc_t>& b) const;
@@ -54,11 +90,78 @@ namespace ana
 
     static int MaxID() {return fgNextID-1;}
 
+    /// Lookup or evaluate the result for the record of the current scope
+    bool CachedValue(const void* rec) const;
+
+    /// \brief \a chain, with the operands of its && or || evaluated in
+    /// whichever order turns out fastest
+    ///
+    /// The first \a nsamples records are used to profile the operands. Only
+    /// use this if all of them can be safely evaluated in any order (ie no
+    /// cut relies on an earlier one to guard against eg a missing
+    /// object). Anything other than a chain is returned unchanged.
+    static CutBase Adaptive(const CutBase& chain, int nsamples);
+
+    // Functors of the composites made by the operators above. They have
+    // names so that ExprProgram can find their operands.
+    class ShortCircuit;
+    class Not;
+    class AdaptiveChain;
+
+    /// \brief Operands of \a c, if it was made by &&, || or !, for \ref
+    /// ExprProgram
+    ///
+    /// \a b is null for !. False for anything else.
+    static bool Operands(const CutBase& c, const CutBase*& a, const CutBase*& b);
+
+    /// Start memoizing results for \a rec (or stop, if null) on this thread
+    static void SetCacheRecord(const void* rec);
+
+    /// \brief ID for a Cut with structure \a node
+    ///
+    /// The existing ID if there is one, otherwise a new one, recorded in the
+    /// \ref ExprGraph. Threadsafe.
+    static int InternID(const ExprGraph::Node& node);
+
     std::function<VoidCutFunc_t> fFunc;
+    std::function<VoidBatchCutFunc_t> fBatchFunc; ///< May be empty
     std::function<VoidExpoFunc_t> fLiveFunc, fPOTFunc;
 
     int fID;
     /// The next ID that hasn't yet been assigned
-    static int fgNextID;
+    static std::atomic<int> fgNextID;
+
+    /// Record of the innermost \ref CutCacheScope on this thread, if any
+    static thread_local const void* fgCacheRec;
+  };
+
+  /// \brief Evaluate each distinct Cut only once per record
+  ///
+  /// While one of these exists, calls on the same thread to any Cut with \a
+  /// rec are memoized by Cut ID. Because && and || give the same ID to the
+  /// same combinations, selections that share a common prefix (a && b && ...)
+  /// only evaluate that prefix once, and everything downstream of a prefix
+  /// that failed is skipped by the usual short-circuiting. Normally opened
+  /// by a \ref VarCacheScope.
+  ///
+  /// Results are keyed on the record's address alone. Anything that modifies
+  /// the record in place, such as applying a systematic shift, or restoring
+  /// it afterwards, must be followed by a new scope or a call to \ref
+  /// Invalidate, otherwise the unshifted results will be reused.
+  class CutCacheScope
+  {
+  public:
+    CutCacheScope(const void* rec);
+    ~CutCacheScope();
+
+    /// Forget all the results so far, because the record has changed. O(1)
+    void Invalidate();
+
+    CutCacheScope(const CutCacheScope&) = delete;
+    CutCacheScope& operator=(const CutCacheScope&) = delete;
+
+  protected:
+    /// Restored on destruction, to allow nesting
+    const void* fPrevRec;
   };
 } // namespace
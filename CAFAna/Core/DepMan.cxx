@@ -2,6 +2,7 @@
 
 #include "CAFAna/Core/UtilsExt.h" // DemangledTypeName()
 
+#include <atomic>
 #include <cassert>
 #include <cstdlib>
 #include <iostream>
@@ -37,42 +38,123 @@ namespace
   // The static for the DepMan singleton might be destroyed before various
   // classes which might then try to access it in their own destructors. Make
   // everything a no-op during shutdown.
-  bool gDuringShutdown = false;
+  std::atomic<bool> gDuringShutdown{false};
   void DepManAtExit(){gDuringShutdown = true;}
   const struct RegisterDepManAtExit
   {
     RegisterDepManAtExit(){atexit(DepManAtExit);}
   } gRegisterDepManAtExit;
+
+  double MilliSecs(std::chrono::steady_clock::duration d)
+  {
+    return std::chrono::duration<double, std::milli>(d).count();
+  }
 }
 
 namespace ana
 {
   // --------------------------------------------------------------------------
-  template<class T> DepMan<T>& DepMan<T>::Instance()
+  template<class T> DepMan<T>::DepMan()
+    : fActive(false), fDisabled(false), fNOps(0),
+      fReport(getenv("CAFANA_DEPMAN_REPORT") != 0), fReported(false),
+      fNConstructed(0), fNConstructedResolved(0)
+  {
+    UpdateActive();
+  }
+
+  // --------------------------------------------------------------------------
+  template<class T> DepMan<T>::~DepMan()
   {
-    // Avoid static order problems for the manager itself
-    static DepMan<T> dm;
-    return dm;
+    // Anything destroyed after us must not touch fNodes
+    fActive = false;
+  }
+
+  // --------------------------------------------------------------------------
+  template<class T> void DepMan<T>::UpdateActive()
+  {
+    fActive.store(!fDisabled && ((fReport && !fReported) || !fNodes.empty()),
+                  std::memory_order_relaxed);
   }
 
   // --------------------------------------------------------------------------
   template<class T> void DepMan<T>::Print()
   {
-    std::cout << "DepMan for "<< DemangledTypeName<T>() << " :\n";
     if(gDuringShutdown){
+      std::cout << "DepMan for "<< DemangledTypeName<T>() << " :\n";
       std::cout << "  Unable to print during shutdown" << std::endl;
     }
     else{
-      std::cout << "  assisted construction of " << fNOps << " objects. "
-                << fNodes.size() << " still awaiting construction."
+      PrintStats();
+    }
+  }
+
+  // --------------------------------------------------------------------------
+  template<class T> void DepMan<T>::PrintStats()
+  {
+    std::lock_guard<std::recursive_mutex> lock(fMutex);
+
+    std::cout << "DepMan for "<< DemangledTypeName<T>() << " :\n";
+    std::cout << "  assisted construction of " << fNOps << " objects. "
+              << fNodes.size() << " still awaiting construction."
+              << std::endl;
+
+    if(!fReport) return;
+
+    if(fReported){
+      std::cout << "  static construction of " << fNConstructedResolved
+                << " objects took " << MilliSecs(fResolvedTime - fFirstTime)
+                << " ms, from the first construction until the last dependency was resolved."
                 << std::endl;
     }
+    else if(fNConstructed == 0){
+      std::cout << "  no objects constructed" << std::endl;
+    }
+    else if(fNodes.empty()){
+      std::cout << "  " << fNConstructed << " objects constructed, none needing assistance" << std::endl;
+    }
+    else{
+      std::cout << "  " << fNConstructed << " objects constructed, dependencies never all resolved" << std::endl;
+    }
   }
 
   // --------------------------------------------------------------------------
-  template<class T> void DepMan<T>::RegisterConstruction(T* x)
+  template<class T> void DepMan<T>::ReportAtExit()
   {
-    if(fDisabled || gDuringShutdown) return;
+    // We're guaranteed to run before the manager is destroyed. Only needed
+    // if the dependencies never drained.
+    DepMan<T>& dm = Instance();
+    std::lock_guard<std::recursive_mutex> lock(dm.fMutex);
+    if(!dm.fReported) dm.PrintStats();
+  }
+
+  // --------------------------------------------------------------------------
+  template<class T> void DepMan<T>::Drained()
+  {
+    if(fReport && !fReported){
+      fResolvedTime = std::chrono::steady_clock::now();
+      fNConstructedResolved = fNConstructed;
+      fReported = true;
+
+      // This is most likely still during static initialization
+      const std::ios_base::Init init;
+      PrintStats();
+    }
+
+    UpdateActive();
+  }
+
+  // --------------------------------------------------------------------------
+  template<class T> void DepMan<T>::RegisterConstructionSlow(T* x)
+  {
+    if(gDuringShutdown) return;
+
+    std::lock_guard<std::recursive_mutex> lock(fMutex);
+
+    if(fDisabled) return;
+
+    if(fReport){
+      if(fNConstructed++ == 0) fFirstTime = std::chrono::steady_clock::now();
+    }
 
     ParentKids* xnode = maybe_find(fNodes, x);
     if(!xnode) return; // No record of us, nothing to do
@@ -86,17 +168,24 @@ namespace ana
     // Nor do we need to remember anything about this node anymore
     maybe_erase(fNodes, x);
 
+    // Counted first, in case the recursion drains the graph and reports
+    fNOps += kids.size();
+
     // Assign into all the kids that were depending on us. They in turn will
     // register their construction and so recurse into any grandkids.
     for(T* kid: kids) *kid = *x;
 
-    fNOps += kids.size();
+    if(fNodes.empty()) Drained();
   }
 
   // --------------------------------------------------------------------------
-  template<class T> void DepMan<T>::RegisterDestruction(T* x)
+  template<class T> void DepMan<T>::RegisterDestructionSlow(T* x)
   {
-    if(fDisabled || gDuringShutdown) return;
+    if(gDuringShutdown) return;
+
+    std::lock_guard<std::recursive_mutex> lock(fMutex);
+
+    if(fDisabled) return;
 
     ParentKids* xnode = maybe_find(fNodes, x);
     if(!xnode) return; // No record of us, nothing to do
@@ -115,28 +204,44 @@ namespace ana
     }
 
     fNodes.erase(x); // And finally forget this node in particular
+
+    if(fNodes.empty()) Drained();
   }
 
   // --------------------------------------------------------------------------
   template<class T> void DepMan<T>::
   RegisterDependency(const T* parent, T* child)
   {
-    if(fDisabled || gDuringShutdown) return;
+    if(gDuringShutdown) return;
+
+    std::lock_guard<std::recursive_mutex> lock(fMutex);
+
+    if(fDisabled) return;
 
     fNodes[child].parent = parent;
     fNodes[parent].kids.insert(child);
+
+    UpdateActive();
   }
 
   // --------------------------------------------------------------------------
   template<class T> void DepMan<T>::Disable()
   {
-    if(!gDuringShutdown) fDisabled = true;
+    if(gDuringShutdown) return;
+
+    std::lock_guard<std::recursive_mutex> lock(fMutex);
+    fDisabled = true;
+    UpdateActive();
   }
 
   // --------------------------------------------------------------------------
   template<class T> void DepMan<T>::Enable()
   {
-    if(!gDuringShutdown) fDisabled = false;
+    if(gDuringShutdown) return;
+
+    std::lock_guard<std::recursive_mutex> lock(fMutex);
+    fDisabled = false;
+    UpdateActive();
   }
 }
 
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -9,15 +13,41 @@ namespace ana
   /// \brief Deep magic to fix static initialization order. Here Be Dragons!
   ///
   /// Intended for internal use by Cut and Var only.
+  ///
+  /// Once every dependency is resolved, which is always the case by the time
+  /// static initialization is over, registering constructions and
+  /// destructions costs only a relaxed atomic load. What tracking there is is
+  /// safe to use from many threads.
+  ///
+  /// Set CAFANA_DEPMAN_REPORT to print how long static construction took. The
+  /// report is printed once, as soon as every dependency is first resolved,
+  /// normally at the end of static initialization. If that never happens it
+  /// is printed at exit instead.
   template<class T> class DepMan
   {
   public:
-    static DepMan& Instance();
+    static DepMan& Instance()
+    {
+      // Avoid static order problems for the manager itself
+      static DepMan<T> dm;
+      // Registered after dm is constructed, so runs before it's destroyed
+      static const bool report = dm.fReport && atexit(ReportAtExit) == 0;
+      (void)report;
+      return dm;
+    }
 
     /// Call from constructor (in the success case)
-    void RegisterConstruction(T* x);
+    void RegisterConstruction(T* x)
+    {
+      if(fActive.load(std::memory_order_relaxed)) RegisterConstructionSlow(x);
+    }
+
     /// Call from destructor
-    void RegisterDestruction(T* x);
+    void RegisterDestruction(T* x)
+    {
+      if(fActive.load(std::memory_order_relaxed)) RegisterDestructionSlow(x);
+    }
+
     /// Call from copy constructor and assignment operator
     void RegisterDependency(const T* parent, T* child);
 
@@ -27,7 +57,31 @@ namespace ana
     void Disable();
     void Enable();
   protected:
-    DepMan() : fDisabled(false), fNOps(0) {}
+    DepMan();
+    ~DepMan();
+
+    void RegisterConstructionSlow(T* x);
+    void RegisterDestructionSlow(T* x);
+
+    /// Decide whether the slow paths are needed. Call with fMutex held
+    void UpdateActive();
+
+    void PrintStats();
+    static void ReportAtExit();
+
+    /// Called whenever the last dependency goes away. Call with fMutex held
+    void Drained();
+
+    /// \brief Whether any tracking is needed at all
+    ///
+    /// Only ever set while there are dependencies waiting. They only arise
+    /// during static initialization, which is single-threaded, so a relaxed
+    /// load is enough.
+    std::atomic<bool> fActive;
+
+    /// Recursive, because resolving a dependency assigns into the child,
+    /// which registers its construction in turn
+    std::recursive_mutex fMutex;
 
     struct ParentKids{const T* parent; std::unordered_set<T*> kids;};
     std::unordered_map<const T*, ParentKids> fNodes;
@@ -35,5 +89,15 @@ namespace ana
     bool fDisabled;
 
     int fNOps;
+
+    /// Timing for CAFANA_DEPMAN_REPORT. Keeps the slow paths active until
+    /// the report is printed
+    bool fReport;
+    bool fReported;
+    typedef std::chrono::steady_clock::time_point Time_t;
+    Time_t fFirstTime;    ///< First construction
+    Time_t fResolvedTime; ///< Last time all dependencies were resolved
+    int fNConstructed;
+    int fNConstructedResolved; ///< Value of fNConstructed at fResolvedTime
   };
 }
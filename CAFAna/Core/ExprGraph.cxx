@@ -0,0 +1,329 @@
+#include "CAFAna/Core/ExprGraph.h"
+
+#include "CAFAna/Core/CutBase.h"
+#include "CAFAna/Core/VarBase.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+  const char* OpName(ana::ExprGraph::EOp op)
+  {
+    switch(op){
+    case ana::ExprGraph::kGreater:       return ">";
+    case ana::ExprGraph::kGreaterEquals: return ">=";
+    case ana::ExprGraph::kLess:          return "<";
+    case ana::ExprGraph::kLessEquals:    return "<=";
+    case ana::ExprGraph::kEquals:        return "==";
+    case ana::ExprGraph::kNotEquals:     return "!=";
+    default:                             return "?";
+    }
+  }
+}
+
+namespace ana
+{
+  //----------------------------------------------------------------------
+  ExprGraph& ExprGraph::Instance()
+  {
+    // Avoid static order problems for the graph itself
+    static ExprGraph g;
+    return g;
+  }
+
+  //----------------------------------------------------------------------
+  ExprGraph::Key ExprGraph::MakeKey(const Node& node)
+  {
+    uint64_t bits;
+    static_assert(sizeof(bits) == sizeof(node.c));
+    memcpy(&bits, &node.c, sizeof(bits));
+    return Key(std::make_tuple(int(node.op), node.a, node.b, bits), node.args);
+  }
+
+  //----------------------------------------------------------------------
+  int ExprGraph::Intern(const Node& node,
+                        std::vector<Entry>& entries,
+                        std::map<Key, int>& ids,
+                        std::map<Key, int>& seen,
+                        std::atomic<int>& nextID)
+  {
+    const bool leaf = node.op == kLeaf;
+    const Key key = leaf ? Key() : MakeKey(node);
+
+    if(!leaf){
+      auto it = seen.find(key);
+      if(it != seen.end()) return it->second;
+    }
+
+    std::lock_guard<std::mutex> lock(fMutex);
+
+    if(!leaf){
+      auto it = ids.find(key);
+      if(it != ids.end()){
+        seen.emplace(key, it->second);
+        return it->second;
+      }
+    }
+
+    // Still holding the lock, so no one else can add the same node first
+    const int id = nextID++;
+    if(id >= int(entries.size())) entries.resize(id+1);
+    entries[id].valid = true;
+    entries[id].node = node;
+
+    if(!leaf){
+      ids.emplace(key, id);
+      seen.emplace(key, id);
+    }
+    return id;
+  }
+
+  //----------------------------------------------------------------------
+  int ExprGraph::InternVar(const Node& node, std::atomic<int>& nextID)
+  {
+    // Entries are never removed or changed, so each thread can remember
+    // everything it has already looked up without any locking. Var and Cut
+    // IDs are separate, so they need separate caches.
+    thread_local std::map<Key, int> seen;
+    return Intern(node, fVars, fVarIDs, seen, nextID);
+  }
+
+  //----------------------------------------------------------------------
+  int ExprGraph::InternCut(const Node& node, std::atomic<int>& nextID)
+  {
+    // As above
+    thread_local std::map<Key, int> seen;
+    return Intern(node, fCuts, fCutIDs, seen, nextID);
+  }
+
+  //----------------------------------------------------------------------
+  ExprGraph::Node ExprGraph::VarNode(int id) const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    if(id < 0 || id >= int(fVars.size()) || !fVars[id].valid){
+      std::cout << "ExprGraph: no record of Var with ID " << id << std::endl;
+      abort();
+    }
+    return fVars[id].node;
+  }
+
+  //----------------------------------------------------------------------
+  ExprGraph::Node ExprGraph::CutNode(int id) const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    if(id < 0 || id >= int(fCuts.size()) || !fCuts[id].valid){
+      std::cout << "ExprGraph: no record of Cut with ID " << id << std::endl;
+      abort();
+    }
+    return fCuts[id].node;
+  }
+
+  //----------------------------------------------------------------------
+  ExprProgram::ExprProgram() : fGen(0), fRec(0)
+  {
+  }
+
+  //----------------------------------------------------------------------
+  int ExprProgram::AddVarOp(const VarBase& v)
+  {
+    const int id = v.ID();
+    auto it = fVarOps.find(id);
+    if(it != fVarOps.end()) return it->second;
+
+    Op op;
+    op.node = ExprGraph::Instance().VarNode(id);
+    const VarBase *a, *b;
+    if(op.node.op != ExprGraph::kLeaf && op.node.op != ExprGraph::kMapND &&
+       VarBase::Operands(v, a, b)){
+      op.node.a = AddVarOp(*a);
+      op.node.b = AddVarOp(*b);
+    }
+    else{
+      // Distinct leaves are distinct operations
+      op.node = {ExprGraph::kLeaf, id, -1, 0};
+      op.varFunc = v.fFunc;
+    }
+
+    const int idx = AddOp(std::move(op), false);
+    fVarOps[id] = idx;
+    return idx;
+  }
+
+  //----------------------------------------------------------------------
+  int ExprProgram::AddCutOp(const CutBase& c)
+  {
+    const int id = c.ID();
+    auto it = fCutOps.find(id);
+    if(it != fCutOps.end()) return it->second;
+
+    Op op;
+    op.node = ExprGraph::Instance().CutNode(id);
+    bool found = false;
+    switch(op.node.op){
+    case ExprGraph::kLeaf:
+      break;
+    case ExprGraph::kAnd:
+    case ExprGraph::kOr:
+    case ExprGraph::kNot:{
+      const CutBase *a, *b;
+      found = CutBase::Operands(c, a, b);
+      if(found){
+        op.node.a = AddCutOp(*a);
+        if(b) op.node.b = AddCutOp(*b);
+      }
+      break;
+    }
+    default:{ // comparisons
+      const VarBase *a, *b;
+      found = VarBase::Operands(c, a, b);
+      if(found){
+        op.node.a = AddVarOp(*a);
+        if(b) op.node.b = AddVarOp(*b);
+      }
+    }
+    }
+
+    if(!found){
+      // Leaves, and anything else we can't see inside (eg an Adaptive()
+      // chain) are evaluated as they are
+      op.node = {ExprGraph::kLeaf, id, -1, 0};
+      op.cutFunc = c.fFunc;
+    }
+
+    // Folding may reduce this to an existing op
+    const int alias = FoldCut(op.node);
+    const int idx = (alias >= 0) ? alias : AddOp(std::move(op), true);
+    fCutOps[id] = idx;
+    return idx;
+  }
+
+  //----------------------------------------------------------------------
+  int ExprProgram::FoldCut(const ExprGraph::Node& node) const
+  {
+    // Only identities that evaluate every comparison the original would, so
+    // that no NaN warnings are lost
+    switch(node.op){
+    case ExprGraph::kNot:{
+      const ExprGraph::Node& a = fOps[node.a].node;
+      if(a.op == ExprGraph::kNot) return a.a; // !!x
+      return -1;
+    }
+
+    case ExprGraph::kAnd:
+    case ExprGraph::kOr:
+      if(node.a == node.b) return node.a; // x && x, x || x
+      return -1;
+
+    default:
+      return -1;
+    }
+  }
+
+  //----------------------------------------------------------------------
+  int ExprProgram::AddOp(Op&& op, bool isCut)
+  {
+    // Leaves are keyed by their ID in the graph, so identical ops are
+    // identical expressions
+    const ExprGraph::Node& n = op.node;
+    uint64_t bits;
+    memcpy(&bits, &n.c, sizeof(bits));
+    const auto key = std::make_pair(isCut, std::make_tuple(int(n.op), n.a, n.b, bits));
+
+    auto it = fOpIndex.find(key);
+    if(it != fOpIndex.end()) return it->second;
+
+    const int idx = fOps.size();
+    fOps.push_back(std::move(op));
+    fVals.push_back(0);
+    fStamps.push_back(0);
+    fOpIndex[key] = idx;
+    return idx;
+  }
+
+  //----------------------------------------------------------------------
+  void ExprProgram::SetRecord(const void* rec)
+  {
+    fRec = rec;
+    if(++fGen == 0){
+      // Wrapped around. Make sure no ancient entries can match
+      std::fill(fStamps.begin(), fStamps.end(), 0);
+      fGen = 1;
+    }
+  }
+
+  //----------------------------------------------------------------------
+  double ExprProgram::VarValue(int idx)
+  {
+    return Eval(idx);
+  }
+
+  //----------------------------------------------------------------------
+  bool ExprProgram::CutValue(int idx)
+  {
+    return Eval(idx) != 0;
+  }
+
+  //----------------------------------------------------------------------
+  double ExprProgram::Eval(int idx)
+  {
+    if(fStamps[idx] == fGen) return fVals[idx];
+
+    const Op& op = fOps[idx];
+    const ExprGraph::Node& n = op.node;
+
+    double ret = 0;
+    switch(n.op){
+    case ExprGraph::kLeaf:
+    case ExprGraph::kMapND: // Always compiled as a leaf
+      ret = op.varFunc ? op.varFunc(fRec) : op.cutFunc(fRec);
+      break;
+
+    case ExprGraph::kPlus:  ret = Eval(n.a) + Eval(n.b); break;
+    case ExprGraph::kMinus: ret = Eval(n.a) - Eval(n.b); break;
+    case ExprGraph::kTimes: ret = Eval(n.a) * Eval(n.b); break;
+    case ExprGraph::kDivide:{
+      // Same as VarBase::operator/
+      const double denom = Eval(n.b);
+      ret = (denom != 0) ? Eval(n.a) / denom : 0.0;
+      break;
+    }
+
+    case ExprGraph::kGreater:
+    case ExprGraph::kGreaterEquals:
+    case ExprGraph::kLess:
+    case ExprGraph::kLessEquals:
+    case ExprGraph::kEquals:
+    case ExprGraph::kNotEquals:{
+      // Same warnings as ValHelper
+      const double a = Eval(n.a);
+      const double b = (n.b >= 0) ? Eval(n.b) : n.c;
+      if(n.b < 0 && std::isnan(a)){
+        std::cout << "Warning: Cut compares NaN " << OpName(n.op) << " " << b << std::endl;
+      }
+      if(n.b >= 0 && (std::isnan(a) || std::isnan(b))){
+        std::cout << "Warning: Cut compares " << a << " " << OpName(n.op) << " " << b << std::endl;
+      }
+      switch(n.op){
+      case ExprGraph::kGreater:       ret = a >  b; break;
+      case ExprGraph::kGreaterEquals: ret = a >= b; break;
+      case ExprGraph::kLess:          ret = a <  b; break;
+      case ExprGraph::kLessEquals:    ret = a <= b; break;
+      case ExprGraph::kEquals:        ret = a == b; break;
+      default:                        ret = a != b; break;
+      }
+      break;
+    }
+
+    case ExprGraph::kAnd: ret = Eval(n.a) != 0 && Eval(n.b) != 0; break;
+    case ExprGraph::kOr:  ret = Eval(n.a) != 0 || Eval(n.b) != 0; break;
+    case ExprGraph::kNot: ret = Eval(n.a) == 0; break;
+    }
+
+    fVals[idx] = ret;
+    fStamps[idx] = fGen;
+    return ret;
+  }
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "CAFAna/Core/FwdDeclare.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace ana
+{
+  class VarBase;
+  class CutBase;
+
+  /// \brief Record of how every Var and Cut was built
+  ///
+  /// Each distinct Var ID and Cut ID is a node. Composites remember their
+  /// operator, the IDs of their operands, and any constant, and structurally
+  /// identical composites are given the same ID. Leaves (and anything built
+  /// some other way) are just a new ID. Only the structure is kept, no
+  /// functions, so nothing that goes out of scope is kept alive. This is what
+  /// lets \ref ExprProgram see the sub-expressions shared between different
+  /// Vars and Cuts.
+  ///
+  /// Safe to use from many threads. Looking up a composite that a thread has
+  /// already seen doesn't take any lock.
+  ///
+  /// Intended for use by VarBase and CutBase only.
+  class ExprGraph
+  {
+  public:
+    enum EOp{
+      kLeaf,    ///< Opaque function
+
+      // Vars, of Vars a and b
+      kPlus, kMinus, kTimes, kDivide,
+
+      // Cuts, comparing Var a to Var b, or to constant c if b is negative
+      kGreater, kGreaterEquals, kLess, kLessEquals, kEquals, kNotEquals,
+
+      // Cuts, of Cuts a and b
+      kAnd, kOr, kNot,
+
+      /// Var mapping several Vars into one binned dimension, see \ref
+      /// LabelsAndBins::FindBin. Operands are in \a args
+      kMapND
+    };
+
+    struct Node
+    {
+      EOp op;
+      int a, b;
+      double c;
+      /// For kMapND, the Var IDs, then for each binning whether it's simple,
+      /// the number of edges, and the edges themselves
+      std::vector<double> args = {};
+    };
+
+    typedef double (VoidVarFunc_t)(const void* rec);
+    typedef bool (VoidCutFunc_t)(const void* rec);
+
+    static ExprGraph& Instance();
+
+    /// \brief ID for a Var with structure \a node
+    ///
+    /// For a composite, the same ID as any identical one made before. If
+    /// there isn't one (or it's a kLeaf), takes a new ID from \a nextID and
+    /// records \a node against it.
+    int InternVar(const Node& node, std::atomic<int>& nextID);
+    int InternCut(const Node& node, std::atomic<int>& nextID);
+
+    /// Structure of Var \a id. Aborts if it's unknown
+    Node VarNode(int id) const;
+    Node CutNode(int id) const;
+
+  protected:
+    ExprGraph() {}
+
+    /// Node with its constant as raw bits, so that NaNs compare equal
+    typedef std::pair<std::tuple<int, int, int, uint64_t>, std::vector<double>> Key;
+    static Key MakeKey(const Node& node);
+
+    struct Entry
+    {
+      bool valid = false;
+      Node node;
+    };
+
+    /// \a seen is the calling thread's cache of \a ids
+    int Intern(const Node& node,
+               std::vector<Entry>& entries,
+               std::map<Key, int>& ids,
+               std::map<Key, int>& seen,
+               std::atomic<int>& nextID);
+
+    /// Protects everything below
+    mutable std::mutex fMutex;
+
+    /// Indexed by ID
+    std::vector<Entry> fVars, fCuts;
+
+    std::map<Key, int> fVarIDs, fCutIDs;
+  };
+
+  /// \brief Evaluate a whole set of Vars and Cuts together, once per record
+  ///
+  /// Built up from all the Vars and Cuts an analysis needs. The operations of
+  /// all of them are compiled into one program, in which:
+  ///  - any sub-expression shared between them is only evaluated once
+  ///  - the identities !!a, a && a and a || a are folded away
+  ///  - nothing is evaluated until it's asked for, and the operands of && and
+  ///    || that can't affect the result are never evaluated
+  ///
+  /// The results are the same as calling each Var and Cut directly. So are
+  /// the warnings about comparisons with NaN, except that each distinct
+  /// comparison is only made, and so only warns, once per record.
+  ///
+  /// The program holds copies of the functions it needs, taken from the Vars
+  /// and Cuts passed in.
+  class ExprProgram
+  {
+  public:
+    ExprProgram();
+
+    /// \brief Include \a v in the program
+    ///
+    /// \return Index to pass to \ref VarValue to get its result
+    template<class T> int AddVar(const _Var<T>& v) {return AddVarOp(v);}
+    /// As \ref AddVar, for \ref CutValue
+    template<class RecT, class SpillT> int AddCut(const _Cut<RecT, SpillT>& c)
+    {
+      return AddCutOp(c);
+    }
+
+    /// Forget all values and start work on \a rec
+    void SetRecord(const void* rec);
+
+    /// Value for the current record, computed if not already known
+    double VarValue(int idx);
+    bool CutValue(int idx);
+
+    /// Number of distinct operations in the program
+    int NOps() const {return fOps.size();}
+
+  protected:
+    struct Op
+    {
+      ExprGraph::Node node; ///< Operands are indices into fOps
+      std::function<ExprGraph::VoidVarFunc_t> varFunc; ///< For Var leaves
+      std::function<ExprGraph::VoidCutFunc_t> cutFunc; ///< For Cut leaves
+    };
+
+    /// \brief Index of the op computing \a v, adding it if necessary
+    ///
+    /// Composites made by the usual operators are broken down into their
+    /// operands. Anything else is a leaf, evaluated by its own function.
+    int AddVarOp(const VarBase& v);
+    int AddCutOp(const CutBase& c);
+
+    /// Add \a op, unless an identical one exists already
+    int AddOp(Op&& op, bool isCut);
+
+    /// \brief Simplify cut \a node (with operands already as indices), if
+    /// possible
+    ///
+    /// \return Index of an existing op it's equivalent to, or -1
+    int FoldCut(const ExprGraph::Node& node) const;
+
+    double Eval(int idx);
+
+    std::vector<Op> fOps;
+    /// Results for the current record, valid if the stamp matches fGen
+    std::vector<double> fVals;
+    std::vector<unsigned int> fStamps;
+    unsigned int fGen;
+    const void* fRec;
+
+    /// Map from Var and Cut IDs to op indices
+    std::map<int, int> fVarOps, fCutOps;
+    /// (isCut, op, a, b, c) to op indices, for the structural deduplication
+    std::map<std::pair<bool, std::tuple<int, int, int, uint64_t>>, int> fOpIndex;
+  };
+}
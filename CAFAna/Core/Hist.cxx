@@ -4,15 +4,174 @@
 #include "CAFAna/Core/UtilsExt.h"
 
 #include "CAFAna/Core/Stan.h"
+#include "CAFAna/Core/ThreadLocal.h"
+#include "CAFAna/Core/ThreadPool.h"
 
 #include "TH1.h"
 #include "THnSparse.h"
 
 #include "TDirectory.h"
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <unordered_map>
+
 namespace
 {
   namespace util{template<class T> T sqr(const T& x){return x*x;}}
+
+  Eigen::ArrayXd ToDense(const Eigen::SparseVector<double>& v)
+  {
+    return Eigen::VectorXd(v).array();
+  }
+
+  // Autodiff operations on whole vectors. Each is a single node on the tape,
+  // with the adjoints computed in one go by vector operations. Anything the
+  // reverse pass needs is copied onto the stan arena (heap-allocated Eigen
+  // objects captured in the callbacks would never be freed).
+
+  using ana::StanVector;
+  using stan::math::arena_t;
+  using stan::math::make_callback_var;
+
+  /// Collect per-bin vars into a single node
+  StanVector ToStanVector(const Eigen::ArrayXstan& xs)
+  {
+    arena_t<Eigen::VectorXstan> arena_xs = xs.matrix();
+    Eigen::VectorXd vals(xs.size());
+    for(int i = 0; i < xs.size(); ++i) vals[i] = xs[i].val();
+
+    return make_callback_var(vals, [arena_xs](auto& vi) mutable
+    {
+      for(int i = 0; i < arena_xs.size(); ++i) arena_xs[i].adj() += vi.adj()[i];
+    });
+  }
+
+  /// Per-bin vars that pass their adjoints back to \a v
+  Eigen::ArrayXstan ToStanBins(const StanVector& v)
+  {
+    arena_t<Eigen::VectorXstan> bins(v.size());
+    // These are leaves, they don't need to go on the chain stack
+    for(int i = 0; i < v.size(); ++i) bins[i] = new stan::math::vari(v.val()[i], false);
+
+    stan::math::reverse_pass_callback([v, bins]() mutable
+    {
+      for(int i = 0; i < bins.size(); ++i) v.adj()[i] += bins[i].adj();
+    });
+
+    return bins.array();
+  }
+
+  /// s*v + c
+  StanVector Affine(const StanVector& v, double s, const Eigen::ArrayXd& c)
+  {
+    return make_callback_var(Eigen::VectorXd(s * v.val() + c.matrix()), [v, s](auto& vi) mutable
+    {
+      v.adj() += s * vi.adj();
+    });
+  }
+
+  /// s*v
+  StanVector Times(const StanVector& v, double s)
+  {
+    return make_callback_var(Eigen::VectorXd(s * v.val()), [v, s](auto& vi) mutable
+    {
+      v.adj() += s * vi.adj();
+    });
+  }
+
+  /// s*v
+  StanVector Times(const StanVector& v, const stan::math::var& s)
+  {
+    return make_callback_var(Eigen::VectorXd(s.val() * v.val()), [v, s](auto& vi) mutable
+    {
+      v.adj() += s.val() * vi.adj();
+      s.adj() += vi.adj().dot(v.val());
+    });
+  }
+
+  /// s*x
+  StanVector Times(const Eigen::ArrayXd& x, const stan::math::var& s)
+  {
+    arena_t<Eigen::VectorXd> arena_x = x.matrix();
+    return make_callback_var(Eigen::VectorXd(s.val() * arena_x), [arena_x, s](auto& vi) mutable
+    {
+      s.adj() += vi.adj().dot(arena_x);
+    });
+  }
+
+  /// a + s*b
+  StanVector Plus(const StanVector& a, const StanVector& b, double s)
+  {
+    return make_callback_var(Eigen::VectorXd(a.val() + s * b.val()), [a, b, s](auto& vi) mutable
+    {
+      a.adj() += vi.adj();
+      b.adj() += s * vi.adj();
+    });
+  }
+
+  /// a*b elementwise
+  StanVector Product(const StanVector& a, const StanVector& b)
+  {
+    return make_callback_var(Eigen::VectorXd(a.val().cwiseProduct(b.val())), [a, b](auto& vi) mutable
+    {
+      a.adj() += vi.adj().cwiseProduct(b.val());
+      b.adj() += vi.adj().cwiseProduct(a.val());
+    });
+  }
+
+  /// a*b elementwise
+  StanVector Product(const StanVector& a, const Eigen::ArrayXd& b)
+  {
+    arena_t<Eigen::VectorXd> arena_b = b.matrix();
+    return make_callback_var(Eigen::VectorXd(a.val().cwiseProduct(arena_b)), [a, arena_b](auto& vi) mutable
+    {
+      a.adj() += vi.adj().cwiseProduct(arena_b);
+    });
+  }
+
+  /// a/b elementwise
+  StanVector Quotient(const StanVector& a, const StanVector& b)
+  {
+    return make_callback_var(Eigen::VectorXd(a.val().cwiseQuotient(b.val())), [a, b](auto& vi) mutable
+    {
+      a.adj() += vi.adj().cwiseQuotient(b.val());
+      b.adj() -= vi.adj().cwiseProduct(vi.val()).cwiseQuotient(b.val());
+    });
+  }
+
+  /// a/b elementwise
+  StanVector Quotient(const StanVector& a, const Eigen::ArrayXd& b)
+  {
+    arena_t<Eigen::VectorXd> arena_b = b.matrix();
+    return make_callback_var(Eigen::VectorXd(a.val().cwiseQuotient(arena_b)), [a, arena_b](auto& vi) mutable
+    {
+      a.adj() += vi.adj().cwiseQuotient(arena_b);
+    });
+  }
+
+  /// a/b elementwise
+  StanVector Quotient(const Eigen::ArrayXd& a, const StanVector& b)
+  {
+    return make_callback_var(Eigen::VectorXd(a.matrix().cwiseQuotient(b.val())), [b](auto& vi) mutable
+    {
+      b.adj() -= vi.adj().cwiseProduct(vi.val()).cwiseQuotient(b.val());
+    });
+  }
+
+  /// Replace the entries of \a v selected by \a mask with one. Used to keep
+  /// the derivatives of 0/0 = 0 finite
+  StanVector OneWhere(const StanVector& v, const Eigen::Array<bool, Eigen::Dynamic, 1>& mask)
+  {
+    arena_t<Eigen::VectorXd> keep = (!mask).cast<double>().matrix();
+    return make_callback_var(Eigen::VectorXd(mask.select(1., v.val().array())), [v, keep](auto& vi) mutable
+    {
+      v.adj() += vi.adj().cwiseProduct(keep);
+    });
+  }
+
+  const uint32_t kMaxCount = std::numeric_limits<uint32_t>::max();
 }
 
 class StatErrorsEnabled
@@ -33,7 +192,7 @@ protected:
 namespace ana
 {
   //----------------------------------------------------------------------
-  Hist::Hist() : fType(kUninitialized), fSqrtErrs(false)
+  Hist::Hist() : fType(kUninitialized), fScale(1), fSqrtErrs(false), fDenseFillFrac(0)
   {
   }
 
@@ -57,19 +216,57 @@ namespace ana
     return ret;
   }
 
+  //----------------------------------------------------------------------
+  Hist Hist::ZeroFloat(int nbins)
+  {
+    Hist ret;
+    ret.fType = kDenseFloat;
+    ret.fDataFloat = Eigen::ArrayXf::Zero(nbins+2);
+    ret.fSqrtErrs = true;
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  Hist Hist::ZeroCount(int nbins)
+  {
+    Hist ret;
+    ret.fType = kDenseCount;
+    ret.fDataCount.setZero(nbins+2);
+    ret.fSqrtErrs = true;
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  Hist Hist::ZeroAdaptive(int nbins, double fillFrac)
+  {
+    assert(fillFrac > 0);
+    Hist ret = ZeroSparse(nbins);
+    ret.fDenseFillFrac = fillFrac;
+    return ret;
+  }
+
   //----------------------------------------------------------------------
   Hist::Hist(const Hist& rhs)
     : Hist()
   {
     assert(rhs.Initialized());
+    assert(!rhs.fConcurrent);
 
     fType = rhs.fType;
     // Only one of these will actually have contents
     fDataSparse = rhs.fDataSparse;
+    fSumSqSparse = rhs.fSumSqSparse;
+    fSparseBuffer = rhs.fSparseBuffer;
     fDataStan   = rhs.fDataStan;
+    fDataStanBins = rhs.fDataStanBins;
     fData       = rhs.fData;
     fSumSq      = rhs.fSumSq;
+    fDataFloat  = rhs.fDataFloat;
+    fSumSqFloat = rhs.fSumSqFloat;
+    fDataCount  = rhs.fDataCount;
+    fScale      = rhs.fScale;
     fSqrtErrs   = rhs.fSqrtErrs;
+    fDenseFillFrac = rhs.fDenseFillFrac;
   }
 
   //----------------------------------------------------------------------
@@ -77,13 +274,22 @@ namespace ana
     : Hist()
   {
     assert(rhs.Initialized());
+    assert(!rhs.fConcurrent);
 
     fType = rhs.fType;
     std::swap(fDataSparse, rhs.fDataSparse);
+    std::swap(fSumSqSparse, rhs.fSumSqSparse);
+    std::swap(fSparseBuffer, rhs.fSparseBuffer);
     std::swap(fDataStan,   rhs.fDataStan);
+    std::swap(fDataStanBins, rhs.fDataStanBins);
     std::swap(fData,       rhs.fData);
     std::swap(fSumSq,      rhs.fSumSq);
+    std::swap(fDataFloat,  rhs.fDataFloat);
+    std::swap(fSumSqFloat, rhs.fSumSqFloat);
+    std::swap(fDataCount,  rhs.fDataCount);
+    fScale = rhs.fScale;
     fSqrtErrs = rhs.fSqrtErrs;
+    fDenseFillFrac = rhs.fDenseFillFrac;
   }
 
   //----------------------------------------------------------------------
@@ -94,13 +300,22 @@ namespace ana
     DontAddDirectory guard;
 
     assert(rhs.Initialized());
+    assert(!fConcurrent && !rhs.fConcurrent);
 
     fType = rhs.fType;
     fDataSparse = rhs.fDataSparse;
+    fSumSqSparse = rhs.fSumSqSparse;
+    fSparseBuffer = rhs.fSparseBuffer;
     fDataStan   = rhs.fDataStan;
+    fDataStanBins = rhs.fDataStanBins;
     fData       = rhs.fData;
     fSumSq      = rhs.fSumSq;
+    fDataFloat  = rhs.fDataFloat;
+    fSumSqFloat = rhs.fSumSqFloat;
+    fDataCount  = rhs.fDataCount;
+    fScale      = rhs.fScale;
     fSqrtErrs   = rhs.fSqrtErrs;
+    fDenseFillFrac = rhs.fDenseFillFrac;
 
     return *this;
   }
@@ -111,13 +326,22 @@ namespace ana
     if(this == &rhs) return *this;
 
     assert(rhs.Initialized());
+    assert(!fConcurrent && !rhs.fConcurrent);
 
     fType = rhs.fType;
     std::swap(fDataSparse, rhs.fDataSparse);
+    std::swap(fSumSqSparse, rhs.fSumSqSparse);
+    std::swap(fSparseBuffer, rhs.fSparseBuffer);
     std::swap(fDataStan,   rhs.fDataStan);
+    std::swap(fDataStanBins, rhs.fDataStanBins);
     std::swap(fData,       rhs.fData);
     std::swap(fSumSq,      rhs.fSumSq);
+    std::swap(fDataFloat,  rhs.fDataFloat);
+    std::swap(fSumSqFloat, rhs.fSumSqFloat);
+    std::swap(fDataCount,  rhs.fDataCount);
+    fScale = rhs.fScale;
     fSqrtErrs = rhs.fSqrtErrs;
+    fDenseFillFrac = rhs.fDenseFillFrac;
 
     return *this;
   }
@@ -140,11 +364,40 @@ namespace ana
   Hist Hist::AdoptStan(Eigen::ArrayXstan&& v)
   {
     Hist ret;
-    ret.fType = kDenseStan;
-    ret.fDataStan = std::move(v);
+    ret.SetStan(ToStanVector(v));
+    // These are still valid as the individual bins
+    ret.fDataStanBins = std::move(v);
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  Hist Hist::AdoptStan(StanVector&& v)
+  {
+    Hist ret;
+    ret.SetStan(std::move(v));
     return ret;
   }
 
+  //----------------------------------------------------------------------
+  void Hist::SetStan(StanVector&& v)
+  {
+    fType = kDenseStan;
+    fDataStan = std::move(v);
+    fDataStanBins.resize(0);
+
+    // Errors are stored densely alongside
+    if(fSumSqSparse.size() > 0) fSumSq = ToDense(fSumSqSparse);
+    fSumSqSparse.resize(0);
+  }
+
+  //----------------------------------------------------------------------
+  Eigen::ArrayXstan Hist::GetEigenStan() const
+  {
+    assert(fType == kDenseStan);
+    if(fDataStanBins.size() > 0) return fDataStanBins;
+    return ToStanBins(fDataStan);
+  }
+
   //----------------------------------------------------------------------
   Hist Hist::Adopt(Eigen::ArrayXd&& v)
   {
@@ -154,6 +407,182 @@ namespace ana
     return ret;
   }
 
+  //----------------------------------------------------------------------
+  Eigen::ArrayXd Hist::GetEigen(double s) const
+  {
+    switch(fType){
+    case kDense:      return (s * fScale) * fData;
+      // eg an adaptive Hist that hasn't reached its dense threshold yet
+    case kSparse:{
+      Eigen::SparseVector<double> tmp;
+      return (s * fScale) * ToDense(MergedSparse(tmp));
+    }
+    case kDenseFloat: return s * fDataFloat.cast<double>();
+    case kDenseCount: return s * fDataCount.cast<double>();
+    default:
+      assert(false);
+      abort();
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::AdaptStorage()
+  {
+    if(fDenseFillFrac <= 0) return;
+
+    if(fType == kSparse){
+      const double limit = fDenseFillFrac * fDataSparse.size();
+
+      // Every buffered entry is a distinct bin, so this alone proves we're
+      // over the limit
+      if(fSparseBuffer.size() > limit){SparseToDense(); return;}
+
+      // We might be over. Only pay for the merge to find out once a decent
+      // number of new entries have built up.
+      if(fDataSparse.nonZeros() + fSparseBuffer.size() > limit &&
+         fSparseBuffer.size() > limit/8) FlushSparse();
+
+      if(fSparseBuffer.empty() && fDataSparse.nonZeros() > limit) SparseToDense();
+    }
+
+    if(fType == kDense){
+      // Hysteresis, so we don't keep flipping back and forth
+      if((fData != 0).count() < fDenseFillFrac/2 * fData.size()) DenseToSparse();
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::SparseToDense()
+  {
+    assert(fType == kSparse);
+
+    FlushSparse();
+    fData = Eigen::ArrayXd(Eigen::VectorXd(fDataSparse));
+    fDataSparse = Eigen::SparseVector<double>();
+    if(fSumSqSparse.size() > 0) fSumSq = ToDense(fSumSqSparse);
+    fSumSqSparse = Eigen::SparseVector<double>();
+    fType = kDense;
+
+    // Adopted or loaded contents may have no errors. But in this special
+    // case we know
+    if(gStatErrs && fSumSq.size() == 0 && fSqrtErrs) fSumSq = fData;
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::DenseToSparse()
+  {
+    assert(fType == kDense);
+
+    fDataSparse = fData.matrix().sparseView();
+    fData.resize(0);
+    if(fSumSq.size() > 0) fSumSqSparse = fSumSq.matrix().sparseView();
+    fSumSq.resize(0);
+    fType = kSparse;
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::FlushSparse()
+  {
+    if(fSparseBuffer.empty()) return;
+
+    Eigen::SparseVector<double> merged;
+    MergedSparse(merged);
+    fDataSparse = std::move(merged);
+
+    if(fSumSqSparse.size() > 0){
+      Eigen::SparseVector<double> mergedSumSq;
+      MergedSparse(mergedSumSq, true);
+      fSumSqSparse = std::move(mergedSumSq);
+    }
+
+    fSparseBuffer.clear();
+  }
+
+  //----------------------------------------------------------------------
+  const Eigen::SparseVector<double>& Hist::
+  MergedSparse(Eigen::SparseVector<double>& merged, bool sumsq) const
+  {
+    const Eigen::SparseVector<double>& stored = sumsq ? fSumSqSparse : fDataSparse;
+
+    // Nothing to do, or errors aren't enabled
+    if(fSparseBuffer.empty() || stored.size() == 0) return stored;
+
+    std::vector<std::pair<int, double>> pending;
+    pending.reserve(fSparseBuffer.size());
+    for(auto it: fSparseBuffer) pending.emplace_back(it.first, sumsq ? it.second.w2 : it.second.w);
+    std::sort(pending.begin(), pending.end());
+
+    // Merge the two sorted lists, so that every insertion is at the end
+    merged = Eigen::SparseVector<double>(stored.size());
+    merged.reserve(stored.nonZeros() + pending.size());
+
+    Eigen::SparseVector<double>::InnerIterator it(stored);
+    auto pit = pending.begin();
+    while(it || pit != pending.end()){
+      if(pit == pending.end() || (it && it.index() < pit->first)){
+        merged.insertBack(it.index()) = it.value();
+        ++it;
+      }
+      else if(!it || pit->first < it.index()){
+        merged.insertBack(pit->first) = pit->second;
+        ++pit;
+      }
+      else{
+        merged.insertBack(it.index()) = it.value() + pit->second;
+        ++it;
+        ++pit;
+      }
+    }
+
+    return merged;
+  }
+
+  //----------------------------------------------------------------------
+  double Hist::SparseCoeff(int i, bool sumsq) const
+  {
+    auto it = fSparseBuffer.find(i);
+    if(sumsq) return fSumSqSparse.coeff(i) + (it == fSparseBuffer.end() ? 0 : it->second.w2);
+    return fDataSparse.coeff(i) + (it == fSparseBuffer.end() ? 0 : it->second.w);
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::ApplyScale()
+  {
+    if(fScale == 1) return;
+
+    FlushSparse();
+
+    switch(fType){
+    case kSparse: fDataSparse *= fScale; fSumSqSparse *= fScale; break;
+    case kDense:  fData       *= fScale; fSumSq       *= fScale; break;
+    default: abort(); // unreachable
+    }
+
+    fScale = 1;
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::ToDouble()
+  {
+    if(fType == kDenseFloat){
+      fData = fDataFloat.cast<double>();
+      if(fSumSqFloat.size() > 0) fSumSq = fSumSqFloat.cast<double>();
+    }
+    else if(fType == kDenseCount){
+      fData = fDataCount.cast<double>();
+      // Every entry so far had unit weight
+      if(gStatErrs) fSumSq = fData;
+    }
+    else{
+      return; // nothing to do
+    }
+
+    fType = kDense;
+    fDataFloat.resize(0);
+    fSumSqFloat.resize(0);
+    fDataCount.resize(0);
+  }
+
   //----------------------------------------------------------------------
   Hist Hist::FromDirectory(TDirectory* dir)
   {
@@ -184,6 +613,8 @@ namespace ana
 
       ret.fDataSparse.resize(nbins);
       ret.fDataSparse.setZero();
+      // Random-order insertion into the SparseVector would be quadratic
+      ret.fSparseBuffer.reserve(hSparse->GetNbins());
       for(int i = 0; i < hSparse->GetNbins(); ++i){
         int idx[N];
         const double y = hSparse->GetBinContent(i, idx);
@@ -193,7 +624,7 @@ namespace ana
           mult *= hSparse->GetAxis(d-1)->GetNbins()+2;
           idx1d += mult*idx[d];
         }
-        ret.fDataSparse.coeffRef(idx1d) = y;
+        ret.fSparseBuffer[idx1d].w += y;
       }
     }
 
@@ -204,22 +635,31 @@ namespace ana
   }
 
   //----------------------------------------------------------------------
-  TH1D* Hist::ToTH1(const Binning& bins) const
+  TH1D* Hist::ToTH1(const Binning& bins, double scale) const
   {
     assert(Initialized());
 
+    Eigen::SparseVector<double> tmp;
+    const Eigen::SparseVector<double>& sparse = (fType == kSparse) ? MergedSparse(tmp) : fDataSparse;
+
     TH1D* ret = MakeTH1D(UniqueName().c_str(), "", bins);
 
+    // Scaling the contents scales the errors by the same amount, like
+    // TH1::Scale()
+    const double s = scale * fScale;
+
     for(int i = 0; i < bins.NBins()+2; ++i){
       switch(fType){
-      case kDense:     ret->SetBinContent(i, fData[i]); break;
-      case kDenseStan: ret->SetBinContent(i, fDataStan[i].val()); break;
+      case kDense:     ret->SetBinContent(i, s * fData[i]); break;
+      case kDenseStan: ret->SetBinContent(i, s * fDataStan.val()[i]); break;
         // Interface requires returning literally a TH1D in any case
-      case kSparse:    ret->SetBinContent(i, fDataSparse.coeff(i)); break;
+      case kSparse:    ret->SetBinContent(i, s * sparse.coeff(i)); break;
+      case kDenseFloat: ret->SetBinContent(i, s * fDataFloat[i]); break;
+      case kDenseCount: ret->SetBinContent(i, s * fDataCount[i]); break;
       default:
         abort(); // unreachable
       }
-      if(fSumSq.size() > 0  || fSqrtErrs) ret->SetBinError(i, GetBinError(i));
+      if(fSumSq.size() > 0 || fSumSqFloat.size() > 0 || fSumSqSparse.size() > 0 || fSqrtErrs) ret->SetBinError(i, std::abs(scale) * GetBinError(i));
     }
     return ret;
   }
@@ -233,6 +673,8 @@ namespace ana
     case kSparse:    return fDataSparse.size()-2;
     case kDenseStan: return fDataStan  .size()-2;
     case kDense:     return fData      .size()-2;
+    case kDenseFloat: return fDataFloat.size()-2;
+    case kDenseCount: return fDataCount.size()-2;
     default: abort(); // unreachable
     }
   }
@@ -243,7 +685,9 @@ namespace ana
     assert(Initialized());
 
     if(fSqrtErrs) return sqrt(GetBinContent(i));
-    if(fSumSq.size() > 0) return sqrt(fSumSq[i]);
+    if(fSumSq.size() > 0) return sqrt(fScale * fSumSq[i]);
+    if(fSumSqSparse.size() > 0) return sqrt(fScale * SparseCoeff(i, true));
+    if(fSumSqFloat.size() > 0) return sqrt(double(fSumSqFloat[i]));
 
     return 0;
   }
@@ -253,87 +697,464 @@ namespace ana
   {
     assert(Initialized());
 
+    double pending = 0;
+    for(auto it: fSparseBuffer) pending += it.second.w;
+
     switch(fType){
-    case kSparse:    return fDataSparse.sum();
-    case kDenseStan: return fDataStan  .sum().val();
-    case kDense:     return fData      .sum();
+    case kSparse:    return fScale * (fDataSparse.sum() + pending);
+    case kDenseStan: return fDataStan.val().sum();
+    case kDense:     return fScale * fData.sum();
+      // Sum in double precision
+    case kDenseFloat: return fDataFloat.cast<double>().sum();
+    case kDenseCount: return fDataCount.cast<double>().sum();
     default: abort(); // unreachable
     }
   }
 
+  //----------------------------------------------------------------------
+  bool Hist::Empty() const
+  {
+    assert(Initialized());
+
+    if(fScale == 0) return true;
+
+    Eigen::SparseVector<double> tmp;
+
+    // any() returns as soon as it finds a non-zero bin
+    switch(fType){
+    case kSparse:    return !(MergedSparse(tmp).coeffs() != 0).any();
+    case kDenseStan: return !(fDataStan.val().array() != 0).any();
+    case kDense:     return !(fData != 0).any();
+    case kDenseFloat: return !(fDataFloat != 0).any();
+    case kDenseCount: return !(fDataCount != 0).any();
+    default: abort(); // unreachable
+    }
+  }
+
+  //----------------------------------------------------------------------
+  /// Interface for the various ways of filling from multiple threads
+  class Hist::ConcurrentFill
+  {
+  public:
+    virtual ~ConcurrentFill() {}
+
+    virtual void FillBin(int bin, double w) = 0;
+
+    virtual void FillN(const std::vector<int>& bins,
+                       const std::vector<double>& ws)
+    {
+      for(unsigned int i = 0; i < bins.size(); ++i) FillBin(bins[i], ws[i]);
+    }
+
+    /// Add everything accumulated so far into \a h
+    virtual void MergeInto(Hist& h) = 0;
+  };
+
+  //----------------------------------------------------------------------
+  /// Each thread fills its own private copy of the bins, and these are
+  /// summed at the end. No contention, at the cost of memory per thread
+  class Hist::ShardedFill: public Hist::ConcurrentFill
+  {
+  public:
+    ShardedFill(bool sparse, int size) : fSparse(sparse), fSize(size) {}
+
+    void FillBin(int bin, double w) override
+    {
+      Shard& s = GetShard();
+      if(w != 1) s.sqrtErrs = false;
+      if(fSparse){
+        SparseFill& f = s.sparse[bin];
+        f.w += w;
+        if(gStatErrs) f.w2 += w*w;
+      }
+      else{
+        s.data[bin] += w;
+        if(gStatErrs) s.sumsq[bin] += w*w;
+      }
+    }
+
+    void FillN(const std::vector<int>& bins,
+               const std::vector<double>& ws) override
+    {
+      // Only look up this thread's shard once for the whole batch
+      Shard& s = GetShard();
+      const unsigned int N = bins.size();
+      for(unsigned int i = 0; i < N; ++i){
+        const double w = ws[i];
+        if(w != 1) s.sqrtErrs = false;
+        if(fSparse){
+          SparseFill& f = s.sparse[bins[i]];
+          f.w += w;
+          if(gStatErrs) f.w2 += w*w;
+        }
+        else{
+          s.data[bins[i]] += w;
+          if(gStatErrs) s.sumsq[bins[i]] += w*w;
+        }
+      }
+    }
+
+    void MergeInto(Hist& h) override
+    {
+      fShards.ForEach([&h](Shard& s)
+                      {
+                        if(!s.sqrtErrs) h.fSqrtErrs = false;
+
+                        if(!s.sparse.empty() && gStatErrs && h.fSumSqSparse.size() == 0) h.fSumSqSparse.resize(h.fDataSparse.size());
+                        for(auto it: s.sparse){
+                          SparseFill& f = h.fSparseBuffer[it.first];
+                          f.w += it.second.w;
+                          f.w2 += it.second.w2;
+                        }
+
+                        if(s.data.size() == 0) return;
+
+                        // The shards accumulate in double precision, but are
+                        // added into the storage in its own
+                        if(h.fType == kDenseCount){
+                          // Only possible if every entry had unit weight,
+                          // and no bin overflows
+                          if(s.sqrtErrs && (h.fDataCount.cast<double>() + s.data).maxCoeff() <= kMaxCount){
+                            h.fDataCount += s.data.cast<uint32_t>();
+                            return;
+                          }
+                          h.ToDouble();
+                        }
+                        if(h.fType == kDenseFloat){
+                          h.fDataFloat += s.data.cast<float>();
+                          if(s.sumsq.size() > 0){
+                            if(h.fSumSqFloat.size() == 0) h.fSumSqFloat = Eigen::ArrayXf::Zero(h.fDataFloat.size());
+                            h.fSumSqFloat += s.sumsq.cast<float>();
+                          }
+                          return;
+                        }
+
+                        h.fData += s.data;
+                        if(s.sumsq.size() > 0){
+                          if(h.fSumSq.size() == 0) h.fSumSq = Eigen::ArrayXd::Zero(h.fData.size());
+                          h.fSumSq += s.sumsq;
+                        }
+                      });
+    }
+
+  protected:
+    struct Shard
+    {
+      Eigen::ArrayXd data, sumsq;
+      std::unordered_map<int, SparseFill> sparse;
+      bool sqrtErrs = true;
+    };
+
+    Shard& GetShard()
+    {
+      Shard* s = fShards.operator->();
+      if(!fSparse && s->data.size() == 0){
+        s->data = Eigen::ArrayXd::Zero(fSize);
+        if(gStatErrs) s->sumsq = Eigen::ArrayXd::Zero(fSize);
+      }
+      return *s;
+    }
+
+    bool fSparse;
+    int fSize;
+    ThreadLocal<Shard> fShards;
+  };
+
+  //----------------------------------------------------------------------
+  /// All threads fill the same set of bins, using atomic additions. No extra
+  /// memory, but threads hitting the same bin will slow each other
+  class Hist::AtomicFill: public Hist::ConcurrentFill
+  {
+  public:
+    /// Updates \a data, and \a sumsq if not null, in place
+    AtomicFill(double* data, double* sumsq)
+      : fData(data), fSumSq(sumsq), fSqrtErrs(true)
+    {
+    }
+
+    void FillBin(int bin, double w) override
+    {
+      // Check first, to avoid every thread writing to this cache line
+      if(w != 1 && fSqrtErrs.load(std::memory_order_relaxed))
+        fSqrtErrs.store(false, std::memory_order_relaxed);
+
+      AtomicAdd(fData[bin], w);
+      if(fSumSq) AtomicAdd(fSumSq[bin], w*w);
+    }
+
+    void MergeInto(Hist& h) override
+    {
+      // The bins themselves are already filled
+      if(!fSqrtErrs) h.fSqrtErrs = false;
+    }
+
+  protected:
+    /// There's no std::atomic_ref until C++20. The compiler builtins can
+    /// update a plain double atomically instead.
+    static void AtomicAdd(double& x, double w)
+    {
+      double old, sum;
+      __atomic_load(&x, &old, __ATOMIC_RELAXED);
+      do{
+        sum = old + w;
+      } while(!__atomic_compare_exchange(&x, &old, &sum, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    double* fData;
+    double* fSumSq;
+    std::atomic<bool> fSqrtErrs;
+  };
+
   //----------------------------------------------------------------------
   void Hist::Fill(const Binning& bins, double x, double w)
+  {
+    FillBin(bins.FindBin(x), w);
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::FillBin(int bin, double w)
   {
     assert(Initialized());
 
+    if(fConcurrent){fConcurrent->FillBin(bin, w); return;}
+
+    if(fScale != 1) ApplyScale();
+
+    // Counts can only represent unweighted entries
+    if(fType == kDenseCount && (w != 1 || fDataCount[bin] == kMaxCount)) ToDouble();
+
     if(w != 1) fSqrtErrs = false;
 
-    if(fType == kDense && gStatErrs && fSumSq.size() == 0) fSumSq.resize(fData.size());
+    // Errors are stored the same way as the contents
+    if(fType == kDense && gStatErrs && fSumSq.size() == 0) fSumSq = Eigen::ArrayXd::Zero(fData.size());
+    if(fType == kSparse && gStatErrs && fSumSqSparse.size() == 0) fSumSqSparse.resize(fDataSparse.size());
+    if(fType == kDenseFloat && gStatErrs && fSumSqFloat.size() == 0) fSumSqFloat = Eigen::ArrayXf::Zero(fDataFloat.size());
 
     switch(fType){
-    case kSparse:
-      fDataSparse.coeffRef(bins.FindBin(x)) += w;
+    case kSparse:{
+      SparseFill& f = fSparseBuffer[bin];
+      f.w += w;
+      if(gStatErrs) f.w2 += w*w;
       break;
+    }
     case kDenseStan:
       std::cout << "Hist::Fill() not supported for stan vars" << std::endl;
       abort();
     case kDense:
-      {
-        const int bin = bins.FindBin(x);
-        fData[bin] += w;
-        if(gStatErrs){
-          if(fSumSq.size() == 0) fSumSq.resize(fData.size());
-          fSumSq[bin] += w*w;
+      fData[bin] += w;
+      if(gStatErrs) fSumSq[bin] += w*w;
+      break;
+    case kDenseFloat:
+      fDataFloat[bin] += w;
+      if(gStatErrs) fSumSqFloat[bin] += w*w;
+      break;
+    case kDenseCount:
+      ++fDataCount[bin];
+      break;
+    default:
+      abort(); // unreachable
+    }
+
+    if(fType == kSparse) AdaptStorage();
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::FillN(const Binning& bins,
+                   const std::vector<double>& xs,
+                   const std::vector<double>& ws)
+  {
+    assert(Initialized());
+    assert(xs.size() == ws.size());
+
+    if(xs.empty()) return;
+
+    if(fType == kDenseStan){
+      std::cout << "Hist::FillN() not supported for stan vars" << std::endl;
+      abort();
+    }
+
+    // Reuse the index buffer between calls to avoid an allocation per batch
+    thread_local std::vector<int> idxs;
+    bins.FindBins(xs, idxs);
+
+    if(fConcurrent){fConcurrent->FillN(idxs, ws); return;}
+
+    if(fScale != 1) ApplyScale();
+
+    // Do all the per-call bookkeeping once for the whole batch
+    const Eigen::Map<const Eigen::ArrayXd> wmap(ws.data(), ws.size());
+    if((wmap != 1).any()){
+      fSqrtErrs = false;
+      // Counts can only represent unweighted entries
+      if(fType == kDenseCount) ToDouble();
+    }
+
+    const unsigned int N = xs.size();
+    unsigned int i0 = 0; // where to start the dense fill from
+
+    if(fType == kDenseCount){
+      for(; i0 < N; ++i0){
+        if(fDataCount[idxs[i0]] == kMaxCount) break;
+        ++fDataCount[idxs[i0]];
+      }
+      if(i0 == N) return;
+      // Some bin is about to overflow. Do the rest in double precision
+      ToDouble();
+    }
+
+    switch(fType){
+    case kSparse:
+      if(gStatErrs){
+        if(fSumSqSparse.size() == 0) fSumSqSparse.resize(fDataSparse.size());
+        for(unsigned int i = 0; i < N; ++i){
+          SparseFill& f = fSparseBuffer[idxs[i]];
+          f.w += ws[i];
+          f.w2 += ws[i]*ws[i];
         }
       }
+      else{
+        for(unsigned int i = 0; i < N; ++i) fSparseBuffer[idxs[i]].w += ws[i];
+      }
+      break;
+    case kDense:
+      // Scatter-add. Separate loops for the two cases so that the common one
+      // has no branch in it.
+      if(gStatErrs){
+        if(fSumSq.size() == 0) fSumSq = Eigen::ArrayXd::Zero(fData.size());
+        for(unsigned int i = i0; i < N; ++i){
+          fData[idxs[i]] += ws[i];
+          fSumSq[idxs[i]] += ws[i]*ws[i];
+        }
+      }
+      else{
+        for(unsigned int i = i0; i < N; ++i) fData[idxs[i]] += ws[i];
+      }
+      break;
+    case kDenseFloat:
+      if(gStatErrs){
+        if(fSumSqFloat.size() == 0) fSumSqFloat = Eigen::ArrayXf::Zero(fDataFloat.size());
+        for(unsigned int i = 0; i < N; ++i){
+          fDataFloat[idxs[i]] += ws[i];
+          fSumSqFloat[idxs[i]] += ws[i]*ws[i];
+        }
+      }
+      else{
+        for(unsigned int i = 0; i < N; ++i) fDataFloat[idxs[i]] += ws[i];
+      }
       break;
     default:
       abort(); // unreachable
     }
+
+    if(fType == kSparse) AdaptStorage();
   }
 
   //----------------------------------------------------------------------
-  void Hist::Scale(double s)
+  void Hist::BeginConcurrentFill(EConcurrentFill mode)
   {
     assert(Initialized());
+    assert(!fConcurrent);
 
-    switch(fType){
-    case kSparse:    fDataSparse *= s; break;
-    case kDenseStan: fDataStan   *= s; break;
-    case kDense:     fData       *= s; break;
+    if(fType == kDenseStan){
+      std::cout << "Hist::BeginConcurrentFill() not supported for stan vars" << std::endl;
+      abort();
+    }
+
+    // The shards are merged straight into the stored contents
+    ApplyScale();
+
+    switch(mode){
+    case kThreadShards:
+      fConcurrent = std::make_unique<ShardedFill>(fType == kSparse, GetNbinsX()+2);
+      break;
+    case kAtomicBins:
+      if(fType != kDense){
+        std::cout << "Hist::BeginConcurrentFill() kAtomicBins is only supported for dense histograms" << std::endl;
+        abort();
+      }
+      if(gStatErrs && fSumSq.size() == 0) fSumSq = Eigen::ArrayXd::Zero(fData.size());
+      fConcurrent = std::make_unique<AtomicFill>(fData.data(), fSumSq.size() > 0 ? fSumSq.data() : 0);
+      break;
     default:
       abort(); // unreachable
     }
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::EndConcurrentFill()
+  {
+    assert(fConcurrent);
+
+    // Detach first so that the merge sees this as a regular Hist
+    std::unique_ptr<ConcurrentFill> fill = std::move(fConcurrent);
+    fill->MergeInto(*this);
+    // Enough new bins may have been filled to change the storage
+    AdaptStorage();
+  }
+
+  //----------------------------------------------------------------------
+  void Hist::Scale(double s)
+  {
+    assert(Initialized());
+
+    // Counts can't represent the scaled contents, but they can stay compact
+    if(fType == kDenseCount && s != 1){
+      fDataFloat = fDataCount.cast<float>();
+      // Every entry so far had unit weight
+      if(gStatErrs) fSumSqFloat = fDataFloat;
+      fDataCount.resize(0);
+      fType = kDenseFloat;
+    }
+
+    if(fType == kDenseStan){
+      SetStan(Times(fDataStan, s));
+      fSumSq *= s;
+    }
+    else if(fType == kDenseFloat){
+      // Compact storage doesn't use fScale. Scale it in place instead
+      fDataFloat *= s;
+      fSumSqFloat *= s;
+    }
+    else{
+      // fSumSq is covered by fScale too
+      fScale *= s;
+    }
 
     if(s != 1) fSqrtErrs = false;
-    fSumSq *= s;
+
+    // Scaling to zero is the only way this can change which bins are filled
+    if(s == 0){
+      ApplyScale();
+      AdaptStorage();
+    }
   }
 
   //----------------------------------------------------------------------
   void Hist::Scale(const stan::math::var& s)
   {
     assert(Initialized());
+    ToDouble();
+    ApplyScale();
+    FlushSparse();
     switch (fType){
     case kSparse:
-      fDataStan = fDataSparse * s;
+      SetStan(Times(ToDense(fDataSparse), s));
       fDataSparse.resize(0);
       break;
 
     case kDense:
-      fDataStan = fData * s;
+      SetStan(Times(fData, s));
       fData.resize(0);
       break;
 
     case kDenseStan:
-      fDataStan *= s;
+      SetStan(Times(fDataStan, s));
       break;
 
     default:
       abort(); // unreachable
     }
 
-    fType = kDenseStan;
-
     if(s != 1) fSqrtErrs = false;
     fSumSq *= s.val();
   }
@@ -342,6 +1163,9 @@ namespace ana
   void Hist::ResetErrors()
   {
     fSumSq.resize(0);
+    fSumSqFloat.resize(0);
+    fSumSqSparse.resize(0);
+    for(auto& it: fSparseBuffer) it.second.w2 = 0;
     fSqrtErrs = true;
   }
 
@@ -351,9 +1175,11 @@ namespace ana
     assert(Initialized());
 
     switch(fType){
-    case kSparse: return fDataSparse.coeff(i);
-    case kDenseStan: return fDataStan[i].val();
-    case kDense: return fData[i];
+    case kSparse: return fScale * SparseCoeff(i);
+    case kDenseStan: return fDataStan.val()[i];
+    case kDense: return fScale * fData[i];
+    case kDenseFloat: return fDataFloat[i];
+    case kDenseCount: return fDataCount[i];
     default:
       abort(); // unreachable
     }
@@ -363,6 +1189,9 @@ namespace ana
   void Hist::SetBinContent(int i, double x)
   {
     assert(Initialized());
+    ToDouble();
+    ApplyScale();
+    FlushSparse();
 
     switch(fType){
     case kSparse: fDataSparse.coeffRef(i) = x; break;
@@ -376,6 +1205,7 @@ namespace ana
 
     fSqrtErrs = false;
     if(fSumSq.size() > 0) fSumSq[i] = 0;
+    if(fSumSqSparse.size() > 0) fSumSqSparse.coeffRef(i) = 0;
   }
 
   //----------------------------------------------------------------------
@@ -383,13 +1213,22 @@ namespace ana
   {
     switch(fType){
     case kSparse:    fDataSparse.setZero(); break;
-    case kDenseStan: fDataStan  .setZero(); break;
+    case kDenseStan: SetStan(StanVector(Eigen::VectorXd::Zero(fDataStan.size()))); break;
     case kDense:     fData      .setZero(); break;
+    case kDenseFloat: fDataFloat.setZero(); break;
+    case kDenseCount: fDataCount.setZero(); break;
     default: ; // OK?
     }
 
+    fSparseBuffer.clear();
+
+    fScale = 1;
     fSqrtErrs = true;
     fSumSq.resize(0);
+    fSumSqFloat.resize(0);
+    fSumSqSparse.resize(0);
+
+    AdaptStorage();
   }
 
   //----------------------------------------------------------------------
@@ -397,30 +1236,27 @@ namespace ana
   {
     switch(fType){
     case kSparse:    fDataSparse += rhs * scale; break;
-    case kDenseStan: fDataStan   += rhs * scale; break;
+    case kDenseStan: SetStan(Affine(fDataStan, 1, ToDense(rhs) * scale)); break;
     case kDense:     fData       += rhs * scale; break;
     default: abort(); // unreachable
     }
   }
 
   //----------------------------------------------------------------------
-  void Hist::Add(const Eigen::ArrayXstan& rhs, double scale)
+  void Hist::Add(const StanVector& rhs, double scale)
   {
     switch(fType){
     case kSparse:
-      fType = kDenseStan;
-      fDataStan = rhs * scale;
-      fDataStan += fDataSparse;
+      SetStan(Affine(rhs, scale, ToDense(fDataSparse)));
       fDataSparse.resize(0);
       break;
 
     case kDenseStan:
-      fDataStan += rhs * scale;
+      SetStan(Plus(fDataStan, rhs, scale));
       break;
 
     case kDense:
-      fType = kDenseStan;
-      fDataStan = fData + rhs * scale;
+      SetStan(Affine(rhs, scale, fData));
       fData.resize(0);
       break;
 
@@ -437,10 +1273,12 @@ namespace ana
       fData = rhs * scale;
       fData += fDataSparse;
       fDataSparse.resize(0);
+      if(fSumSqSparse.size() > 0) fSumSq = ToDense(fSumSqSparse);
+      fSumSqSparse.resize(0);
       break;
 
     case kDenseStan:
-      fDataStan += rhs * scale;
+      SetStan(Affine(fDataStan, 1, rhs * scale));
       break;
 
     case kDense:
@@ -457,22 +1295,152 @@ namespace ana
     assert(Initialized());
     assert(rhs.Initialized());
 
+    ToDouble();
+    ApplyScale();
+    FlushSparse();
+
+    // No need to apply the scale factor of rhs, it can be combined with ours
+    scale *= rhs.fScale;
+
+    Eigen::SparseVector<double> tmp;
+
     switch(rhs.fType){
-    case kSparse:    Add(rhs.fDataSparse, scale); break;
+    case kSparse:    Add(rhs.MergedSparse(tmp), scale); break;
     case kDenseStan: Add(rhs.fDataStan,   scale); break;
     case kDense:     Add(rhs.fData,       scale); break;
+    case kDenseFloat: Add(Eigen::ArrayXd(rhs.fDataFloat.cast<double>()), scale); break;
+    case kDenseCount: Add(Eigen::ArrayXd(rhs.fDataCount.cast<double>()), scale); break;
     default: abort(); // unreachable
     }
 
     if(scale != 1 || !rhs.fSqrtErrs) fSqrtErrs = false;
 
+    if(fType == kSparse){
+      // Then rhs is sparse too, or this would have become dense
+      if(rhs.fSumSqSparse.size() > 0){
+        Eigen::SparseVector<double> tmpSumSq;
+        const Eigen::SparseVector<double>& rhsErrs = rhs.MergedSparse(tmpSumSq, true);
+        if(fSumSqSparse.size() > 0) fSumSqSparse += scale * rhsErrs;
+        else fSumSqSparse = scale * rhsErrs;
+      }
+
+      AdaptStorage();
+      return;
+    }
+
+    Eigen::ArrayXd rhsSumSq;
+    if(rhs.fSumSqFloat.size() > 0) rhsSumSq = rhs.fSumSqFloat.cast<double>();
+    if(rhs.fSumSqSparse.size() > 0) rhsSumSq = ToDense(rhs.MergedSparse(tmp, true));
+    // Only the double-precision errors don't need copying
+    const Eigen::ArrayXd& rhsErrs = (rhsSumSq.size() > 0) ? rhsSumSq : rhs.fSumSq;
+
     if(fSumSq.size() > 0){
-      if(rhs.fSumSq.size() > 0) fSumSq += scale * rhs.fSumSq;
+      if(rhsErrs.size() > 0) fSumSq += scale * rhsErrs;
       // otherwise nothing to add in
     }
     else{
-      fSumSq = scale * rhs.fSumSq;
+      fSumSq = scale * rhsErrs;
+    }
+
+    AdaptStorage();
+  }
+
+  //----------------------------------------------------------------------
+  Eigen::ArrayXd Hist::DenseContents() const
+  {
+    switch(fType){
+    case kDense:  return fScale * fData;
+    case kSparse:{
+      Eigen::SparseVector<double> tmp;
+      return fScale * ToDense(MergedSparse(tmp));
+    }
+    case kDenseStan: return fDataStan.val().array();
+    default: abort(); // unreachable
+    }
+  }
+
+  //----------------------------------------------------------------------
+  bool Hist::HasErrors() const
+  {
+    return fSumSq.size() > 0 || fSumSqSparse.size() > 0 || (gStatErrs && fSqrtErrs);
+  }
+
+  //----------------------------------------------------------------------
+  Eigen::ArrayXd Hist::SumSq(const Eigen::ArrayXd& contents) const
+  {
+    if(fSumSq.size() > 0) return fScale * fSumSq;
+    if(fSumSqSparse.size() > 0){
+      Eigen::SparseVector<double> tmp;
+      return fScale * ToDense(MergedSparse(tmp, true));
     }
+    // Filled with unit weights, so the variance is just the contents
+    if(gStatErrs && fSqrtErrs) return contents;
+    return Eigen::ArrayXd::Zero(contents.size());
+  }
+
+  //----------------------------------------------------------------------
+  Eigen::SparseVector<double> Hist::SparseProductSumSq(const Hist& rhs,
+                                                       bool divide,
+                                                       bool zeroOverZero) const
+  {
+    assert(fType == kSparse && fScale == 1 && fSparseBuffer.empty());
+    assert(rhs.fType == kSparse || rhs.fType == kDense);
+    assert(rhs.fScale == 1 && rhs.fSparseBuffer.empty());
+
+    typedef Eigen::SparseVector<double>::InnerIterator It;
+
+    // Both terms vanish unless this bin has contents or errors here, so those
+    // are the only bins to visit
+    std::vector<int> idxs;
+    idxs.reserve(fDataSparse.nonZeros() + fSumSqSparse.nonZeros());
+    for(It it(fDataSparse); it; ++it) idxs.push_back(it.index());
+    for(It it(fSumSqSparse); it; ++it) idxs.push_back(it.index());
+    std::sort(idxs.begin(), idxs.end());
+    idxs.erase(std::unique(idxs.begin(), idxs.end()), idxs.end());
+
+    // Advance \a it to bin i (which only increases) and read the value there
+    const auto at = [](It& it, int i)
+    {
+      while(it && it.index() < i) ++it;
+      return (it && it.index() == i) ? it.value() : 0.;
+    };
+    // Empty bins have no error, even divided by zero
+    const auto ratio = [](double num, double denom)
+    {
+      return (num == 0) ? 0. : num / denom;
+    };
+
+    const bool sqrtErrs = gStatErrs && fSqrtErrs;
+    const bool rhsSqrtErrs = gStatErrs && rhs.fSqrtErrs;
+
+    It ait(fDataSparse), sait(fSumSqSparse);
+    It bit(rhs.fDataSparse), sbit(rhs.fSumSqSparse);
+
+    Eigen::SparseVector<double> ret(fDataSparse.size());
+    ret.reserve(idxs.size());
+    for(int i: idxs){
+      const double a = at(ait, i);
+      const double sa = sqrtErrs ? a : at(sait, i);
+
+      const double b = (rhs.fType == kSparse) ? at(bit, i) : rhs.fData[i];
+      double sb = 0;
+      if(rhsSqrtErrs) sb = b;
+      else if(rhs.fSumSq.size() > 0) sb = rhs.fSumSq[i];
+      else if(rhs.fSumSqSparse.size() > 0) sb = at(sbit, i);
+
+      double sumsq;
+      if(divide){
+        if(zeroOverZero && a == 0 && b == 0) continue;
+        sumsq = ratio(sa, b*b) + ratio(sb*a*a, b*b*b*b);
+      }
+      else{
+        sumsq = sa*b*b + sb*a*a;
+      }
+
+      if(sumsq != 0) ret.insertBack(i) = sumsq;
+    }
+
+    return ret;
   }
 
   //----------------------------------------------------------------------
@@ -481,102 +1449,365 @@ namespace ana
     assert(Initialized());
     assert(rhs.Initialized());
 
-    if(fType == kSparse || rhs.fType == kSparse){
-      std::cout << "Hist::Multiply() not implemented for sparse vectors" << std::endl;
-      abort();
+    if(rhs.IsCompact() || rhs.fScale != 1 || !rhs.fSparseBuffer.empty()){
+      Hist tmp(rhs);
+      tmp.ToDouble();
+      tmp.ApplyScale();
+      tmp.FlushSparse();
+      Multiply(tmp);
+      return;
     }
+    ToDouble();
+    ApplyScale();
+    FlushSparse();
+
+    // Didn't bother to implement error prop for stan hists. Otherwise we need
+    // the contents from before the operation.
+    const bool errs = fType != kDenseStan && rhs.fType != kDenseStan &&
+                      (HasErrors() || rhs.HasErrors());
+    // Sparse results keep sparse errors, from only the bins filled in here
+    const bool sparseErrs = errs && fType == kSparse;
+    Eigen::SparseVector<double> sumSqSparse;
+    Eigen::ArrayXd a, b;
+    if(sparseErrs) sumSqSparse = SparseProductSumSq(rhs, false, false);
+    else if(errs){a = DenseContents(); b = rhs.DenseContents();}
 
-    if(fType == kDenseStan){
-      if(rhs.fType == kDenseStan){
-        fDataStan *= rhs.fDataStan;
+    if(fType == kSparse){
+      switch(rhs.fType){
+      case kSparse:
+        fDataSparse = fDataSparse.cwiseProduct(rhs.fDataSparse);
+        break;
+      case kDense:
+        // Empty bins stay empty, only need to touch the filled ones
+        for(Eigen::SparseVector<double>::InnerIterator it(fDataSparse); it; ++it)
+          it.valueRef() *= rhs.fData[it.index()];
+        break;
+      case kDenseStan:
+        SetStan(Product(rhs.fDataStan, ToDense(fDataSparse)));
+        fDataSparse.resize(0);
+        break;
+      default: abort(); // unreachable
       }
-      else{
-        fDataStan *= rhs.fData;
+    }
+    else if(fType == kDenseStan){
+      switch(rhs.fType){
+      case kSparse:    SetStan(Product(fDataStan, ToDense(rhs.fDataSparse))); break;
+      case kDenseStan: SetStan(Product(fDataStan, rhs.fDataStan)); break;
+      case kDense:     SetStan(Product(fDataStan, rhs.fData)); break;
+      default: abort(); // unreachable
       }
     }
     else{
-      if(rhs.fType == kDenseStan){
-        fType = kDenseStan;
-        fDataStan = fData * rhs.fDataStan;
-        fData.resize(0);
+      switch(rhs.fType){
+      case kSparse:{
+        // Only the bins filled in rhs can be non-zero
+        Eigen::ArrayXd prod = Eigen::ArrayXd::Zero(fData.size());
+        for(Eigen::SparseVector<double>::InnerIterator it(rhs.fDataSparse); it; ++it)
+          prod[it.index()] = fData[it.index()] * it.value();
+        fData.swap(prod);
+        break;
       }
-      else{
+      case kDenseStan:
+        SetStan(Product(rhs.fDataStan, fData));
+        fData.resize(0);
+        break;
+      case kDense:
         fData *= rhs.fData;
+        break;
+      default: abort(); // unreachable
       }
     }
 
-    if(fType == kDense && rhs.fType == kDense){
-      if(fSumSq.size() > 0){
-        if(rhs.fSumSq.size() > 0){
-          fSumSq = fSumSq * util::sqr(rhs.fData) + rhs.fSumSq * util::sqr(fData);
-        }
-        else{
-          fSumSq *= util::sqr(rhs.fData);
-        }
-      }
-      else if(rhs.fSumSq.size() > 0){
-        fSumSq = rhs.fSumSq * util::sqr(fData);
-      }
+    if(errs && !sparseErrs){
+      fSumSq = SumSq(a) * util::sqr(b) + rhs.SumSq(b) * util::sqr(a);
     }
     else{
-      // Didn't bother to implement error prop for multiplying stan/sparse
-      // hists
       fSumSq.resize(0);
     }
+    // Errors are stored the same way as the contents
+    fSumSqSparse.swap(sumSqSparse);
 
     fSqrtErrs = false;
   }
 
   //----------------------------------------------------------------------
-  void Hist::Divide(const Hist& rhs)
+  void Hist::Divide(const Hist& rhs, bool zeroOverZero)
   {
     assert(Initialized());
     assert(rhs.Initialized());
 
-    if(fType == kSparse || rhs.fType == kSparse){
-      std::cout << "Hist::Divide() not implemented for sparse vectors" << std::endl;
-      abort();
+    if(rhs.IsCompact() || rhs.fScale != 1 || !rhs.fSparseBuffer.empty()){
+      Hist tmp(rhs);
+      tmp.ToDouble();
+      tmp.ApplyScale();
+      tmp.FlushSparse();
+      Divide(tmp, zeroOverZero);
+      return;
+    }
+    ToDouble();
+    ApplyScale();
+    FlushSparse();
+
+    const bool errs = fType != kDenseStan && rhs.fType != kDenseStan &&
+                      (HasErrors() || rhs.HasErrors());
+    // Sparse results keep sparse errors, from only the bins filled in here
+    const bool sparseErrs = errs && fType == kSparse;
+    Eigen::SparseVector<double> sumSqSparse;
+    Eigen::ArrayXd a, b;
+    if(sparseErrs){
+      sumSqSparse = SparseProductSumSq(rhs, true, zeroOverZero);
+    }
+    else if(errs){
+      a = DenseContents();
+      b = rhs.DenseContents();
     }
 
-    if(fType == kDenseStan){
-      if(rhs.fType == kDenseStan){
-        fDataStan /= rhs.fDataStan;
+    // With autodiff, 0/0 = 0 is implemented by dividing those bins by one
+    // instead, otherwise their derivatives would be NaN
+    Eigen::Array<bool, Eigen::Dynamic, 1> zz;
+    if(zeroOverZero && (fType == kDenseStan || rhs.fType == kDenseStan)){
+      zz = DenseContents() == 0 && rhs.DenseContents() == 0;
+    }
+    const auto denom = [&zz](const Eigen::ArrayXd& d) -> Eigen::ArrayXd
+    {
+      return zz.size() ? zz.select(1., d) : d;
+    };
+    const auto denomStan = [&zz](const StanVector& d)
+    {
+      return zz.size() ? OneWhere(d, zz) : d;
+    };
+
+    if(fType == kSparse){
+      switch(rhs.fType){
+      case kSparse:{
+        // Walk the two lists of filled bins in step
+        Eigen::SparseVector<double>::InnerIterator jt(rhs.fDataSparse);
+        for(Eigen::SparseVector<double>::InnerIterator it(fDataSparse); it; ++it){
+          while(jt && jt.index() < it.index()) ++jt;
+          const double d = (jt && jt.index() == it.index()) ? jt.value() : 0;
+          it.valueRef() = (zeroOverZero && it.value() == 0 && d == 0) ? 0 : it.value() / d;
+        }
+        break;
       }
-      else{
-        fDataStan /= rhs.fData;
+      case kDense:
+        for(Eigen::SparseVector<double>::InnerIterator it(fDataSparse); it; ++it){
+          const double d = rhs.fData[it.index()];
+          it.valueRef() = (zeroOverZero && it.value() == 0 && d == 0) ? 0 : it.value() / d;
+        }
+        break;
+      case kDenseStan:
+        SetStan(Quotient(ToDense(fDataSparse), denomStan(rhs.fDataStan)));
+        fDataSparse.resize(0);
+        break;
+      default: abort(); // unreachable
+      }
+    }
+    else if(fType == kDenseStan){
+      switch(rhs.fType){
+      case kSparse:    SetStan(Quotient(fDataStan, denom(ToDense(rhs.fDataSparse)))); break;
+      case kDenseStan: SetStan(Quotient(fDataStan, denomStan(rhs.fDataStan))); break;
+      case kDense:     SetStan(Quotient(fDataStan, denom(rhs.fData))); break;
+      default: abort(); // unreachable
       }
     }
     else{
-      if(rhs.fType == kDenseStan){
-        fType = kDenseStan;
-        fDataStan = fData / rhs.fDataStan;
-        fData.resize(0);
+      switch(rhs.fType){
+      case kSparse:
+      case kDense:{
+        // Dividing by the empty bins makes this dense in any case
+        const Eigen::ArrayXd denom = (rhs.fType == kSparse) ? ToDense(rhs.fDataSparse) : rhs.fData;
+        if(zeroOverZero)
+          fData = (fData == 0 && denom == 0).select(0., fData / denom);
+        else
+          fData /= denom;
+        break;
       }
-      else{
-        fData /= rhs.fData;
+      case kDenseStan:
+        SetStan(Quotient(fData, denomStan(rhs.fDataStan)));
+        fData.resize(0);
+        break;
+      default: abort(); // unreachable
       }
     }
 
-    if(fType == kDense && rhs.fType == kDense){
-      if(fSumSq.size() > 0){
-        if(rhs.fSumSq.size() > 0){
-          fSumSq = fSumSq / util::sqr(rhs.fData) + rhs.fSumSq * util::sqr(fData) / util::sqr(util::sqr(rhs.fData));
-        }
-        else{
-          fSumSq /= util::sqr(rhs.fData);
+    if(errs && !sparseErrs){
+      fSumSq = SumSq(a) / util::sqr(b) + rhs.SumSq(b) * util::sqr(a) / util::sqr(util::sqr(b));
+      if(zeroOverZero) fSumSq = (a == 0 && b == 0).select(0., fSumSq);
+    }
+    else{
+      fSumSq.resize(0);
+    }
+    // Errors are stored the same way as the contents
+    fSumSqSparse.swap(sumSqSparse);
+
+    fSqrtErrs = false;
+  }
+
+  //----------------------------------------------------------------------
+  Hist Hist::Evaluate(const std::vector<Op>& prog)
+  {
+    // The fused loop only handles plain dense storage
+    int nbins = -1;
+    bool fused = true;
+    unsigned int depth = 0, maxDepth = 0;
+    for(const Op& op: prog){
+      if(op.op == Op::kPush) maxDepth = std::max(maxDepth, ++depth);
+      if(op.op == Op::kAdd) --depth;
+      if(!op.hist) continue;
+      if(op.hist->fType != kDense || op.hist->fDenseFillFrac != 0 ||
+         (nbins >= 0 && op.hist->fData.size() != nbins)) fused = false;
+      nbins = op.hist->fData.size();
+    }
+    assert(depth == 1);
+
+    if(!fused || nbins <= 0){
+      std::vector<Hist> stack;
+      for(const Op& op: prog){
+        switch(op.op){
+        case Op::kPush: stack.push_back(*op.hist); break;
+        case Op::kAdd:
+          stack[stack.size()-2].Add(stack.back(), op.scale);
+          stack.pop_back();
+          break;
+        case Op::kMultiply: stack.back().Multiply(*op.hist); break;
+        case Op::kDivide:   stack.back().Divide(*op.hist);   break;
+        case Op::kScale:    stack.back().Scale(op.scale);    break;
         }
       }
-      else if(rhs.fSumSq.size() > 0){
-        fSumSq = rhs.fSumSq * util::sqr(fData) / util::sqr(util::sqr(rhs.fData));
+      return std::move(stack.back());
+    }
+
+    // Small enough that all the slots stay in cache
+    const int kBlockSize = 256;
+    // Big enough that starting the threads is worth it
+    const int kParallelBins = 1 << 18;
+
+    struct Slot
+    {
+      Eigen::ArrayXd val, sumsq;
+      bool hasSumSq, sqrtErrs;
+    };
+
+    Hist ret;
+    ret.fType = kDense;
+    ret.fData.resize(nbins);
+
+    // Compute bins [i0, i1) of the result, using 'slots' as scratch space
+    auto RunBlocks = [&](int i0, int i1, std::vector<Slot>& slots)
+    {
+      for(Slot& s: slots){
+        s.val.resize(kBlockSize);
+        s.sumsq.resize(kBlockSize);
+      }
+
+      for(int j0 = i0; j0 < i1; j0 += kBlockSize){
+        const int n = std::min(kBlockSize, i1-j0);
+
+        // This replicates Add(), Multiply(), Divide() and Scale() exactly,
+        // including the way the errors are carried along
+        unsigned int d = 0;
+        for(const Op& op: prog){
+          if(op.op == Op::kPush){
+            Slot& s = slots[d++];
+            s.val.head(n) = op.hist->fScale * op.hist->fData.segment(j0, n);
+            s.hasSumSq = op.hist->fSumSq.size() > 0;
+            if(s.hasSumSq) s.sumsq.head(n) = op.hist->fScale * op.hist->fSumSq.segment(j0, n);
+            s.sqrtErrs = op.hist->fSqrtErrs;
+            continue;
+          }
+
+          if(op.op == Op::kAdd){
+            Slot& s = slots[d-2];
+            const Slot& r = slots[--d];
+            s.val.head(n) += op.scale * r.val.head(n);
+            if(r.hasSumSq){
+              if(s.hasSumSq) s.sumsq.head(n) += op.scale * r.sumsq.head(n);
+              else           s.sumsq.head(n)  = op.scale * r.sumsq.head(n);
+              s.hasSumSq = true;
+            }
+            if(op.scale != 1 || !r.sqrtErrs) s.sqrtErrs = false;
+            continue;
+          }
+
+          if(op.op == Op::kScale){
+            Slot& s = slots[d-1];
+            s.val.head(n) *= op.scale;
+            if(s.hasSumSq) s.sumsq.head(n) *= op.scale;
+            if(op.scale != 1) s.sqrtErrs = false;
+            continue;
+          }
+
+          Slot& s = slots[d-1];
+          const Hist& h = *op.hist;
+          const auto a = s.val.head(n);
+          const auto b = h.fScale * h.fData.segment(j0, n);
+
+          const bool lhsImplicit = !s.hasSumSq && gStatErrs && s.sqrtErrs;
+          if(s.hasSumSq || lhsImplicit || h.HasErrors()){
+            auto ss = s.sumsq.head(n);
+            if(!s.hasSumSq){
+              if(lhsImplicit) ss = a; else ss.setZero();
+            }
+
+            if(op.op == Op::kMultiply){
+              ss *= b.square();
+              if(h.fSumSq.size() > 0) ss += h.fScale * h.fSumSq.segment(j0, n) * a.square();
+              else if(h.HasErrors())  ss += b * a.square();
+            }
+            else{
+              ss /= b.square();
+              if(h.fSumSq.size() > 0) ss += h.fScale * h.fSumSq.segment(j0, n) * a.square() / b.square().square();
+              else if(h.HasErrors())  ss += b * a.square() / b.square().square();
+            }
+            s.hasSumSq = true;
+          }
+          else{
+            s.hasSumSq = false;
+          }
+          s.sqrtErrs = false;
+
+          if(op.op == Op::kMultiply) s.val.head(n) *= b; else s.val.head(n) /= b;
+        }
+
+        ret.fData.segment(j0, n) = slots[0].val.head(n);
+        if(slots[0].hasSumSq) ret.fSumSq.segment(j0, n) = slots[0].sumsq.head(n);
       }
+    };
+
+    // Whether there are errors doesn't depend on the bin. Find out from the
+    // first block, so the storage for them is ready for all the others.
+    std::vector<Slot> slots(maxDepth);
+    const int first = std::min(kBlockSize, nbins);
+    ret.fSumSq.resize(first);
+    RunBlocks(0, first, slots);
+    if(slots[0].hasSumSq){
+      ret.fSumSq.conservativeResize(nbins);
     }
     else{
-      // Didn't bother to implement error prop for dividing stan/sparse
-      // hists
-      fSumSq.resize(0);
+      ret.fSumSq.resize(0);
     }
+    ret.fSqrtErrs = slots[0].sqrtErrs;
 
-    fSqrtErrs = false;
+    if(nbins < kParallelBins){
+      RunBlocks(first, nbins, slots);
+      return ret;
+    }
+
+    ThreadPool pool;
+    const int nchunks = pool.NThreads();
+    // Whole numbers of blocks per thread
+    const int chunk = (nbins-first + nchunks*kBlockSize-1) / (nchunks*kBlockSize) * kBlockSize;
+    for(int i0 = first; i0 < nbins; i0 += chunk){
+      const int i1 = std::min(i0+chunk, nbins);
+      pool.AddTask([&RunBlocks, i0, i1, maxDepth]()
+                   {
+                     std::vector<Slot> slots(maxDepth);
+                     RunBlocks(i0, i1, slots);
+                   });
+    }
+    pool.Finish();
+
+    return ret;
   }
 
   //----------------------------------------------------------------------
@@ -588,21 +1819,26 @@ namespace ana
       std::cout << "Hist::Write() not implemented (impossible?) for stan vars" << std::endl;
       abort();
     }
-    if(fType == kDense){
+    if(fType == kDense || IsCompact()){
       TH1D* h = ToTH1(bins);
       h->Write("hist");
       delete h;
     }
     if(fType == kSparse){
+      Eigen::SparseVector<double> tmp, tmpSumSq;
+      const Eigen::SparseVector<double>& sparse = MergedSparse(tmp);
+      const Eigen::SparseVector<double>& sumsq = MergedSparse(tmpSumSq, true);
+
       const int n = bins.NBins();
       const double x0 = bins.IsSimple() ? bins.Min() : 0;
       const double x1 = bins.IsSimple() ? bins.Max() : bins.NBins();
       THnSparseD* h = new THnSparseD("", "", 1, &n, &x0, &x1);
 
-      for(Eigen::SparseVector<double>::InnerIterator it(fDataSparse); it; ++it){
+      for(Eigen::SparseVector<double>::InnerIterator it(sparse); it; ++it){
         const int idx = it.index();
-        h->SetBinContent(&idx, it.value());
-        if(fSqrtErrs) h->SetBinError(&idx, sqrt(it.value()));
+        h->SetBinContent(&idx, fScale * it.value());
+        if(fSqrtErrs) h->SetBinError(&idx, sqrt(fScale * it.value()));
+        else if(fSumSqSparse.size() > 0) h->SetBinError(&idx, sqrt(fScale * sumsq.coeff(idx)));
       }
 
       h->Write("hist_sparse");
@@ -9,6 +9,11 @@ class TH1D;
 #include <Eigen/Dense>
 #include <Eigen/SparseCore>
 
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
 namespace Eigen{
   using ArrayXstan = Eigen::Array<stan::math::var, Eigen::Dynamic, 1>;
   using VectorXstan = Eigen::Matrix<stan::math::var, Eigen::Dynamic, 1>;
@@ -18,6 +23,11 @@ namespace ana
 {
   class Binning;
 
+  /// \brief A whole vector of bins as a single autodiff node
+  ///
+  /// Operations on these put one node on the tape, rather than one per bin
+  using StanVector = stan::math::var_value<Eigen::VectorXd>;
+
   class Hist
   {
   public:
@@ -32,24 +42,80 @@ namespace ana
 
     static Hist Zero(int nbins);
     static Hist ZeroSparse(int nbins);
+    /// Single-precision storage. Half the memory, with ~7 significant figures
+    static Hist ZeroFloat(int nbins);
+    /// \brief Integer counts. A quarter of the memory, for unweighted fills
+    ///
+    /// Switches to double precision automatically on the first weighted fill
+    static Hist ZeroCount(int nbins);
+    /// \brief Sparse storage that switches itself to dense (and back)
+    ///
+    /// \param fillFrac Convert to dense once more than this fraction of the
+    ///                 bins are filled. Converts back to sparse when an
+    ///                 operation leaves less than half that fraction filled.
+    static Hist ZeroAdaptive(int nbins, double fillFrac = .25);
 
     static Hist AdoptSparse(Eigen::SparseVector<double>&& v);
     static Hist AdoptStan(Eigen::ArrayXstan&& v);
+    static Hist AdoptStan(StanVector&& v);
     static Hist Adopt(Eigen::ArrayXd&& v);
 
     static Hist FromDirectory(TDirectory* dir);
 
-    TH1D* ToTH1(const Binning& bins) const;
+    /// \param scale Multiply the contents and errors of the result by this
+    TH1D* ToTH1(const Binning& bins, double scale = 1) const;
 
     bool HasStan() const {return fType == kDenseStan;}
-    const Eigen::ArrayXd& GetEigen() const {assert(fType == kDense); return fData;}
-    const Eigen::ArrayXstan& GetEigenStan() const {assert(fType == kDenseStan); return fDataStan;}
+    /// \brief Contents in double precision, whatever the storage
+    ///
+    /// A copy, so stays valid whatever happens to this Hist afterwards
+    Eigen::ArrayXd GetEigen() const {return GetEigen(1);}
+    /// Contents multiplied by \a s. Cheaper than scaling \ref GetEigen()
+    Eigen::ArrayXd GetEigen(double s) const;
+    /// \brief Per-bin vars. Prefer \ref GetStanVector where possible
+    ///
+    /// Unless the Hist was made from per-bin vars, each call puts new ones on
+    /// the autodiff stack
+    Eigen::ArrayXstan GetEigenStan() const;
+    const StanVector& GetStanVector() const {assert(fType == kDenseStan); return fDataStan;}
 
     int GetNbinsX() const;
     double GetBinError(int i) const;
     double Integral() const;
+    /// \brief Are all the bins zero?
+    ///
+    /// Stops at the first filled bin, so much cheaper than testing
+    /// \ref Integral for anything with contents
+    bool Empty() const;
 
     void Fill(const Binning& bins, double x, double w);
+    /// Fill with an already-computed bin index
+    void FillBin(int bin, double w);
+    /// Fill a whole batch of values at once. Much cheaper per-entry than
+    /// repeated calls to \ref Fill
+    void FillN(const Binning& bins,
+               const std::vector<double>& xs,
+               const std::vector<double>& ws);
+
+    /// Strategies for filling one Hist from several threads simultaneously
+    enum EConcurrentFill{
+      kThreadShards, ///< Each thread fills a private copy, summed at the end
+      kAtomicBins    ///< Threads update shared bins atomically. Dense only
+    };
+
+    /// \brief Allow \ref Fill, \ref FillBin and \ref FillN to be called from
+    /// many threads at once
+    ///
+    /// Nothing else may be done with this Hist until \ref EndConcurrentFill
+    void BeginConcurrentFill(EConcurrentFill mode);
+    /// Merge the results of all the concurrent filling into this Hist
+    void EndConcurrentFill();
+    bool InConcurrentFill() const {return bool(fConcurrent);}
+
+    /// \brief Only records the factor, which is applied when the contents are
+    /// needed
+    ///
+    /// Compact storage is scaled in place. Counts become single precision
     void Scale(double s);
     void Scale(const stan::math::var& s);
     void ResetErrors();
@@ -60,8 +126,36 @@ namespace ana
 
     void Add(const Hist& rhs, double scale = 1);
 
+    /// Sparse storage stays sparse: empty bins remain empty
     void Multiply(const Hist& rhs);
-    void Divide(const Hist& rhs);
+    /// \brief Divide bin-by-bin
+    ///
+    /// \param zeroOverZero Make bins that are empty in both zero rather than
+    ///                     NaN. Empty bins of sparse storage always stay empty
+    void Divide(const Hist& rhs, bool zeroOverZero = false);
+
+    /// One step of a calculation for \ref Evaluate
+    struct Op
+    {
+      enum EOp{
+        kPush,     ///< Push a copy of \a hist onto the stack
+        kAdd,      ///< Pop the stack and add it, times \a scale, to the new top
+        kMultiply, ///< Multiply the top of the stack by \a hist
+        kDivide,   ///< Divide the top of the stack by \a hist
+        kScale     ///< Scale the top of the stack by \a scale
+      } op;
+      const Hist* hist;
+      double scale;
+    };
+
+    /// \brief Run a sequence of operations on a stack of Hists
+    ///
+    /// Equivalent to the corresponding calls to \ref Add, \ref Multiply and
+    /// \ref Divide. When all the inputs are dense double-precision the
+    /// contents and errors are computed together in one blocked pass over the
+    /// bins, with no intermediate Hists. Large Hists have their bins split
+    /// between several threads.
+    static Hist Evaluate(const std::vector<Op>& prog);
 
     void Write(const Binning& bins) const;
   protected:
@@ -69,16 +163,90 @@ namespace ana
 
     // Helpers for the public Add() function
     void Add(const Eigen::SparseVector<double>& rhs, double scale);
-    void Add(const Eigen::ArrayXstan& rhs, double scale);
+    void Add(const StanVector& rhs, double scale);
+
+    /// Switch to stan storage, with contents \a v
+    void SetStan(StanVector&& v);
     void Add(const Eigen::ArrayXd& rhs, double scale);
 
-    enum EType{kUninitialized, kDense, kDenseStan, kSparse};
+    /// Contents as double-precision dense array, whatever the storage
+    Eigen::ArrayXd DenseContents() const;
+    bool HasErrors() const;
+    /// Sum of squared weights, given the \a contents of this Hist
+    Eigen::ArrayXd SumSq(const Eigen::ArrayXd& contents) const;
+
+    /// \brief Errors of this sparse Hist multiplied (or divided) by \a rhs,
+    /// given the contents before the operation
+    ///
+    /// Only visits the bins filled in this Hist. Both must already be flushed
+    /// and have their scale applied.
+    Eigen::SparseVector<double> SparseProductSumSq(const Hist& rhs,
+                                                   bool divide,
+                                                   bool zeroOverZero) const;
+
+    /// Switch between sparse and dense storage if this is an adaptive Hist
+    void AdaptStorage();
+    void SparseToDense();
+    void DenseToSparse();
+
+    /// Apply the contents of fSparseBuffer to fDataSparse and fSumSqSparse
+    void FlushSparse();
+    /// \brief fDataSparse (or fSumSqSparse) with the contents of
+    /// fSparseBuffer applied
+    ///
+    /// Returns the stored vector itself if nothing is pending, otherwise
+    /// merges into \a tmp. Doesn't modify this Hist, so safe for const
+    /// readers.
+    const Eigen::SparseVector<double>& MergedSparse(Eigen::SparseVector<double>& tmp,
+                                                    bool sumsq = false) const;
+    /// Bin \a i of fDataSparse (or fSumSqSparse), including anything pending
+    /// in fSparseBuffer
+    double SparseCoeff(int i, bool sumsq = false) const;
+
+    /// Multiply the stored contents by fScale, and reset it to one
+    void ApplyScale();
+
+    /// Convert compact storage (kDenseFloat/kDenseCount) to kDense
+    void ToDouble();
+    bool IsCompact() const {return fType == kDenseFloat || fType == kDenseCount;}
+
+    enum EType{kUninitialized, kDense, kDenseStan, kSparse, kDenseFloat, kDenseCount};
     EType fType;
 
+    /// Doesn't include fSparseBuffer until FlushSparse()
     Eigen::SparseVector<double> fDataSparse;
-    Eigen::ArrayXstan fDataStan;
+    /// Errors for kSparse, if enabled (non-zero size)
+    Eigen::SparseVector<double> fSumSqSparse;
+    /// Pending fills of a single bin of sparse storage
+    struct SparseFill{double w = 0; double w2 = 0;};
+    /// \brief Pending additions to fDataSparse and fSumSqSparse, by bin
+    ///
+    /// Inserting into the middle of a SparseVector is O(nnz), so fill into
+    /// here and merge them all in one go when the contents are needed
+    ///
+    /// Only the non-const methods flush it. Const ones see through it with
+    /// \ref MergedSparse or \ref SparseCoeff.
+    std::unordered_map<int, SparseFill> fSparseBuffer;
+    StanVector fDataStan;
+    /// Per-bin vars fDataStan was made from, if it was. For GetEigenStan()
+    Eigen::ArrayXstan fDataStanBins;
     Eigen::ArrayXd fData;
     Eigen::ArrayXd fSumSq; ///< Accumulate errors, if enabled
+    Eigen::ArrayXf fDataFloat;
+    Eigen::ArrayXf fSumSqFloat; ///< Errors for kDenseFloat, if enabled
+    Eigen::Array<uint32_t, Eigen::Dynamic, 1> fDataCount;
+    /// \brief Factor that fData or fDataSparse, and fSumSq, are to be
+    /// multiplied by
+    ///
+    /// Lets \ref Scale be O(1). Always one for other storage types
+    double fScale;
     bool fSqrtErrs; ///< Special case when filled with unweighted data
+    double fDenseFillFrac; ///< Only for adaptive storage, otherwise zero
+
+    class ConcurrentFill;
+    class ShardedFill;
+    class AtomicFill;
+    /// Only set between BeginConcurrentFill() and EndConcurrentFill()
+    std::unique_ptr<ConcurrentFill> fConcurrent;
   };
 }
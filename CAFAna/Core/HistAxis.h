@@ -22,7 +22,7 @@ namespace ana
               const std::vector<T>& vars = {})
       : LabelsAndBins(labels, bins), fVars(vars)
     {
-      assert(fBins.size() == fVars.size() || fVars.empty());
+      assert(bins.size() == fVars.size() || fVars.empty());
     }
 
     // Forwards
@@ -76,16 +76,13 @@ namespace ana
 
     // MultiD binning expressed as a composition of existing axes
     _HistAxis(const std::vector<_HistAxis<T>>& axes)
-      : LabelsAndBins(std::vector<std::string>(), std::vector<Binning>())
+      : LabelsAndBins(std::vector<LabelsAndBins>(axes.begin(), axes.end()))
     {
       for(const auto& a: axes){
-        fLabels.insert(fLabels.end(), a.fLabels.begin(), a.fLabels.end());
-        fBins.insert(fBins.end(), a.fBins.begin(), a.fBins.end());
         fVars.insert(fVars.end(), a.fVars.begin(), a.fVars.end());
       }
 
-      assert(fLabels.size() == fBins.size());
-      assert(fBins.size() == fVars.size() || fVars.empty());
+      assert(NDimensions() == fVars.size() || fVars.empty());
     }
 
     _HistAxis(const _HistAxis<T>& xax,
@@ -106,14 +103,14 @@ namespace ana
     const std::vector<T>& GetVars() const {return fVars;}
 
     /// A variable "flattening" all the dimensions into one 1D value. Use
-    /// sparingly.
+    /// sparingly. Where possible, evaluate \ref GetVars individually and fill
+    /// with \ref Spectrum::Fill(const std::vector<double>&, double) instead.
     T GetVar1D() const
     {
       switch(fVars.size()){
+      case 0: HistAxisDimensionError(0);
       case 1: return fVars[0];
-      case 2: return T(fVars[0], fBins[0], fVars[1], fBins[1]);
-      case 3: return T(fVars[0], fBins[0], fVars[1], fBins[1], fVars[2], fBins[2]);
-      default: HistAxisDimensionError(fVars.size());
+      default: return T(fVars, GetBinnings());
       }
     }
 
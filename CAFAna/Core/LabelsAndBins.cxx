@@ -1,56 +1,128 @@
 #include "CAFAna/Core/LabelsAndBins.h"
 
 #include <cassert>
+#include <map>
+#include <mutex>
 
 namespace ana
 {
   //----------------------------------------------------------------------
   LabelsAndBins::LabelsAndBins(const std::vector<std::string>& labels,
                                const std::vector<Binning>& bins)
-    : fLabels(labels), fBins(bins)
+    : fImpl(Intern(labels, bins))
   {
-    assert(fLabels.size() == fBins.size());
+    assert(labels.size() == bins.size());
   }
 
   //----------------------------------------------------------------------
   LabelsAndBins::LabelsAndBins(const std::vector<LabelsAndBins>& axes)
   {
+    std::vector<std::string> labels;
+    std::vector<Binning> bins;
     for(const auto& a: axes){
-      fLabels.insert(fLabels.end(), a.fLabels.begin(), a.fLabels.end());
-      fBins.insert(fBins.end(), a.fBins.begin(), a.fBins.end());
+      labels.insert(labels.end(), a.GetLabels().begin(), a.GetLabels().end());
+      bins.insert(bins.end(), a.GetBinnings().begin(), a.GetBinnings().end());
     }
 
-    assert(fLabels.size() == fBins.size());
+    assert(labels.size() == bins.size());
+
+    fImpl = Intern(labels, bins);
+  }
+
+  //----------------------------------------------------------------------
+  std::shared_ptr<const LabelsAndBins::Impl> LabelsAndBins::
+  Intern(const std::vector<std::string>& labels,
+         const std::vector<Binning>& bins)
+  {
+    auto MakeImpl = [&labels, &bins]()
+    {
+      auto ret = std::make_shared<Impl>();
+      ret->labels = labels;
+      ret->bins = bins;
+      return std::shared_ptr<const Impl>(std::move(ret));
+    };
+
+    // A binning that isn't statically constructed yet will be filled in
+    // later (see DepMan), so we can't know what we'll be identical to. Those
+    // can't be shared.
+    for(const Binning& b: bins) if(!b.IsConstructed()) return MakeImpl();
+
+    // Binnings are shared too, so they can be identified by their
+    // contents. Those are kept alive by any Impl using them, so the pointers
+    // can't be reused while an entry is live.
+    typedef std::pair<std::vector<std::string>, std::vector<const Binning::Impl*>> Key;
+    Key key(labels, {});
+    for(const Binning& b: bins) key.second.push_back(b.fImpl.get());
+
+    // Entries only keep the contents alive as long as some axis uses them
+    static std::mutex mutex;
+    static std::map<Key, std::weak_ptr<const Impl>> registry;
+    static size_t purgeSize = 1024;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::weak_ptr<const Impl>& entry = registry[std::move(key)];
+    std::shared_ptr<const Impl> ret = entry.lock();
+    if(!ret){
+      ret = MakeImpl();
+      entry = ret;
+    }
+
+    // Don't let axes that are long gone pile up
+    if(registry.size() > purgeSize){
+      for(auto it = registry.begin(); it != registry.end();){
+        if(it->second.expired()) it = registry.erase(it); else ++it;
+      }
+      purgeSize = std::max(purgeSize, 2*registry.size());
+    }
+
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  bool LabelsAndBins::operator==(const LabelsAndBins& rhs) const
+  {
+    if(fImpl == rhs.fImpl) return true;
+
+    return GetLabels() == rhs.GetLabels() && GetBinnings() == rhs.GetBinnings();
   }
 
   //----------------------------------------------------------------------
   const Binning& LabelsAndBins::GetBins1D() const
   {
-    if(fBins.size() == 1) return fBins[0];
+    const Impl& impl = *fImpl;
 
-    if(fBins1D) return *fBins1D;
+    if(impl.bins.size() == 1) return impl.bins[0];
 
-    assert(!fBins.empty());
+    // The contents are shared, possibly between threads
+    std::call_once(impl.onceBins1D, [&impl]()
+    {
+      assert(!impl.bins.empty());
 
-    int n = 1;
-    for(const Binning& b: fBins) n *= b.NBins();
-    fBins1D = Binning::Simple(n, 0, n);
+      int n = 1;
+      for(const Binning& b: impl.bins) n *= b.NBins();
+      impl.bins1D = Binning::Simple(n, 0, n);
+    });
 
-    return *fBins1D;
+    return *impl.bins1D;
   }
 
   //----------------------------------------------------------------------
   const std::string& LabelsAndBins::GetLabel1D() const
   {
-    if(fLabels.size() == 1) return fLabels[0];
+    const Impl& impl = *fImpl;
 
-    if(fLabel1D) return *fLabel1D;
+    if(impl.labels.size() == 1) return impl.labels[0];
 
-    fLabel1D = "";
-    for(const std::string& l: fLabels) *fLabel1D += l + " and ";
-    fLabel1D->resize(fLabel1D->size()-5); // drop extra "and"
+    std::call_once(impl.onceLabel1D, [&impl]()
+    {
+      std::string label;
+      for(const std::string& l: impl.labels) label += l + " and ";
+      label.resize(label.size()-5); // drop extra "and"
+      impl.label1D = label;
+    });
 
-    return *fLabel1D;
+    return *impl.label1D;
   }
 
 }
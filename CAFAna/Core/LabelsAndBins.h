@@ -2,10 +2,18 @@
 
 #include "CAFAna/Core/Binning.h"
 
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 
 namespace ana
 {
+  /// \brief Labels and binnings of the axes of a Spectrum or similar
+  ///
+  /// The contents never change once made, and identical ones are shared, so
+  /// copies are cheap and take no extra memory.
   class LabelsAndBins
   {
   public:
@@ -47,6 +55,9 @@ namespace ana
     }
 
     LabelsAndBins(const LabelsAndBins& ax) = default;
+    LabelsAndBins(LabelsAndBins&& ax) = default;
+    LabelsAndBins& operator=(const LabelsAndBins& ax) = default;
+    LabelsAndBins& operator=(LabelsAndBins&& ax) = default;
 
     LabelsAndBins(const std::vector<LabelsAndBins>& axes);
 
@@ -63,20 +74,71 @@ namespace ana
     {
     }
 
-    unsigned int NDimensions() const{return fLabels.size();}
+    unsigned int NDimensions() const{return fImpl->labels.size();}
 
-    const std::vector<std::string>& GetLabels() const {return fLabels;}
-    const std::vector<Binning>& GetBinnings() const {return fBins;}
+    const std::vector<std::string>& GetLabels() const {return fImpl->labels;}
+    const std::vector<Binning>& GetBinnings() const {return fImpl->bins;}
+
+    /// Axes made the same way share their contents, in which case this is a
+    /// pointer comparison
+    bool operator==(const LabelsAndBins& rhs) const;
+    bool operator!=(const LabelsAndBins& rhs) const {return !(*this == rhs);}
 
     /// Appropriate binning and labelling for that 1D Var
     const Binning& GetBins1D() const;
     const std::string& GetLabel1D() const;
 
+    /// \brief Bin in the flattened 1D representation (see \ref GetBins1D)
+    ///
+    /// Follows the ROOT convention of 0 for underflow and N+1 for overflow. If
+    /// any coordinate underflows the entry is underflow, otherwise if any
+    /// overflows it is overflow. The first axis varies slowest.
+    int FindBin(const std::vector<double>& xs) const
+    {
+      assert(xs.size() == fImpl->bins.size());
+      return FindBinWith([&xs](int i){return xs[i];});
+    }
+
+    /// \brief As \ref FindBin, but coordinate i is given by \a coord(i)
+    ///
+    /// Allows the coordinates to be computed on-the-fly with no temporary
+    /// storage.
+    template<class F> int FindBinWith(const F& coord) const
+    {
+      const std::vector<Binning>& bins = fImpl->bins;
+      bool under = false, over = false;
+      int idx = 0;
+      int ntot = 1;
+      for(unsigned int i = 0; i < bins.size(); ++i){
+        const Binning& b = bins[i];
+        const int bin = b.FindBin(coord(i));
+        if(bin == 0) under = true;
+        if(bin > b.NBins()) over = true;
+        idx = idx * b.NBins() + (bin-1);
+        ntot *= b.NBins();
+      }
+
+      if(under) return 0;
+      if(over) return ntot+1;
+      return idx+1;
+    }
+
   protected:
-    std::vector<std::string> fLabels;
-    std::vector<Binning> fBins;
+    struct Impl
+    {
+      std::vector<std::string> labels;
+      std::vector<Binning> bins;
+
+      /// Built on first use by GetBins1D() and GetLabel1D()
+      mutable std::once_flag onceBins1D, onceLabel1D;
+      mutable std::optional<Binning> bins1D;
+      mutable std::optional<std::string> label1D;
+    };
+
+    /// Contents for \a labels and \a bins, shared with any identical ones
+    static std::shared_ptr<const Impl> Intern(const std::vector<std::string>& labels,
+                                              const std::vector<Binning>& bins);
 
-    mutable std::optional<Binning> fBins1D;
-    mutable std::optional<std::string> fLabel1D;
+    std::shared_ptr<const Impl> fImpl;
   };
 }
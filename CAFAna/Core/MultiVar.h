@@ -1,7 +1,9 @@
 #pragma once
 
+#include "CAFAna/Core/LabelsAndBins.h"
 #include "CAFAna/Core/Var.h" // for Var2DMapper
 
+#include <atomic>
 #include <functional>
 #include <vector>
 
@@ -20,7 +22,7 @@ namespace ana
   protected:
     int fID;
     /// The next ID that hasn't yet been assigned
-    static int fgNextID;
+    static std::atomic<int> fgNextID;
   };
 
 
@@ -58,6 +60,12 @@ namespace ana
     {
     } 
 
+    _MultiVar(const std::vector<_MultiVar>& vars,
+              const std::vector<Binning>& bins)
+      : _MultiVar(FuncND(vars, bins))
+    {
+    }
+
     /// Allows a variable to be called with values = myVar(sr) syntax
     std::vector<double> operator()(const T* sr) const
     {
@@ -84,6 +92,33 @@ namespace ana
       const _MultiVar fA, fB, fC;
     };
 
+    struct FuncND
+    {
+      FuncND(const std::vector<_MultiVar>& vars,
+             const std::vector<Binning>& bins)
+        : fVars(vars), fAxis(std::vector<std::string>(bins.size()), bins) {}
+
+      std::vector<double> operator()(const T* x) const
+      {
+        std::vector<std::vector<double>> vals;
+        vals.reserve(fVars.size());
+        for(const _MultiVar& v: fVars) vals.push_back(v(x));
+
+        std::vector<double> ret(vals.empty() ? 0 : vals[0].size());
+        for(unsigned int j = 0; j < ret.size(); ++j){
+          const int bin = fAxis.FindBinWith([&vals, j](int i){
+              assert(vals[i].size() == vals[0].size());
+              return vals[i][j];
+            });
+          ret[j] = (bin == 0) ? -1 : bin-.5;
+        }
+        return ret;
+      }
+
+      const std::vector<_MultiVar> fVars;
+      const LabelsAndBins fAxis;
+    };
+
     std::function<VarFunc_t> fFunc;
   };
 
@@ -10,21 +10,13 @@ namespace ana
   //----------------------------------------------------------------------
   Ratio::Ratio(const Spectrum& num, const Spectrum& denom,
 	       bool purOrEffErrs)
-    : fHist(num.fHist), fAxis(num.GetLabels(), num.GetBinnings())
+    : fHist(num.fHist), fAxis(num.fAxis)
   {
-    fHist.Divide(denom.fHist);
+    // The old histogram operation considered 0/0 = 0, which is actually
+    // pretty useful (at least PredictionInterp relies on this).
+    fHist.Divide(denom.fHist, true);
     fHist.Scale(denom.POT()/num.POT());
 
-    // This is clumsy, but the old histogram operation considered 0/0 = 0,
-    // which is actually pretty useful (at least PredictionInterp relies on
-    // this).
-    for(int i = 0; i < fHist.GetNbinsX()+2; ++i){
-      if(num.fHist.GetBinContent(i) == 0 &&
-         denom.fHist.GetBinContent(i) == 0){
-        fHist.SetBinContent(i, 0);
-      }
-    }
-
     // TODO do something with purOrEffErrs
   }
 
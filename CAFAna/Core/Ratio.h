@@ -9,6 +9,7 @@ namespace ana
   {
   public:
     friend class Spectrum;
+    friend class SpectrumExpr;
 
     /// \param num Numerator of the ratio
     /// \param denom Denominator of the ratio
@@ -41,8 +42,9 @@ namespace ana
     TH2* ToTH2() const;
 
     bool HasStan() const {return fHist.HasStan();}
-    const Eigen::ArrayXd& GetEigen() const {return fHist.GetEigen();}
-    const Eigen::ArrayXstan& GetEigenStan() const {return fHist.GetEigenStan();}
+    Eigen::ArrayXd GetEigen() const {return fHist.GetEigen();}
+    Eigen::ArrayXstan GetEigenStan() const {return fHist.GetEigenStan();}
+    const StanVector& GetStanVector() const {return fHist.GetStanVector();}
 
   protected:
     // For derived classes
@@ -3,15 +3,138 @@
 #include "CAFAna/Core/Binning.h"
 #include "CAFAna/Core/Ratio.h"
 #include "CAFAna/Core/Stan.h"
+#include "CAFAna/Core/ThreadPool.h"
 
 #include "TDirectory.h"
 #include "TH2.h"
+#include "THnSparse.h"
 #include "TObjString.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <memory>
 
+namespace
+{
+  /// out = sum_i scales[i]*ins[i], for arrays of length n
+  void WeightedSum(const std::vector<const double*>& ins,
+                   const std::vector<double>& scales,
+                   int n, double* out)
+  {
+    // Each block of the output stays in cache while all the inputs are added
+    const int kBlockSize = 4096;
+    // Big enough that starting the threads is worth it
+    const int kParallelElems = 1 << 18;
+
+    using ConstMap = Eigen::Map<const Eigen::ArrayXd>;
+
+    auto RunBlocks = [&](int i0, int i1)
+    {
+      for(int j0 = i0; j0 < i1; j0 += kBlockSize){
+        const int m = std::min(kBlockSize, i1-j0);
+        Eigen::Map<Eigen::ArrayXd> o(out+j0, m);
+        o = scales[0] * ConstMap(ins[0]+j0, m);
+        for(unsigned int k = 1; k < ins.size(); ++k){
+          o += scales[k] * ConstMap(ins[k]+j0, m);
+        }
+      }
+    };
+
+    if(n < kParallelElems){
+      RunBlocks(0, n);
+      return;
+    }
+
+    ana::ThreadPool pool;
+    const int nchunks = pool.NThreads();
+    // Whole numbers of blocks per thread
+    const int chunk = (n + nchunks*kBlockSize-1) / (nchunks*kBlockSize) * kBlockSize;
+    for(int i0 = 0; i0 < n; i0 += chunk){
+      const int i1 = std::min(i0+chunk, n);
+      pool.AddTask([&RunBlocks, i0, i1](){RunBlocks(i0, i1);});
+    }
+    pool.Finish();
+  }
+
+  /// m^T * w, or m * w if \a transpose is false. The columns of w are split
+  /// between threads if there's enough work. \a m may be dense or sparse.
+  template<class M> Eigen::MatrixXd Product(const M& m,
+                                            const Eigen::Ref<const Eigen::MatrixXd>& w,
+                                            bool transpose)
+  {
+    // Multiply-adds. Enough that starting the threads is worth it
+    const double kParallelOps = 1 << 24;
+
+    Eigen::MatrixXd ret(transpose ? m.cols() : m.rows(), w.cols());
+
+    // Eigen's product is cache-blocked already
+    auto Columns = [&](int c0, int nc)
+    {
+      if(transpose)
+        ret.middleCols(c0, nc).noalias() = m.transpose() * w.middleCols(c0, nc);
+      else
+        ret.middleCols(c0, nc).noalias() = m * w.middleCols(c0, nc);
+    };
+
+    if(double(m.nonZeros()) * w.cols() < kParallelOps || w.cols() < 2){
+      Columns(0, w.cols());
+      return ret;
+    }
+
+    ana::ThreadPool pool;
+    const int chunk = (w.cols() + pool.NThreads()-1) / pool.NThreads();
+    for(int c0 = 0; c0 < w.cols(); c0 += chunk){
+      const int nc = std::min(chunk, int(w.cols())-c0);
+      pool.AddTask([&Columns, c0, nc](){Columns(c0, nc);});
+    }
+    pool.Finish();
+
+    return ret;
+  }
+
+  /// \brief Copy of a sparse matrix in the stan arena, for the reverse pass
+  ///
+  /// Capturing the SparseMatrix itself would leak it, since nothing on the
+  /// arena is ever destructed
+  class ArenaSparse
+  {
+  public:
+    ArenaSparse(const Eigen::SparseMatrix<double>& m)
+      : fRows(m.rows()), fCols(m.cols()),
+        fVals(Eigen::Map<const Eigen::VectorXd>(m.valuePtr(), m.nonZeros())),
+        fInner(Eigen::Map<const Eigen::VectorXi>(m.innerIndexPtr(), m.nonZeros())),
+        fOuter(Eigen::Map<const Eigen::VectorXi>(m.outerIndexPtr(), m.outerSize()+1))
+    {
+      assert(m.isCompressed());
+    }
+
+    Eigen::Map<const Eigen::SparseMatrix<double>> Get() const
+    {
+      return Eigen::Map<const Eigen::SparseMatrix<double>>(fRows, fCols, fVals.size(),
+                                                           fOuter.data(), fInner.data(),
+                                                           fVals.data());
+    }
+
+  protected:
+    int fRows, fCols;
+    stan::math::arena_t<Eigen::VectorXd> fVals;
+    stan::math::arena_t<Eigen::VectorXi> fInner, fOuter;
+  };
+
+  /// Helper for \ref Unweighted
+  template<class M> Eigen::ArrayXd ProjectionX(const M& mat)
+  {
+    return Eigen::RowVectorXd::Ones(mat.rows()) * mat;
+  }
+
+  /// Helper for \ref WeightingVariable
+  template<class M> Eigen::ArrayXd ProjectionY(const M& mat)
+  {
+    return mat * Eigen::VectorXd::Ones(mat.cols());
+  }
+}
+
 namespace ana
 {
   //----------------------------------------------------------------------
@@ -19,11 +142,49 @@ namespace ana
                                              const LabelsAndBins& recoAxis,
                                              const LabelsAndBins& trueAxis,
                                              double pot, double livetime)
-    : fMat(mat), fPOT(pot), fLivetime(livetime),
+    : fMat(mat), fSparse(false), fDenseFillFrac(0),
+      fPOT(pot), fLivetime(livetime),
       fAxisX(recoAxis), fAxisY(trueAxis)
   {
   }
 
+  //----------------------------------------------------------------------
+  ReweightableSpectrum::ReweightableSpectrum(Eigen::SparseMatrix<double>&& mat,
+                                             const LabelsAndBins& recoAxis,
+                                             const LabelsAndBins& trueAxis,
+                                             double pot, double livetime)
+    : fSparse(true), fMatSparse(std::move(mat)), fDenseFillFrac(0),
+      fPOT(pot), fLivetime(livetime),
+      fAxisX(recoAxis), fAxisY(trueAxis)
+  {
+    fMatSparse.makeCompressed();
+  }
+
+  //----------------------------------------------------------------------
+  void ReweightableSpectrum::InitMatrix(Spectrum::ESparse sparse)
+  {
+    const int nrows = fAxisY.GetBins1D().NBins()+2;
+    const int ncols = fAxisX.GetBins1D().NBins()+2;
+
+    fSparse = (sparse == Spectrum::kSparse || sparse == Spectrum::kAdaptive);
+    fDenseFillFrac = (sparse == Spectrum::kAdaptive) ? .25 : 0;
+
+    if(fSparse){
+      fMatSparse.resize(nrows, ncols);
+      fMat.resize(0, 0);
+    }
+    else{
+      fMat.setZero(nrows, ncols);
+      fMatSparse.resize(0, 0);
+    }
+    fSparseBuffer.clear();
+
+    // Derived classes may fill the matrix directly, so only compute these
+    // once they're asked for
+    fProjX.resize(0);
+    fProjY.resize(0);
+  }
+
   //----------------------------------------------------------------------
   ReweightableSpectrum::~ReweightableSpectrum()
   {
@@ -37,6 +198,12 @@ namespace ana
     DontAddDirectory guard;
 
     fMat = rhs.fMat;
+    fSparse = rhs.fSparse;
+    fMatSparse = rhs.fMatSparse;
+    fSparseBuffer = rhs.fSparseBuffer;
+    fDenseFillFrac = rhs.fDenseFillFrac;
+    if(const Eigen::ArrayXd* p = rhs.CachedProjection(rhs.fProjX)) fProjX = *p;
+    if(const Eigen::ArrayXd* p = rhs.CachedProjection(rhs.fProjY)) fProjY = *p;
     fPOT = rhs.fPOT;
     fLivetime = rhs.fLivetime;
 
@@ -54,6 +221,14 @@ namespace ana
     fAxisY = rhs.fAxisY;
 
     fMat = rhs.fMat;
+    fSparse = rhs.fSparse;
+    fMatSparse = rhs.fMatSparse;
+    fSparseBuffer = rhs.fSparseBuffer;
+    fDenseFillFrac = rhs.fDenseFillFrac;
+    const Eigen::ArrayXd* projX = rhs.CachedProjection(rhs.fProjX);
+    const Eigen::ArrayXd* projY = rhs.CachedProjection(rhs.fProjY);
+    if(projX) fProjX = *projX; else fProjX.resize(0);
+    if(projY) fProjY = *projY; else fProjY.resize(0);
     fPOT = rhs.fPOT;
     fLivetime = rhs.fLivetime;
 
@@ -70,9 +245,20 @@ namespace ana
 
     TH2D* ret = MakeTH2D(UniqueName().c_str(), "", fAxisX.GetBins1D(), fAxisY.GetBins1D());
 
-    for(int i = 0; i < fMat.rows(); ++i){
-      for(int j = 0; j < fMat.cols(); ++j){
-        ret->SetBinContent(j, i, fMat(i, j));
+    if(fSparse){
+      Eigen::SparseMatrix<double> tmp;
+      const Eigen::SparseMatrix<double>& mat = MergedSparse(tmp);
+      for(int j = 0; j < mat.outerSize(); ++j){
+        for(Eigen::SparseMatrix<double>::InnerIterator it(mat, j); it; ++it){
+          ret->SetBinContent(j, it.row(), it.value());
+        }
+      }
+    }
+    else{
+      for(int i = 0; i < fMat.rows(); ++i){
+        for(int j = 0; j < fMat.cols(); ++j){
+          ret->SetBinContent(j, i, fMat(i, j));
+        }
       }
     }
 
@@ -93,59 +279,228 @@ namespace ana
   //----------------------------------------------------------------------
   void ReweightableSpectrum::Fill(double x, double y, double w)
   {
-    fMat(fAxisY.GetBins1D().FindBin(y), fAxisX.GetBins1D().FindBin(x)) += w;
+    const int row = fAxisY.GetBins1D().FindBin(y);
+    const int col = fAxisX.GetBins1D().FindBin(x);
+
+    if(fSparse){
+      fSparseBuffer[int64_t(col)*fMatSparse.rows() + row] += w;
+      AdaptStorage();
+    }
+    else{
+      fMat(row, col) += w;
+    }
+
+    if(fProjX.size() > 0) fProjX[col] += w;
+    if(fProjY.size() > 0) fProjY[row] += w;
   }
 
-  /// Helper for \ref Unweighted
-  inline Eigen::ArrayXd ProjectionX(const Eigen::MatrixXd& mat)
+  //----------------------------------------------------------------------
+  Eigen::MatrixXd ReweightableSpectrum::GetEigen(double pot) const
   {
-    return Eigen::RowVectorXd::Ones(mat.rows()) * mat;
+    if(!fSparse) return fMat * pot/fPOT;
+
+    Eigen::SparseMatrix<double> tmp;
+    return Eigen::MatrixXd(MergedSparse(tmp)) * pot/fPOT;
   }
 
-  /// Helper for \ref WeightingVariable
-  inline Eigen::ArrayXd ProjectionY(const Eigen::MatrixXd& mat)
+  //----------------------------------------------------------------------
+  const Eigen::ArrayXd& ReweightableSpectrum::ProjX() const
   {
-    return mat * Eigen::VectorXd::Ones(mat.cols());
+    std::lock_guard<std::mutex> lock(fProjMutex);
+
+    if(fProjX.size() == 0){
+      Eigen::ArrayXd proj = fSparse ? ProjectionX(fMatSparse) : ProjectionX(fMat);
+      // Add in the pending fills, rather than flushing them into the matrix
+      // under any other readers
+      for(const auto& it: fSparseBuffer) proj[it.first / NRows()] += it.second;
+      fProjX = std::move(proj);
+    }
+    return fProjX;
+  }
+
+  //----------------------------------------------------------------------
+  const Eigen::ArrayXd& ReweightableSpectrum::ProjY() const
+  {
+    std::lock_guard<std::mutex> lock(fProjMutex);
+
+    if(fProjY.size() == 0){
+      Eigen::ArrayXd proj = fSparse ? ProjectionY(fMatSparse) : ProjectionY(fMat);
+      for(const auto& it: fSparseBuffer) proj[it.first % NRows()] += it.second;
+      fProjY = std::move(proj);
+    }
+    return fProjY;
+  }
+
+  //----------------------------------------------------------------------
+  const Eigen::ArrayXd* ReweightableSpectrum::
+  CachedProjection(const Eigen::ArrayXd& proj) const
+  {
+    // Once computed, only non-const methods can invalidate it again
+    std::lock_guard<std::mutex> lock(fProjMutex);
+    return proj.size() > 0 ? &proj : 0;
   }
 
   //----------------------------------------------------------------------
   Spectrum ReweightableSpectrum::UnWeighted() const
   {
-    return Spectrum(Hist::Adopt(ProjectionX(fMat)), fAxisX, fPOT, fLivetime);
+    return Spectrum(Hist::Adopt(Eigen::ArrayXd(ProjX())), fAxisX, fPOT, fLivetime);
   }
 
   //----------------------------------------------------------------------
   Spectrum ReweightableSpectrum::WeightingVariable() const
   {
-    return Spectrum(Hist::Adopt(ProjectionY(fMat)), fAxisY, fPOT, fLivetime);
+    return Spectrum(Hist::Adopt(Eigen::ArrayXd(ProjY())), fAxisY, fPOT, fLivetime);
   }
 
   //----------------------------------------------------------------------
   Spectrum ReweightableSpectrum::WeightedBy(const Ratio& ws) const
   {
+    Eigen::SparseMatrix<double> tmp;
+    const Eigen::SparseMatrix<double>& matSparse = fSparse ? MergedSparse(tmp) : fMatSparse;
+
     if(!ws.HasStan()){
       const Eigen::VectorXd& vec = ws.GetEigen();
 
+      if(fSparse){
+        return Spectrum(Hist::Adopt(Eigen::ArrayXd(matSparse.transpose() * vec)),
+                        fAxisX, fPOT, fLivetime);
+      }
+
       return Spectrum(Hist::Adopt(Eigen::ArrayXd(vec.transpose() * fMat)),
                       fAxisX, fPOT, fLivetime);
     }
     else{
-      const Eigen::VectorXstan& vec = ws.GetEigenStan();
+      const StanVector& vec = ws.GetStanVector();
+
+      // A single node for the whole product. The reverse pass needs its own
+      // copy of the matrix, in the stan arena.
+      StanVector ret;
+      if(fSparse){
+        const ArenaSparse mat(matSparse);
+        ret = stan::math::make_callback_var(Eigen::VectorXd(matSparse.transpose() * vec.val()),
+                                            [vec, mat](auto& vi) mutable
+                                            {
+                                              vec.adj() += mat.Get() * vi.adj();
+                                            });
+      }
+      else{
+        stan::math::arena_t<Eigen::MatrixXd> mat = fMat;
+        ret = stan::math::make_callback_var(Eigen::VectorXd(fMat.transpose() * vec.val()),
+                                            [vec, mat](auto& vi) mutable
+                                            {
+                                              vec.adj() += mat * vi.adj();
+                                            });
+      }
 
-      return Spectrum(Hist::AdoptStan(vec.transpose() * fMat),
+      return Spectrum(Hist::AdoptStan(std::move(ret)),
                       fAxisX, fPOT, fLivetime);
     }
   }
 
+  //----------------------------------------------------------------------
+  std::vector<Spectrum> ReweightableSpectrum::
+  WeightedBy(const Eigen::MatrixXd& weights) const
+  {
+    if(weights.rows() != NRows()){
+      std::cout << "ReweightableSpectrum::WeightedBy(): weights have "
+                << weights.rows() << " rows, but there are " << NRows()
+                << " true bins" << std::endl;
+      abort();
+    }
+
+    Eigen::SparseMatrix<double> tmp;
+    const Eigen::MatrixXd reco = fSparse ? Product(MergedSparse(tmp), weights, true) : Product(fMat, weights, true);
+
+    std::vector<Spectrum> ret;
+    ret.reserve(reco.cols());
+    for(int i = 0; i < reco.cols(); ++i){
+      ret.emplace_back(Hist::Adopt(Eigen::ArrayXd(reco.col(i))), fAxisX, fPOT, fLivetime);
+    }
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  std::vector<Spectrum> ReweightableSpectrum::
+  WeightedBy(const std::vector<StanVector>& weights) const
+  {
+    Eigen::MatrixXd vals(NRows(), weights.size());
+    for(unsigned int i = 0; i < weights.size(); ++i){
+      if(weights[i].size() != NRows()){
+        std::cout << "ReweightableSpectrum::WeightedBy(): weights have "
+                  << weights[i].size() << " entries, but there are "
+                  << NRows() << " true bins" << std::endl;
+        abort();
+      }
+      vals.col(i) = weights[i].val();
+    }
+
+    Eigen::SparseMatrix<double> tmp;
+    const Eigen::SparseMatrix<double>& matSparse = fSparse ? MergedSparse(tmp) : fMatSparse;
+    const Eigen::MatrixXd reco = fSparse ? Product(matSparse, vals, true) : Product(fMat, vals, true);
+
+    // The outputs are plain nodes with no reverse pass of their own. A single
+    // callback, which runs once all their adjoints are known, propagates
+    // them all back to the weights with one product.
+    stan::math::arena_t<std::vector<StanVector>> ins(weights.begin(), weights.end());
+    stan::math::arena_t<std::vector<StanVector>> outs;
+    outs.reserve(weights.size());
+    for(int i = 0; i < reco.cols(); ++i) outs.emplace_back(Eigen::VectorXd(reco.col(i)));
+
+    // Used with either type of matrix
+    auto Backprop = [ins, outs](const auto& mat) mutable
+    {
+      Eigen::MatrixXd adj(mat.cols(), outs.size());
+      for(unsigned int i = 0; i < outs.size(); ++i) adj.col(i) = outs[i].adj();
+
+      const Eigen::MatrixXd grad = Product(mat, adj, false);
+      for(unsigned int i = 0; i < ins.size(); ++i) ins[i].adj() += grad.col(i);
+    };
+
+    if(fSparse){
+      const ArenaSparse mat(matSparse);
+      stan::math::reverse_pass_callback([Backprop, mat]() mutable {Backprop(mat.Get());});
+    }
+    else{
+      stan::math::arena_t<Eigen::MatrixXd> mat = fMat;
+      stan::math::reverse_pass_callback([Backprop, mat]() mutable {Backprop(mat);});
+    }
+
+    std::vector<Spectrum> ret;
+    ret.reserve(outs.size());
+    for(StanVector v: outs){
+      ret.emplace_back(Hist::AdoptStan(std::move(v)), fAxisX, fPOT, fLivetime);
+    }
+    return ret;
+  }
+
   //----------------------------------------------------------------------
   void ReweightableSpectrum::ReweightToTrueSpectrum(const Spectrum& target)
   {
     // This is a big component of what extrapolations do, so it should be fast
 
+    // Pending fills need reweighting too
+    FlushSparse();
+
     const Ratio ratio(target, WeightingVariable());
+    const Eigen::ArrayXd& r = ratio.GetEigen();
     // We want to multiply all the rows by this ratio, so left-multiply
 
-    fMat = ratio.GetEigen().matrix().asDiagonal() * fMat;
+    if(fSparse){
+      fMatSparse = r.matrix().asDiagonal() * fMatSparse;
+      // Cells scaled to zero don't need storing
+      fMatSparse.prune(0.);
+    }
+    else{
+      fMat = r.matrix().asDiagonal() * fMat;
+    }
+    AdaptStorage();
+
+    // Each row was scaled, so its sum was too. Except that an infinite
+    // factor for an empty row gives NaN from dense storage but zero from
+    // sparse. The other projection needs a full pass, so wait until it's
+    // asked for.
+    if(fProjY.size() > 0 && r.isFinite().all()) fProjY *= r; else fProjY.resize(0);
+    fProjX.resize(0);
   }
 
   //----------------------------------------------------------------------
@@ -153,83 +508,208 @@ namespace ana
   {
     // This is a big component of what extrapolations do, so it should be fast
 
+    // As above
+    FlushSparse();
+
     const Ratio ratio(target, UnWeighted());
+    const Eigen::ArrayXd& r = ratio.GetEigen();
     // We want to multiply all the columns by this ratio
 
-    fMat *= ratio.GetEigen().matrix().asDiagonal();
+    if(fSparse){
+      fMatSparse = fMatSparse * r.matrix().asDiagonal();
+      fMatSparse.prune(0.);
+    }
+    else{
+      fMat *= r.matrix().asDiagonal();
+    }
+    AdaptStorage();
+
+    // As for ReweightToTrueSpectrum()
+    if(fProjX.size() > 0 && r.isFinite().all()) fProjX *= r; else fProjX.resize(0);
+    fProjY.resize(0);
   }
 
   //----------------------------------------------------------------------
   ReweightableSpectrum& ReweightableSpectrum::PlusEqualsHelper(const ReweightableSpectrum& rhs, int sign)
   {
     // In this case it would be OK to have no POT/livetime
-    if(rhs.fMat.sum() == 0) return *this;
+    if(rhs.IsZero()) return *this;
+
+    const double scale = CombineExposures(fPOT, fLivetime, rhs.fPOT, rhs.fLivetime);
+    if(scale != 0) AddScaled(rhs, sign*scale);
+    return *this;
+  }
 
+  //----------------------------------------------------------------------
+  void ReweightableSpectrum::AddScaled(const ReweightableSpectrum& rhs,
+                                       double scale)
+  {
+    // Only use the rhs projections if they're already there
+    const Eigen::ArrayXd* rhsX = rhs.CachedProjection(rhs.fProjX);
+    const Eigen::ArrayXd* rhsY = rhs.CachedProjection(rhs.fProjY);
+    if(fProjX.size() > 0 && rhsX) fProjX += scale * *rhsX; else fProjX.resize(0);
+    if(fProjY.size() > 0 && rhsY) fProjY += scale * *rhsY; else fProjY.resize(0);
+
+    FlushSparse();
+    Eigen::SparseMatrix<double> tmp;
+    const Eigen::SparseMatrix<double>& rhsSparse = rhs.fSparse ? rhs.MergedSparse(tmp) : rhs.fMatSparse;
+
+    // The result is dense unless both are sparse
+    if(fSparse && !rhs.fSparse) SparseToDense();
+
+    if(fSparse)
+      fMatSparse += rhsSparse * scale;
+    else if(rhs.fSparse)
+      fMat += rhsSparse * scale;
+    else
+      fMat += rhs.fMat * scale;
+
+    AdaptStorage();
+  }
 
-    if((!fPOT && !fLivetime) || (!rhs.fPOT && !rhs.fLivetime)){
+  //----------------------------------------------------------------------
+  double ReweightableSpectrum::CombineExposures(double& pot, double& livetime,
+                                                double rhsPOT, double rhsLivetime)
+  {
+    if((!pot && !livetime) || (!rhsPOT && !rhsLivetime)){
       std::cout << "Error: can't sum ReweightableSpectrum with no POT or livetime."
-                << fPOT << " " << rhs.fPOT
+                << pot << " " << rhsPOT
                 << std::endl;
       //      abort();
-      return *this;
+      return 0;
     }
 
-    if(!fLivetime && !rhs.fPOT){
+    if(!livetime && !rhsPOT){
       std::cout << "Error: can't sum ReweightableSpectrum with POT ("
-                << fPOT << ") but no livetime and ReweightableSpectrum with livetime ("
-                << rhs.fLivetime << " sec) but no POT." << std::endl;
+                << pot << ") but no livetime and ReweightableSpectrum with livetime ("
+                << rhsLivetime << " sec) but no POT." << std::endl;
       abort();
     }
 
-    if(!fPOT && !rhs.fLivetime){
+    if(!pot && !rhsLivetime){
       std::cout << "Error: can't sum ReweightableSpectrum with livetime ("
-                << fLivetime << " sec) but no POT and ReweightableSpectrum with POT ("
-                << rhs.fPOT << ") but no livetime." << std::endl;
+                << livetime << " sec) but no POT and ReweightableSpectrum with POT ("
+                << rhsPOT << ") but no livetime." << std::endl;
       abort();
     }
 
     // And now there are still a bunch of good cases to consider
 
-    if(fPOT && rhs.fPOT){
+    if(pot && rhsPOT){
       // Scale by POT when possible
-      fMat += rhs.fMat * sign*fPOT/rhs.fPOT;
+      const double scale = pot/rhsPOT;
 
-      if(fLivetime && rhs.fLivetime){
+      if(livetime && rhsLivetime){
         // If POT/livetime ratios match, keep regular lifetime, otherwise zero
         // it out.
-        if(AlmostEqual(fLivetime*rhs.fPOT, rhs.fLivetime*fPOT))
-          fLivetime = 0;
+        if(AlmostEqual(livetime*rhsPOT, rhsLivetime*pot))
+          livetime = 0;
       }
-      if(!fLivetime && rhs.fLivetime){
+      if(!livetime && rhsLivetime){
         // If the RHS has a livetime and we don't, copy it in (suitably scaled)
-        fLivetime = rhs.fLivetime * fPOT/rhs.fPOT;
+        livetime = rhsLivetime * pot/rhsPOT;
       }
       // Otherwise, keep our own livetime (if any)
 
-      return *this;
+      return scale;
     }
 
-    if(fLivetime && rhs.fLivetime){
+    if(livetime && rhsLivetime){
       // Scale by livetime, the only thing in common
-      fMat += rhs.fMat * sign*fLivetime/rhs.fLivetime;
+      const double scale = livetime/rhsLivetime;
 
-      if(!fPOT && rhs.fPOT){
+      if(!pot && rhsPOT){
         // If the RHS has a POT and we don't, copy it in (suitably scaled)
-        fPOT = rhs.fPOT * fLivetime/rhs.fLivetime;
+        pot = rhsPOT * livetime/rhsLivetime;
       }
       // Otherwise, keep our own POT (if any)
 
-      return *this;
+      return scale;
     }
 
     // That should have been all the cases. I definitely want to know what
     // happened if it wasn't.
     std::cout << "ReweightableSpectrum::operator+=(). How did we get here? "
-              << fPOT << " " << fLivetime << " "
-              << rhs.fPOT << " " << rhs.fLivetime << std::endl;
+              << pot << " " << livetime << " "
+              << rhsPOT << " " << rhsLivetime << std::endl;
     abort();
   }
 
+  //----------------------------------------------------------------------
+  ReweightableSpectrum ReweightableSpectrum::Sum(const std::vector<const ReweightableSpectrum*>& specs,
+                                                 const std::vector<double>& weights)
+  {
+    if(specs.empty()){
+      std::cout << "ReweightableSpectrum::Sum(): no spectra to sum" << std::endl;
+      abort();
+    }
+    if(!weights.empty() && weights.size() != specs.size()){
+      std::cout << "ReweightableSpectrum::Sum(): " << specs.size()
+                << " spectra but " << weights.size() << " weights" << std::endl;
+      abort();
+    }
+
+    const ReweightableSpectrum& first = *specs[0];
+
+    ReweightableSpectrum ret(first.fAxisX, first.fAxisY);
+    ret.fPOT = first.fPOT;
+    ret.fLivetime = first.fLivetime;
+
+    // Work out the exposure of the result, and what each input needs to be
+    // scaled by, before touching any bins
+    std::vector<const ReweightableSpectrum*> terms = {&first};
+    std::vector<double> scales = {weights.empty() ? 1 : weights[0]};
+    bool allDense = !first.fSparse;
+
+    for(unsigned int i = 1; i < specs.size(); ++i){
+      const ReweightableSpectrum& s = *specs[i];
+      assert(s.NRows() == first.NRows() &&
+             s.NCols() == first.NCols());
+
+      // Same as PlusEqualsHelper
+      if(s.IsZero()) continue;
+      const double scale = CombineExposures(ret.fPOT, ret.fLivetime, s.fPOT, s.fLivetime);
+      if(scale == 0) continue;
+
+      terms.push_back(&s);
+      scales.push_back((weights.empty() ? 1 : weights[i]) * scale);
+      if(s.fSparse) allDense = false;
+    }
+
+    if(!allDense){
+      // Sparse addition is already a single merge of the non-zero entries
+      ret.fSparse = first.fSparse;
+      ret.fMat = first.fMat * scales[0];
+      Eigen::SparseMatrix<double> tmp;
+      ret.fMatSparse = first.MergedSparse(tmp) * scales[0];
+      ret.fDenseFillFrac = first.fDenseFillFrac;
+      for(unsigned int i = 1; i < terms.size(); ++i) ret.AddScaled(*terms[i], scales[i]);
+    }
+    else{
+      std::vector<const double*> mats;
+      for(const ReweightableSpectrum* s: terms) mats.push_back(s->fMat.data());
+
+      ret.fMat.resize(first.fMat.rows(), first.fMat.cols());
+      WeightedSum(mats, scales, ret.fMat.size(), ret.fMat.data());
+    }
+
+    // The projections can be summed too, if all the inputs have them
+    bool cached = true;
+    for(const ReweightableSpectrum* s: terms){
+      if(!s->CachedProjection(s->fProjX) || !s->CachedProjection(s->fProjY)) cached = false;
+    }
+    if(cached){
+      ret.fProjX = scales[0] * first.fProjX;
+      ret.fProjY = scales[0] * first.fProjY;
+      for(unsigned int i = 1; i < terms.size(); ++i){
+        ret.fProjX += scales[i] * terms[i]->fProjX;
+        ret.fProjY += scales[i] * terms[i]->fProjY;
+      }
+    }
+
+    return ret;
+  }
+
   //----------------------------------------------------------------------
   ReweightableSpectrum& ReweightableSpectrum::operator+=(const ReweightableSpectrum& rhs)
   {
@@ -262,6 +742,100 @@ namespace ana
   void ReweightableSpectrum::Clear()
   {
     fMat.setZero();
+    fMatSparse.setZero();
+    fSparseBuffer.clear();
+    // As for InitMatrix()
+    fProjX.resize(0);
+    fProjY.resize(0);
+  }
+
+  //----------------------------------------------------------------------
+  bool ReweightableSpectrum::IsZero() const
+  {
+    // Faster than testing the sum, since any() stops at the first non-zero
+    if(fSparse){
+      Eigen::SparseMatrix<double> tmp;
+      return !(MergedSparse(tmp).coeffs() != 0).any();
+    }
+    return !(fMat.array() != 0).any();
+  }
+
+  //----------------------------------------------------------------------
+  void ReweightableSpectrum::AdaptStorage()
+  {
+    if(fDenseFillFrac <= 0) return;
+
+    if(fSparse){
+      const double limit = fDenseFillFrac * double(fMatSparse.rows()) * fMatSparse.cols();
+
+      // Every buffered entry is a distinct cell, so this alone proves we're
+      // over the limit
+      if(fSparseBuffer.size() > limit){SparseToDense(); return;}
+
+      // We might be over. Only pay for the merge to find out once a decent
+      // number of new entries have built up.
+      if(fMatSparse.nonZeros() + fSparseBuffer.size() > limit &&
+         fSparseBuffer.size() > limit/8) FlushSparse();
+
+      if(fSparseBuffer.empty() && fMatSparse.nonZeros() > limit) SparseToDense();
+    }
+    else{
+      // Hysteresis, so we don't keep flipping back and forth
+      if((fMat.array() != 0).count() < fDenseFillFrac/2 * fMat.size()) DenseToSparse();
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void ReweightableSpectrum::SparseToDense()
+  {
+    assert(fSparse);
+
+    FlushSparse();
+    fMat = Eigen::MatrixXd(fMatSparse);
+    fMatSparse = Eigen::SparseMatrix<double>();
+    fSparse = false;
+  }
+
+  //----------------------------------------------------------------------
+  void ReweightableSpectrum::DenseToSparse()
+  {
+    assert(!fSparse);
+
+    fMatSparse = fMat.sparseView();
+    fMat.resize(0, 0);
+    fSparse = true;
+  }
+
+  //----------------------------------------------------------------------
+  void ReweightableSpectrum::FlushSparse()
+  {
+    if(fSparseBuffer.empty()) return;
+
+    // Something is pending, so this always merges into tmp
+    Eigen::SparseMatrix<double> tmp;
+    MergedSparse(tmp);
+    fMatSparse.swap(tmp);
+    fSparseBuffer.clear();
+  }
+
+  //----------------------------------------------------------------------
+  const Eigen::SparseMatrix<double>& ReweightableSpectrum::
+  MergedSparse(Eigen::SparseMatrix<double>& tmp) const
+  {
+    if(fSparseBuffer.empty()) return fMatSparse;
+
+    const int nrows = fMatSparse.rows();
+
+    std::vector<Eigen::Triplet<double>> pending;
+    pending.reserve(fSparseBuffer.size());
+    for(const auto& it: fSparseBuffer){
+      pending.emplace_back(it.first % nrows, it.first / nrows, it.second);
+    }
+
+    Eigen::SparseMatrix<double> add(nrows, fMatSparse.cols());
+    add.setFromTriplets(pending.begin(), pending.end());
+    tmp = fMatSparse + add;
+    return tmp;
   }
 
   //----------------------------------------------------------------------
@@ -294,8 +868,35 @@ namespace ana
 
     TObjString(type.c_str()).Write("type");
 
-    TH2* h = ToTH2(fPOT);
-    h->Write("hist");
+    if(fSparse){
+      // Only the filled cells. Otherwise the file is as big as the dense
+      // matrix would have been
+      Eigen::SparseMatrix<double> tmpMat;
+      const Eigen::SparseMatrix<double>& mat = MergedSparse(tmpMat);
+
+      const Binning xbins = fAxisX.GetBins1D();
+      const Binning ybins = fAxisY.GetBins1D();
+      const int n[2] = {xbins.NBins(), ybins.NBins()};
+      const double x0[2] = {xbins.IsSimple() ? xbins.Min() : 0,
+                            ybins.IsSimple() ? ybins.Min() : 0};
+      const double x1[2] = {xbins.IsSimple() ? xbins.Max() : xbins.NBins(),
+                            ybins.IsSimple() ? ybins.Max() : ybins.NBins()};
+      THnSparseD h("", "", 2, n, x0, x1);
+
+      for(int j = 0; j < mat.outerSize(); ++j){
+        for(Eigen::SparseMatrix<double>::InnerIterator it(mat, j); it; ++it){
+          const int idx[2] = {j, int(it.row())};
+          h.SetBinContent(idx, it.value());
+        }
+      }
+
+      h.Write("hist_sparse");
+    }
+    else{
+      TH2* h = ToTH2(fPOT);
+      h->Write("hist");
+      delete h;
+    }
 
     TH1D hPot("", "", 1, 0, 1);
     hPot.Fill(.5, fPOT);
@@ -317,8 +918,6 @@ namespace ana
     dir->Write();
     delete dir;
 
-    delete h;
-
     tmp->cd();
   }
 
@@ -334,7 +933,8 @@ namespace ana
     delete tag;
 
     TH2D* spect = (TH2D*)dir->Get("hist");
-    assert(spect);
+    THnSparseD* spectSparse = (THnSparseD*)dir->Get("hist_sparse");
+    assert(bool(spect) != bool(spectSparse));
     TH1* hPot = (TH1*)dir->Get("pot");
     assert(hPot);
     TH1* hLivetime = (TH1*)dir->Get("livetime");
@@ -363,23 +963,45 @@ namespace ana
       labelsy.push_back(labely ? labely->GetString().Data() : "");
     }
 
-    // Backwards compatibility
+    // Backwards compatibility. Sparse files always have the y axis saved
     if(labelsy.empty()) labelsy.push_back(spect->GetYaxis()->GetTitle());
     if(binsy.empty()) binsy.push_back(Binning::FromTAxis(spect->GetYaxis()));
 
     const LabelsAndBins xax(labels, bins);
     const LabelsAndBins yax(labelsy, binsy);
 
-    // ROOT histogram storage is row-major, but Eigen is column-major by
-    // default
-    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen:: Dynamic, Eigen::RowMajor> MatRowMajor;
-    auto ret = std::make_unique<ReweightableSpectrum>(
-      Eigen::Map<MatRowMajor>(spect->GetArray(),
-                              yax.GetBins1D().NBins()+2,
-                              xax.GetBins1D().NBins()+2),
-      xax, yax, hPot->Integral(0, -1), hLivetime->Integral(0, -1));
+    const int nrows = yax.GetBins1D().NBins()+2;
+    const int ncols = xax.GetBins1D().NBins()+2;
+
+    std::unique_ptr<ReweightableSpectrum> ret;
+
+    if(spect){
+      // ROOT histogram storage is row-major, but Eigen is column-major by
+      // default
+      typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen:: Dynamic, Eigen::RowMajor> MatRowMajor;
+      ret = std::make_unique<ReweightableSpectrum>(
+        Eigen::Map<MatRowMajor>(spect->GetArray(), nrows, ncols),
+        xax, yax, hPot->Integral(0, -1), hLivetime->Integral(0, -1));
+    }
+    else{
+      std::vector<Eigen::Triplet<double>> cells;
+      cells.reserve(spectSparse->GetNbins());
+      for(int i = 0; i < spectSparse->GetNbins(); ++i){
+        int idx[2];
+        const double z = spectSparse->GetBinContent(i, idx);
+        cells.emplace_back(idx[1], idx[0], z);
+      }
+
+      Eigen::SparseMatrix<double> mat(nrows, ncols);
+      mat.setFromTriplets(cells.begin(), cells.end());
+
+      ret = std::make_unique<ReweightableSpectrum>(
+        std::move(mat),
+        xax, yax, hPot->Integral(0, -1), hLivetime->Integral(0, -1));
+    }
 
     delete spect;
+    delete spectSparse;
 
     delete hPot;
     delete hLivetime;
@@ -2,7 +2,13 @@
 
 #include "CAFAna/Core/Spectrum.h"
 
+#include <Eigen/SparseCore>
+
+#include <cstdint>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 class TDirectory;
 class TH2;
@@ -22,19 +28,29 @@ namespace ana
     friend class ReweightableSpectrumSink;
     friend class SpectrumSinkBase<ReweightableSpectrum>;
 
+    /// \param sparse kSparse stores only the filled cells of the matrix.
+    ///               kAdaptive starts out sparse and switches to dense storage
+    ///               once enough of it is filled. Compact storage types are
+    ///               not supported, and give kDense.
     template<class T, class U>
     ReweightableSpectrum(SpectrumLoaderBase& loader,
                          const _HistAxis<_Var<T>>& recoAxis,
                          const _HistAxis<_Var<T>>& trueAxis,
                          const _Cut<T, U>& cut,
                          const SystShifts& shift = kNoShift,
-                         const _Weight<T>& wei = Unweighted<T>());
+                         const _Weight<T>& wei = Unweighted<T>(),
+                         Spectrum::ESparse sparse = Spectrum::kDense);
 
     ReweightableSpectrum(const Eigen::MatrixXd&& mat,
                          const LabelsAndBins& recoAxis,
                          const LabelsAndBins& trueAxis,
                          double pot, double livetime);
 
+    ReweightableSpectrum(Eigen::SparseMatrix<double>&& mat,
+                         const LabelsAndBins& recoAxis,
+                         const LabelsAndBins& trueAxis,
+                         double pot, double livetime);
+
     /// The only valid thing to do with such a spectrum is to assign something
     /// else into it.
     static ReweightableSpectrum Uninitialized(){return ReweightableSpectrum();}
@@ -49,6 +65,7 @@ namespace ana
     TH2D* ToTH2(double pot) const;
 
     double POT() const{return fPOT;}
+    bool IsSparse() const{return fSparse;}
     double Livetime() const{return fLivetime;}
 
     Spectrum UnWeighted() const;
@@ -58,6 +75,18 @@ namespace ana
     /// Reco spectrum with truth weights applied
     Spectrum WeightedBy(const Ratio& weights) const;
 
+    /// \brief Reco spectra for many sets of truth weights at once
+    ///
+    /// Much faster than calling \ref WeightedBy once per set, since all the
+    /// products are done in a single matrix multiplication, which is also
+    /// split between threads if it's big enough.
+    ///
+    /// \param weights One column per set of weights (eg per oscillation
+    ///                point), with one row per true bin
+    std::vector<Spectrum> WeightedBy(const Eigen::MatrixXd& weights) const;
+    /// The gradients for all the sets are propagated in one go too
+    std::vector<Spectrum> WeightedBy(const std::vector<StanVector>& weights) const;
+
     /// Rescale bins so that \ref WeightingVariable will return \a target
     void ReweightToTrueSpectrum(const Spectrum& target);
     /// Recale bins so that \ref Unweighted will return \a target
@@ -72,6 +101,13 @@ namespace ana
     ReweightableSpectrum& operator-=(const ReweightableSpectrum& rhs);
     ReweightableSpectrum operator-(const ReweightableSpectrum& rhs) const;
 
+    /// \brief Sum of many spectra, each scaled by a weight
+    ///
+    /// Same as \ref Spectrum::Sum. The exposures are reconciled first, and
+    /// then the matrices accumulated in one pass over the elements.
+    static ReweightableSpectrum Sum(const std::vector<const ReweightableSpectrum*>& specs,
+                                    const std::vector<double>& weights = {});
+
     void Clear();
 
     void SaveTo(TDirectory* dir, const std::string& name) const;
@@ -83,25 +119,40 @@ namespace ana
     const std::vector<Binning>& GetBinnings() const {return fAxisX.GetBinnings();}
     const std::vector<Binning>& GetTrueBinnings() const {return fAxisY.GetBinnings();}
 
-    Eigen::MatrixXd GetEigen(double pot) const {return fMat * pot/fPOT;}
+    /// Dense copy, whatever the storage
+    Eigen::MatrixXd GetEigen(double pot) const;
   protected:
     // Derived classes can be trusted take care of their own construction
     ReweightableSpectrum(const LabelsAndBins& axisX,
                          const LabelsAndBins& axisY)
-      : fPOT(0), fLivetime(0),
+      : fSparse(false), fDenseFillFrac(0),
+        fPOT(0), fLivetime(0),
         fAxisX(axisX), fAxisY(axisY)
     {
     }
 
     // Constructor for user by Uninitialized()
     ReweightableSpectrum()
-      : fPOT(0), fLivetime(0),
+      : fSparse(false), fDenseFillFrac(0),
+        fPOT(0), fLivetime(0),
         fAxisX(std::vector<std::string>(), std::vector<Binning>()),
         fAxisY(std::vector<std::string>(), std::vector<Binning>())
     {
     }
 
+    /// Size the (empty) matrix to the axes, with the requested storage
+    void InitMatrix(Spectrum::ESparse sparse);
+
     ReweightableSpectrum& PlusEqualsHelper(const ReweightableSpectrum& rhs, int sign);
+    /// fMat += scale*rhs.fMat, whatever the two storage types
+    void AddScaled(const ReweightableSpectrum& rhs, double scale);
+
+    /// \brief Exposure of the sum of two spectra
+    ///
+    /// Updates \a pot and \a livetime, and returns the factor the rhs should
+    /// be scaled by when it's added in, or zero if it can't be added.
+    static double CombineExposures(double& pot, double& livetime,
+                                   double rhsPOT, double rhsLivetime);
 
     void RemoveLoader(ReweightableSpectrum**);
     void AddLoader(ReweightableSpectrum**);
@@ -110,7 +161,60 @@ namespace ana
                  const std::string& name,
                  const std::string& type) const;
 
+    /// Switch between sparse and dense storage if this is adaptive
+    void AdaptStorage();
+    void SparseToDense();
+    void DenseToSparse();
+
+    /// Apply the contents of fSparseBuffer to fMatSparse
+    void FlushSparse();
+    /// \brief fMatSparse with the contents of fSparseBuffer applied
+    ///
+    /// Returns fMatSparse itself if nothing is pending, otherwise merges into
+    /// \a tmp. Doesn't modify this spectrum, so safe for const readers.
+    const Eigen::SparseMatrix<double>& MergedSparse(Eigen::SparseMatrix<double>& tmp) const;
+
+    bool IsZero() const;
+
+    /// \brief Forget the cached projections
+    ///
+    /// Derived classes that modify fMat or fMatSparse directly must call this
+    void InvalidateProjections() {fProjX.resize(0); fProjY.resize(0);}
+    /// Projection onto the reco axis, from the cache if possible
+    const Eigen::ArrayXd& ProjX() const;
+    /// Projection onto the true axis, from the cache if possible
+    const Eigen::ArrayXd& ProjY() const;
+    /// \a proj (fProjX or fProjY) if it's up to date, otherwise null. Never
+    /// computes it
+    const Eigen::ArrayXd* CachedProjection(const Eigen::ArrayXd& proj) const;
+
+    /// Dimensions of the matrix, (true bins+2) x (reco bins+2)
+    int NRows() const {return fSparse ? fMatSparse.rows() : fMat.rows();}
+    int NCols() const {return fSparse ? fMatSparse.cols() : fMat.cols();}
+
     Eigen::MatrixXd fMat;
+    bool fSparse; ///< Contents are in fMatSparse rather than fMat
+    /// Doesn't include fSparseBuffer until FlushSparse()
+    Eigen::SparseMatrix<double> fMatSparse;
+    /// \brief Pending fills of fMatSparse, indexed by col*rows+row
+    ///
+    /// Inserting into a SparseMatrix one element at a time is slow
+    ///
+    /// Only the non-const methods flush it. Const ones see through it with
+    /// \ref MergedSparse.
+    std::unordered_map<int64_t, double> fSparseBuffer;
+    double fDenseFillFrac; ///< Only for adaptive storage, otherwise zero
+    /// \brief Cached projections for \ref UnWeighted and
+    /// \ref WeightingVariable. Empty when out of date
+    ///
+    /// Start out empty, and are computed from the matrix the first time
+    /// they're needed. After that, Fill, arithmetic and reweighting update
+    /// them in place where that's cheap, rather than leaving them to be
+    /// recomputed.
+    mutable Eigen::ArrayXd fProjX, fProjY;
+    /// Held while the const methods compute or inspect fProjX and fProjY,
+    /// so those are safe to call from many threads
+    mutable std::mutex fProjMutex;
     double fPOT;
     double fLivetime;
 
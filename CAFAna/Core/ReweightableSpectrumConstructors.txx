@@ -9,11 +9,11 @@ namespace ana
                        const _HistAxis<_Var<T>>& trueAxis,
                        const _Cut<T, U>& cut,
                        const SystShifts& shift,
-                       const _Weight<T>& wei)
+                       const _Weight<T>& wei,
+                       Spectrum::ESparse sparse)
     : ReweightableSpectrum(recoAxis, trueAxis)
   {
-    fMat.resize(trueAxis.GetBins1D().NBins()+2, recoAxis.GetBins1D().NBins()+2);
-    fMat.setZero();
+    InitMatrix(sparse);
 
     if(recoAxis.HasVars()) loader.AddReweightableSpectrum(*this, recoAxis.GetVar1D(), trueAxis.GetVar1D(), cut, shift, wei);
   }
@@ -25,11 +25,12 @@ namespace ana
   {
     const Binning bins1D = fAxis.GetBins1D();
 
-    if(sparse == kSparse){
-      fHist = Hist::ZeroSparse(bins1D.NBins());
-    }
-    else{
-      fHist = Hist::Zero(bins1D.NBins());
+    switch(sparse){
+    case kSparse:     fHist = Hist::ZeroSparse(bins1D.NBins()); break;
+    case kDenseFloat: fHist = Hist::ZeroFloat (bins1D.NBins()); break;
+    case kDenseCount: fHist = Hist::ZeroCount (bins1D.NBins()); break;
+    case kAdaptive:   fHist = Hist::ZeroAdaptive(bins1D.NBins()); break;
+    default:          fHist = Hist::Zero      (bins1D.NBins());
     }
   }
 
@@ -64,7 +65,7 @@ namespace ana
     fHist(std::move(rhs.fHist)),
     fPOT(rhs.fPOT),
     fLivetime(rhs.fLivetime),
-    fAxis(rhs.fAxis)
+    fAxis(std::move(rhs.fAxis))
   {
     std::swap(fReferences, rhs.fReferences);
     for(Spectrum** ref: fReferences) *ref = this;
@@ -93,7 +94,7 @@ namespace ana
     fHist = std::move(rhs.fHist);
     fPOT = rhs.fPOT;
     fLivetime = rhs.fLivetime;
-    fAxis = rhs.fAxis;
+    fAxis = std::move(rhs.fAxis);
 
     std::swap(fReferences, rhs.fReferences);
     for(Spectrum** ref: fReferences) *ref = this;
@@ -116,49 +117,42 @@ namespace ana
     // Could have a file temporarily open
     DontAddDirectory guard;
 
-    TH1D* ret = fHist.ToTH1(fAxis.GetBins1D());
+    // Scale while making the histogram, rather than with TH1::Scale() after
+    double scale = 1;
+    if(expotype == kPOT && fPOT) scale = exposure/fPOT;
+    if(expotype == kLivetime && fLivetime) scale = exposure/fLivetime;
+
+    TH1D* ret = fHist.ToTH1(fAxis.GetBins1D(), scale);
 
     ret->GetXaxis()->SetTitle(fAxis.GetLabel1D().c_str());
     ret->GetYaxis()->SetTitle("Events");
 
-    if(expotype == kPOT){
-      const double pot = exposure;
-      if(fPOT){
-        ret->Scale(pot/fPOT);
-      }
-      else{
-        // Allow zero POT if there are also zero events
-        if(ret->Integral() > 0){
-          std::cout << "Error: Spectrum with " << ret->Integral()
-                    << " entries has zero POT, no way to scale to "
-                    << exposure << " POT.";
-          if(fLivetime > 0){
-            std::cout << " Spectrum has " << fLivetime << " seconds livetime. "
-                      << "Did you mean to pass kLivetime to ToTH1()?";
-          }
-          std::cout << std::endl;
-          abort();
+    if(expotype == kPOT && !fPOT){
+      // Allow zero POT if there are also zero events
+      if(ret->Integral() > 0){
+        std::cout << "Error: Spectrum with " << ret->Integral()
+                  << " entries has zero POT, no way to scale to "
+                  << exposure << " POT.";
+        if(fLivetime > 0){
+          std::cout << " Spectrum has " << fLivetime << " seconds livetime. "
+                    << "Did you mean to pass kLivetime to ToTH1()?";
         }
+        std::cout << std::endl;
+        abort();
       }
     }
-    if(expotype == kLivetime){
-      const double livetime = exposure;
-      if(fLivetime){
-        ret->Scale(livetime/fLivetime);
-      }
-      else{
-        // Allow zero exposure if there are also zero events
-        if(ret->Integral() > 0){
-          std::cout << "Error: Spectrum with " << ret->Integral()
-                    << " entries has zero livetime, no way to scale to "
-                    << livetime << " seconds.";
-          if(fPOT > 0){
-            std::cout << " Spectrum has " << fPOT << " POT. "
-                      << "Did you mean to pass kPOT to ToTH1()?";
-          }
-          std::cout << std::endl;
-          abort();
+    if(expotype == kLivetime && !fLivetime){
+      // Allow zero exposure if there are also zero events
+      if(ret->Integral() > 0){
+        std::cout << "Error: Spectrum with " << ret->Integral()
+                  << " entries has zero livetime, no way to scale to "
+                  << exposure << " seconds.";
+        if(fPOT > 0){
+          std::cout << " Spectrum has " << fPOT << " POT. "
+                    << "Did you mean to pass kPOT to ToTH1()?";
         }
+        std::cout << std::endl;
+        abort();
       }
     }
 
@@ -246,18 +240,18 @@ namespace ana
   Eigen::ArrayXd Spectrum::GetEigen(double exposure, EExposureType expotype) const
   {
     if(expotype == kPOT)
-      return (exposure/fPOT) * fHist.GetEigen();
+      return fHist.GetEigen(exposure/fPOT);
     else
-      return (exposure/fLivetime) * fHist.GetEigen();
+      return fHist.GetEigen(exposure/fLivetime);
   }
 
   //----------------------------------------------------------------------
   Eigen::ArrayXstan Spectrum::GetEigenStan(double exposure, EExposureType expotype) const
   {
-    if(expotype == kPOT)
-      return (exposure/fPOT) * fHist.GetEigenStan();
-    else
-      return (exposure/fLivetime) * fHist.GetEigenStan();
+    // Do the scaling as a single vector operation
+    Hist h = fHist;
+    h.Scale((expotype == kPOT) ? exposure/fPOT : exposure/fLivetime);
+    return h.GetEigenStan();
   }
 
   //----------------------------------------------------------------------
@@ -323,6 +317,19 @@ namespace ana
     // TODO Pull binning out of Hist entirely and just update an index?
   }
 
+  //----------------------------------------------------------------------
+  void Spectrum::Fill(const std::vector<double>& xs, double w)
+  {
+    fHist.FillBin(fAxis.FindBin(xs), w);
+  }
+
+  //----------------------------------------------------------------------
+  void Spectrum::FillN(const std::vector<double>& xs,
+                       const std::vector<double>& ws)
+  {
+    fHist.FillN(fAxis.GetBins1D(), xs, ws);
+  }
+
   //----------------------------------------------------------------------
   Spectrum Spectrum::MockData(double pot, int seed) const
   {
@@ -407,68 +414,116 @@ namespace ana
   Spectrum& Spectrum::PlusEqualsHelper(const Spectrum& rhs, int sign)
   {
     // In this case it would be OK to have no POT/livetime
-    if(rhs.fHist.Initialized() && rhs.fHist.Integral() == 0) return *this;
+    if(rhs.fHist.Initialized() && rhs.fHist.Empty()) return *this;
+
+    const double scale = CombineExposures(fPOT, fLivetime, rhs.fPOT, rhs.fLivetime);
+    fHist.Add(rhs.fHist, sign*scale);
+    return *this;
+  }
+
+  //----------------------------------------------------------------------
+  Spectrum Spectrum::Sum(const std::vector<const Spectrum*>& specs,
+                         const std::vector<double>& weights)
+  {
+    if(specs.empty()){
+      std::cout << "Spectrum::Sum(): no spectra to sum" << std::endl;
+      abort();
+    }
+    if(!weights.empty() && weights.size() != specs.size()){
+      std::cout << "Spectrum::Sum(): " << specs.size() << " spectra but "
+                << weights.size() << " weights" << std::endl;
+      abort();
+    }
+
+    const Spectrum& first = *specs[0];
+    double pot = first.fPOT;
+    double livetime = first.fLivetime;
 
-    if((!fPOT && !fLivetime) || (!rhs.fPOT && !rhs.fLivetime)){
+    // Work out the exposure of the result, and what each input needs to be
+    // scaled by, before touching any bins
+    std::vector<Hist::Op> prog = {{Hist::Op::kPush, &first.fHist, 1}};
+    if(!weights.empty() && weights[0] != 1){
+      prog.push_back({Hist::Op::kScale, 0, weights[0]});
+    }
+
+    for(unsigned int i = 1; i < specs.size(); ++i){
+      const Spectrum& s = *specs[i];
+      // Same as PlusEqualsHelper, adding nothing is always allowed
+      if(s.fHist.Initialized() && s.fHist.Empty()) continue;
+
+      const double w = weights.empty() ? 1 : weights[i];
+      const double scale = CombineExposures(pot, livetime, s.fPOT, s.fLivetime);
+      prog.push_back({Hist::Op::kPush, &s.fHist, 1});
+      prog.push_back({Hist::Op::kAdd, 0, w * scale});
+    }
+
+    return Spectrum(Hist::Evaluate(prog), first.fAxis, pot, livetime);
+  }
+
+  //----------------------------------------------------------------------
+  double Spectrum::CombineExposures(double& pot, double& livetime,
+                                    double rhsPOT, double rhsLivetime)
+  {
+    if((!pot && !livetime) || (!rhsPOT && !rhsLivetime)){
       std::cout << "Error: can't sum Spectrum with no POT or livetime: "
-                << fPOT << " " << rhs.fPOT << " " << fLivetime << " " << rhs.fLivetime
+                << pot << " " << rhsPOT << " " << livetime << " " << rhsLivetime
                 << std::endl;
       abort();
     }
 
-    if(!fLivetime && !rhs.fPOT){
+    if(!livetime && !rhsPOT){
       std::cout << "Error: can't sum Spectrum with POT ("
-                << fPOT << ") but no livetime and Spectrum with livetime ("
-                << rhs.fLivetime << " sec) but no POT." << std::endl;
+                << pot << ") but no livetime and Spectrum with livetime ("
+                << rhsLivetime << " sec) but no POT." << std::endl;
       abort();
     }
 
-    if(!fPOT && !rhs.fLivetime){
+    if(!pot && !rhsLivetime){
       std::cout << "Error: can't sum Spectrum with livetime ("
-                << fLivetime << " sec) but no POT and Spectrum with POT ("
-                << rhs.fPOT << ") but no livetime." << std::endl;
+                << livetime << " sec) but no POT and Spectrum with POT ("
+                << rhsPOT << ") but no livetime." << std::endl;
       abort();
     }
 
     // And now there are still a bunch of good cases to consider
 
-    if(fPOT && rhs.fPOT){
+    if(pot && rhsPOT){
       // Scale by POT when possible
-      fHist.Add(rhs.fHist, sign*fPOT/rhs.fPOT);
+      const double scale = pot/rhsPOT;
 
-      if(fLivetime && rhs.fLivetime){
+      if(livetime && rhsLivetime){
         // If POT/livetime ratios match, keep regular lifetime, otherwise zero
         // it out.
-        if(AlmostEqual(fLivetime*rhs.fPOT, rhs.fLivetime*fPOT))
-          fLivetime = 0;
+        if(AlmostEqual(livetime*rhsPOT, rhsLivetime*pot))
+          livetime = 0;
       }
-      if(!fLivetime && rhs.fLivetime){
+      if(!livetime && rhsLivetime){
         // If the RHS has a livetime and we don't, copy it in (suitably scaled)
-        fLivetime = rhs.fLivetime * fPOT/rhs.fPOT;
+        livetime = rhsLivetime * pot/rhsPOT;
       }
       // Otherwise, keep our own livetime (if any)
 
-      return *this;
+      return scale;
     }
 
-    if(fLivetime && rhs.fLivetime){
+    if(livetime && rhsLivetime){
       // Scale by livetime, the only thing in common
-      fHist.Add(rhs.fHist, sign*fLivetime/rhs.fLivetime);
+      const double scale = livetime/rhsLivetime;
 
-      if(!fPOT && rhs.fPOT){
+      if(!pot && rhsPOT){
         // If the RHS has a POT and we don't, copy it in (suitably scaled)
-        fPOT = rhs.fPOT * fLivetime/rhs.fLivetime;
+        pot = rhsPOT * livetime/rhsLivetime;
       }
       // Otherwise, keep our own POT (if any)
 
-      return *this;
+      return scale;
     }
 
     // That should have been all the cases. I definitely want to know what
     // happened if it wasn't.
     std::cout << "Spectrum::operator+=(). How did we get here? "
-              << fPOT << " " << fLivetime << " "
-              << rhs.fPOT << " " << rhs.fLivetime << std::endl;
+              << pot << " " << livetime << " "
+              << rhsPOT << " " << rhsLivetime << std::endl;
     abort();
   }
 
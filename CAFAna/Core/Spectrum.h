@@ -24,6 +24,7 @@ class TH1D;
 namespace ana
 {
   class Ratio;
+  class SpectrumExpr;
   class SpectrumLoaderBase;
   template<class T> class _Var;
   template<class T> class _Weight;
@@ -44,8 +45,15 @@ namespace ana
     friend class SpectrumSink;
     friend class SpectrumSinkBase<Spectrum>;
     friend class Ratio;
+    friend class SpectrumExpr;
 
-    enum ESparse{kDense, kSparse};
+    /// \brief Storage for the bin contents
+    ///
+    /// kDenseFloat halves the memory, at the cost of precision. kDenseCount
+    /// quarters it, for spectra filled with unweighted events. Both are
+    /// converted to double precision by any arithmetic. kAdaptive starts
+    /// sparse and switches to dense storage if it fills up.
+    enum ESparse{kDense, kSparse, kDenseFloat, kDenseCount, kAdaptive};
 
     /// One constructor to rule them all
     template<class T, class U>
@@ -152,6 +160,23 @@ namespace ana
     Spectrum& operator=(Spectrum&& rhs);
 
     void Fill(double x, double w = 1);
+    /// \brief Fill a multi-dimensional spectrum with one value per axis
+    ///
+    /// Computes the flattened bin directly, rather than going via the
+    /// \ref _HistAxis::GetVar1D encoding
+    void Fill(const std::vector<double>& xs, double w = 1);
+    /// Fill many entries at once. Prefer this over repeated calls to \ref Fill
+    void FillN(const std::vector<double>& xs, const std::vector<double>& ws);
+
+    /// \brief Allow the Fill functions to be called from many threads at once
+    ///
+    /// Nothing else may be done with this Spectrum until the matching call to
+    /// \ref EndConcurrentFill. See \ref Hist::EConcurrentFill for the options
+    void BeginConcurrentFill(Hist::EConcurrentFill mode = Hist::kThreadShards)
+    {
+      fHist.BeginConcurrentFill(mode);
+    }
+    void EndConcurrentFill(){fHist.EndConcurrentFill();}
 
     /// \brief Histogram made from this Spectrum, scaled to some exposure
     ///
@@ -186,8 +211,9 @@ namespace ana
 
     bool HasStan() const {return fHist.HasStan();}
     /// NB these don't have POT scaling. For expert high performance ops only!
-    const Eigen::ArrayXd& GetEigen() const {return fHist.GetEigen();}
-    const Eigen::ArrayXstan& GetEigenStan() const {return fHist.GetEigenStan();}
+    Eigen::ArrayXd GetEigen() const {return fHist.GetEigen();}
+    Eigen::ArrayXstan GetEigenStan() const {return fHist.GetEigenStan();}
+    const StanVector& GetStanVector() const {return fHist.GetStanVector();}
 
     Eigen::ArrayXd GetEigen(double exposure, EExposureType expotype = kPOT) const;
     Eigen::ArrayXstan GetEigenStan(double exposure, EExposureType expotype = kPOT) const;
@@ -243,7 +269,7 @@ namespace ana
 
     // Arithmetic operators are as if these are unlike samples, each a
     // contribution to one total, not seperate sources of stats for the same
-    // sample.
+    // sample. See SpectrumExpr.h to evaluate longer expressions in one pass.
     Spectrum& operator+=(const Spectrum& rhs);
     Spectrum operator+(const Spectrum& rhs) const;
 
@@ -256,6 +282,17 @@ namespace ana
     Spectrum& operator/=(const Ratio& rhs);
     Spectrum operator/(const Ratio& rhs) const;
 
+    /// \brief Sum of many spectra, each scaled by a weight
+    ///
+    /// Gives the same result as adding the (scaled) spectra one by one with
+    /// operator+=, but the exposures are all reconciled first and then the
+    /// contents accumulated in one pass over the bins. The result has the
+    /// axes of the first spectrum.
+    ///
+    /// \param weights Factor to scale each spectrum by. All one if empty
+    static Spectrum Sum(const std::vector<const Spectrum*>& specs,
+                        const std::vector<double>& weights = {});
+
     void SaveTo(TDirectory* dir, const std::string& name) const;
     static std::unique_ptr<Spectrum> LoadFrom(TDirectory* dir, const std::string& name);
 
@@ -281,6 +318,13 @@ namespace ana
     /// Helper for operator+= and operator-=
     Spectrum& PlusEqualsHelper(const Spectrum& rhs, int sign);
 
+    /// \brief Exposure of the sum of two spectra
+    ///
+    /// Updates \a pot and \a livetime, and returns the factor the rhs should
+    /// be scaled by when it's added in.
+    static double CombineExposures(double& pot, double& livetime,
+                                   double rhsPOT, double rhsLivetime);
+
     Hist fHist;
     double fPOT;
     double fLivetime;
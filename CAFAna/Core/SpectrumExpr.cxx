@@ -0,0 +1,171 @@
+#include "CAFAna/Core/SpectrumExpr.h"
+
+#include "CAFAna/Core/Ratio.h"
+
+#include <cassert>
+
+namespace ana
+{
+  /// One operation in the expression tree
+  struct SpectrumExpr::Node
+  {
+    enum EKind{kLeaf, kSum, kMultiply, kDivide} kind;
+
+    /// For kLeaf
+    const Spectrum* spect = 0;
+    std::shared_ptr<const Spectrum> ownedSpect; ///< If it was a temporary
+
+    /// Operands for kSum, or just \a a for kMultiply and kDivide
+    std::shared_ptr<const Node> a, b;
+    int sign = +1; ///< For kSum
+
+    /// For kMultiply and kDivide
+    const Ratio* ratio = 0;
+    std::shared_ptr<const Ratio> ownedRatio; ///< If it was a temporary
+  };
+
+  /// Exposure of the result of a Node, as operator+= would compute it
+  struct SpectrumExpr::Exposure
+  {
+    double pot, livetime;
+    const Spectrum* first; ///< Leftmost operand, whose axes the result has
+  };
+
+  //----------------------------------------------------------------------
+  SpectrumExpr::SpectrumExpr(const Spectrum& s)
+  {
+    auto node = std::make_shared<Node>();
+    node->kind = Node::kLeaf;
+    node->spect = &s;
+    fNode = std::move(node);
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr::SpectrumExpr(Spectrum&& s)
+  {
+    auto node = std::make_shared<Node>();
+    node->kind = Node::kLeaf;
+    node->ownedSpect = std::make_shared<const Spectrum>(std::move(s));
+    node->spect = node->ownedSpect.get();
+    fNode = std::move(node);
+  }
+
+  //----------------------------------------------------------------------
+  bool SpectrumExpr::IsEmpty(const Node& node)
+  {
+    switch(node.kind){
+    case Node::kLeaf:
+      return node.spect->fHist.Initialized() && node.spect->fHist.Empty();
+    case Node::kSum:
+      return IsEmpty(*node.a) && IsEmpty(*node.b);
+    case Node::kMultiply:
+    case Node::kDivide:
+      return IsEmpty(*node.a);
+    }
+    abort(); // unreachable
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr::Exposure SpectrumExpr::Compile(const Node& node,
+                                               std::vector<Hist::Op>& prog)
+  {
+    switch(node.kind){
+    case Node::kLeaf:
+      prog.push_back({Hist::Op::kPush, &node.spect->fHist, 1});
+      return {node.spect->fPOT, node.spect->fLivetime, node.spect};
+
+    case Node::kSum:{
+      Exposure ret = Compile(*node.a, prog);
+      // Same as Spectrum::PlusEqualsHelper, adding nothing is always allowed
+      if(IsEmpty(*node.b)) return ret;
+      const Exposure rhs = Compile(*node.b, prog);
+      const double scale = Spectrum::CombineExposures(ret.pot, ret.livetime,
+                                                      rhs.pot, rhs.livetime);
+      prog.push_back({Hist::Op::kAdd, 0, node.sign * scale});
+      return ret;
+    }
+
+    case Node::kMultiply:
+    case Node::kDivide:{
+      const Exposure ret = Compile(*node.a, prog);
+      prog.push_back({node.kind == Node::kMultiply ? Hist::Op::kMultiply : Hist::Op::kDivide,
+                      &node.ratio->fHist, 1});
+      return ret;
+    }
+    }
+    abort(); // unreachable
+  }
+
+  //----------------------------------------------------------------------
+  Spectrum SpectrumExpr::Eval() const
+  {
+    std::vector<Hist::Op> prog;
+    const Exposure expo = Compile(*fNode, prog);
+
+    return Spectrum(Hist::Evaluate(prog), expo.first->fAxis,
+                    expo.pot, expo.livetime);
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr SpectrumExpr::Sum(const SpectrumExpr& a, const SpectrumExpr& b,
+                                 int sign)
+  {
+    auto node = std::make_shared<Node>();
+    node->kind = Node::kSum;
+    node->a = a.fNode;
+    node->b = b.fNode;
+    node->sign = sign;
+    return SpectrumExpr(std::move(node));
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr SpectrumExpr::Times(const SpectrumExpr& a, const Ratio& r,
+                                   std::shared_ptr<const Ratio> owned,
+                                   bool divide)
+  {
+    auto node = std::make_shared<Node>();
+    node->kind = divide ? Node::kDivide : Node::kMultiply;
+    node->a = a.fNode;
+    node->ratio = &r;
+    node->ownedRatio = std::move(owned);
+    return SpectrumExpr(std::move(node));
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr operator+(const SpectrumExpr& a, const SpectrumExpr& b)
+  {
+    return SpectrumExpr::Sum(a, b, +1);
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr operator-(const SpectrumExpr& a, const SpectrumExpr& b)
+  {
+    return SpectrumExpr::Sum(a, b, -1);
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr operator*(const SpectrumExpr& a, const Ratio& r)
+  {
+    return SpectrumExpr::Times(a, r, 0, false);
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr operator*(const SpectrumExpr& a, Ratio&& r)
+  {
+    auto owned = std::make_shared<const Ratio>(std::move(r));
+    return SpectrumExpr::Times(a, *owned, owned, false);
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr operator/(const SpectrumExpr& a, const Ratio& r)
+  {
+    return SpectrumExpr::Times(a, r, 0, true);
+  }
+
+  //----------------------------------------------------------------------
+  SpectrumExpr operator/(const SpectrumExpr& a, Ratio&& r)
+  {
+    auto owned = std::make_shared<const Ratio>(std::move(r));
+    return SpectrumExpr::Times(a, *owned, owned, true);
+  }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "CAFAna/Core/Spectrum.h"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace ana
+{
+  class Ratio;
+
+  /// \brief Unevaluated arithmetic on Spectrum and Ratio
+  ///
+  /// The regular Spectrum operators compute each intermediate result. Where
+  /// that matters, wrap an operand to build the whole calculation instead,
+  /// and then compute it in a single pass over the bins with \ref Eval, eg
+  ///
+  /// \code
+  /// const Spectrum tot = (SpectrumExpr(a) + SpectrumExpr(b)*r - c).Eval();
+  /// \endcode
+  ///
+  /// The answer is the same as applying the operators one at a time.
+  ///
+  /// NB like any expression template, this refers to its operands. Ones
+  /// that are temporaries are kept alive, but named Spectrum and Ratio
+  /// objects must outlive the expression. Best not to keep one around
+  /// beyond the statement that evaluates it.
+  class SpectrumExpr
+  {
+  public:
+    /// \brief Explicit, so that the regular Spectrum operators are never
+    /// ambiguous with these
+    ///
+    /// Once one operand is a SpectrumExpr the others may be plain Spectrum
+    /// objects, and the result is a SpectrumExpr.
+    explicit SpectrumExpr(const Spectrum& s);
+    /// Takes ownership of temporaries, so they outlive the expression
+    explicit SpectrumExpr(Spectrum&& s);
+
+    Spectrum Eval() const;
+
+    friend SpectrumExpr operator+(const SpectrumExpr& a, const SpectrumExpr& b);
+    friend SpectrumExpr operator-(const SpectrumExpr& a, const SpectrumExpr& b);
+    friend SpectrumExpr operator*(const SpectrumExpr& a, const Ratio& r);
+    friend SpectrumExpr operator*(const SpectrumExpr& a, Ratio&& r);
+    friend SpectrumExpr operator/(const SpectrumExpr& a, const Ratio& r);
+    friend SpectrumExpr operator/(const SpectrumExpr& a, Ratio&& r);
+
+  protected:
+    struct Node;
+    struct Exposure;
+
+    SpectrumExpr(std::shared_ptr<const Node>&& node) : fNode(std::move(node)) {}
+
+    /// Helpers for the operators
+    static SpectrumExpr Sum(const SpectrumExpr& a, const SpectrumExpr& b, int sign);
+    static SpectrumExpr Times(const SpectrumExpr& a, const Ratio& r,
+                              std::shared_ptr<const Ratio> owned, bool divide);
+
+    /// Append the calculation of \a node to \a prog
+    static Exposure Compile(const Node& node, std::vector<Hist::Op>& prog);
+    /// Will \a node certainly evaluate to an empty Spectrum?
+    static bool IsEmpty(const Node& node);
+
+    std::shared_ptr<const Node> fNode;
+  };
+
+  SpectrumExpr operator+(const SpectrumExpr& a, const SpectrumExpr& b);
+  SpectrumExpr operator-(const SpectrumExpr& a, const SpectrumExpr& b);
+  SpectrumExpr operator*(const SpectrumExpr& a, const Ratio& r);
+  SpectrumExpr operator*(const SpectrumExpr& a, Ratio&& r);
+  SpectrumExpr operator/(const SpectrumExpr& a, const Ratio& r);
+  SpectrumExpr operator/(const SpectrumExpr& a, Ratio&& r);
+
+  // Commutative
+  inline SpectrumExpr operator*(const Ratio& lhs, const SpectrumExpr& rhs){return rhs*lhs;}
+  inline SpectrumExpr operator*(Ratio&& lhs, const SpectrumExpr& rhs){return rhs*std::move(lhs);}
+
+  // Sums with a plain Spectrum on one side
+  inline SpectrumExpr operator+(const SpectrumExpr& a, const Spectrum& b){return a + SpectrumExpr(b);}
+  inline SpectrumExpr operator+(const SpectrumExpr& a, Spectrum&& b){return a + SpectrumExpr(std::move(b));}
+  inline SpectrumExpr operator+(const Spectrum& a, const SpectrumExpr& b){return SpectrumExpr(a) + b;}
+  inline SpectrumExpr operator+(Spectrum&& a, const SpectrumExpr& b){return SpectrumExpr(std::move(a)) + b;}
+  inline SpectrumExpr operator-(const SpectrumExpr& a, const Spectrum& b){return a - SpectrumExpr(b);}
+  inline SpectrumExpr operator-(const SpectrumExpr& a, Spectrum&& b){return a - SpectrumExpr(std::move(b));}
+  inline SpectrumExpr operator-(const Spectrum& a, const SpectrumExpr& b){return SpectrumExpr(a) - b;}
+  inline SpectrumExpr operator-(Spectrum&& a, const SpectrumExpr& b){return SpectrumExpr(std::move(a)) - b;}
+}
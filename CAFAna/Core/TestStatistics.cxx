@@ -0,0 +1,279 @@
+#include "CAFAna/Core/TestStatistics.h"
+
+#include "CAFAna/Core/Spectrum.h"
+
+#include <iostream>
+
+namespace
+{
+  using ana::Spectrum;
+  using ana::StanVector;
+  using stan::math::arena_t;
+  using stan::math::make_callback_var;
+
+  /// With this value, a non-positive expectation with events observed gives
+  /// a huge (but finite) penalty, so fits are pushed away from it
+  const double kLarge = 1e10;
+
+  //----------------------------------------------------------------------
+  void CheckSizes(int ne, int no)
+  {
+    if(ne != no){
+      std::cout << "Test statistic: expectation has " << ne
+                << " bins but observation has " << no << std::endl;
+      abort();
+    }
+  }
+
+  // Each of these returns the per-bin contributions to the statistic, and
+  // if 'grad' is set fills it with their derivatives with respect to e
+
+  //----------------------------------------------------------------------
+  Eigen::ArrayXd LLTerms(const Eigen::ArrayXd& e, const Eigen::ArrayXd& o,
+                         Eigen::ArrayXd* grad)
+  {
+    // Negative expectations are treated as zero
+    const Eigen::ArrayXd ep = e.max(0.);
+
+    if(grad){
+      *grad = (o == 0).select(2*(e > 0).cast<double>(),
+                              (e > 0).select(2*(1-o/e), 0.));
+    }
+
+    return (o == 0).select(2*ep,
+                           (e > 0).select(2*(e-o+o*(o/e).log()), kLarge));
+  }
+
+  //----------------------------------------------------------------------
+  Eigen::ArrayXd PearsonTerms(const Eigen::ArrayXd& e, const Eigen::ArrayXd& o,
+                              Eigen::ArrayXd* grad)
+  {
+    if(grad) *grad = (e > 0).select(1-(o/e).square(), 0.);
+
+    return (e > 0).select((e-o).square()/e, 0.);
+  }
+
+  //----------------------------------------------------------------------
+  Eigen::ArrayXd NeymanTerms(const Eigen::ArrayXd& e, const Eigen::ArrayXd& o,
+                             Eigen::ArrayXd* grad)
+  {
+    const Eigen::ArrayXd var = (o > 0).select(o, 1.);
+
+    if(grad) *grad = 2*(e-o)/var;
+
+    return (e-o).square()/var;
+  }
+
+  //----------------------------------------------------------------------
+  template<class F> double Stat(const Eigen::ArrayXd& exp,
+                                const Eigen::ArrayXd& obs,
+                                F terms)
+  {
+    CheckSizes(exp.size(), obs.size());
+    return terms(exp, obs, 0).sum();
+  }
+
+  //----------------------------------------------------------------------
+  /// The statistic of scale*exp, as a single node with an analytic gradient
+  template<class F> stan::math::var Stat(const StanVector& exp,
+                                         const Eigen::ArrayXd& obs,
+                                         double scale,
+                                         F terms)
+  {
+    CheckSizes(exp.size(), obs.size());
+
+    Eigen::ArrayXd grad;
+    const double val = terms(scale * exp.val().array(), obs, &grad).sum();
+
+    arena_t<Eigen::VectorXd> g = scale * grad.matrix();
+    return make_callback_var(val, [exp, g](auto& vi) mutable
+    {
+      exp.adj() += vi.adj() * g;
+    });
+  }
+
+  //----------------------------------------------------------------------
+  double Exposure(const Spectrum& s, ana::EExposureType expotype)
+  {
+    return (expotype == ana::kPOT) ? s.POT() : s.Livetime();
+  }
+
+  //----------------------------------------------------------------------
+  /// Factor to scale \a pred to the exposure of \a data
+  double ScaleFactor(const Spectrum& pred, const Spectrum& data,
+                     ana::EExposureType expotype)
+  {
+    return Exposure(data, expotype) / Exposure(pred, expotype);
+  }
+
+  //----------------------------------------------------------------------
+  const StanVector& StanPrediction(const Spectrum& pred)
+  {
+    if(!pred.HasStan()){
+      std::cout << "Test statistic: Stan version requested, but the prediction has no autodiff contents" << std::endl;
+      abort();
+    }
+    return pred.GetStanVector();
+  }
+}
+
+namespace ana
+{
+  //----------------------------------------------------------------------
+  double LogLikelihood(const Eigen::ArrayXd& exp, const Eigen::ArrayXd& obs)
+  {
+    return Stat(exp, obs, LLTerms);
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var LogLikelihood(const StanVector& exp, const Eigen::ArrayXd& obs)
+  {
+    return Stat(exp, obs, 1, LLTerms);
+  }
+
+  //----------------------------------------------------------------------
+  double PearsonChi2(const Eigen::ArrayXd& exp, const Eigen::ArrayXd& obs)
+  {
+    return Stat(exp, obs, PearsonTerms);
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var PearsonChi2(const StanVector& exp, const Eigen::ArrayXd& obs)
+  {
+    return Stat(exp, obs, 1, PearsonTerms);
+  }
+
+  //----------------------------------------------------------------------
+  double NeymanChi2(const Eigen::ArrayXd& exp, const Eigen::ArrayXd& obs)
+  {
+    return Stat(exp, obs, NeymanTerms);
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var NeymanChi2(const StanVector& exp, const Eigen::ArrayXd& obs)
+  {
+    return Stat(exp, obs, 1, NeymanTerms);
+  }
+
+  //----------------------------------------------------------------------
+  double LogLikelihood(const Spectrum& pred, const Spectrum& data,
+                       EExposureType expotype)
+  {
+    return Stat(pred.GetEigen(Exposure(data, expotype), expotype),
+                data.GetEigen(), LLTerms);
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var LogLikelihoodStan(const Spectrum& pred, const Spectrum& data,
+                                    EExposureType expotype)
+  {
+    return Stat(StanPrediction(pred), data.GetEigen(),
+                ScaleFactor(pred, data, expotype), LLTerms);
+  }
+
+  //----------------------------------------------------------------------
+  double PearsonChi2(const Spectrum& pred, const Spectrum& data,
+                     EExposureType expotype)
+  {
+    return Stat(pred.GetEigen(Exposure(data, expotype), expotype),
+                data.GetEigen(), PearsonTerms);
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var PearsonChi2Stan(const Spectrum& pred, const Spectrum& data,
+                                  EExposureType expotype)
+  {
+    return Stat(StanPrediction(pred), data.GetEigen(),
+                ScaleFactor(pred, data, expotype), PearsonTerms);
+  }
+
+  //----------------------------------------------------------------------
+  double NeymanChi2(const Spectrum& pred, const Spectrum& data,
+                    EExposureType expotype)
+  {
+    return Stat(pred.GetEigen(Exposure(data, expotype), expotype),
+                data.GetEigen(), NeymanTerms);
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var NeymanChi2Stan(const Spectrum& pred, const Spectrum& data,
+                                 EExposureType expotype)
+  {
+    return Stat(StanPrediction(pred), data.GetEigen(),
+                ScaleFactor(pred, data, expotype), NeymanTerms);
+  }
+
+  //----------------------------------------------------------------------
+  CovarianceChi2::CovarianceChi2(const Eigen::MatrixXd& cov)
+  {
+    if(cov.rows() != cov.cols()){
+      std::cout << "CovarianceChi2: covariance matrix is " << cov.rows()
+                << "x" << cov.cols() << ", not square" << std::endl;
+      abort();
+    }
+
+    fLLT.compute(cov);
+
+    if(fLLT.info() != Eigen::Success){
+      std::cout << "CovarianceChi2: covariance matrix is not positive definite" << std::endl;
+      abort();
+    }
+  }
+
+  //----------------------------------------------------------------------
+  Eigen::VectorXd CovarianceChi2::Solve(const Eigen::VectorXd& r) const
+  {
+    CheckSizes(r.size(), NBins());
+    return fLLT.solve(r);
+  }
+
+  //----------------------------------------------------------------------
+  double CovarianceChi2::Chi2(const Eigen::ArrayXd& exp,
+                              const Eigen::ArrayXd& obs) const
+  {
+    CheckSizes(exp.size(), obs.size());
+    const Eigen::VectorXd r = (exp - obs).matrix();
+    return r.dot(Solve(r));
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var CovarianceChi2::Chi2(const StanVector& exp,
+                                       const Eigen::ArrayXd& obs) const
+  {
+    CheckSizes(exp.size(), obs.size());
+    const Eigen::VectorXd r = exp.val() - obs.matrix();
+
+    // V is symmetric, so d(chi²)/de = 2 V^-1 r
+    arena_t<Eigen::VectorXd> x = Solve(r);
+    return make_callback_var(r.dot(x), [exp, x](auto& vi) mutable
+    {
+      exp.adj() += (2 * vi.adj()) * x;
+    });
+  }
+
+  //----------------------------------------------------------------------
+  double CovarianceChi2::Chi2(const Spectrum& pred, const Spectrum& data,
+                              EExposureType expotype) const
+  {
+    return Chi2(pred.GetEigen(Exposure(data, expotype), expotype),
+                data.GetEigen());
+  }
+
+  //----------------------------------------------------------------------
+  stan::math::var CovarianceChi2::Chi2Stan(const Spectrum& pred,
+                                           const Spectrum& data,
+                                           EExposureType expotype) const
+  {
+    const StanVector& exp = StanPrediction(pred);
+    CheckSizes(exp.size(), data.GetEigen().size());
+
+    const double scale = ScaleFactor(pred, data, expotype);
+    const Eigen::VectorXd r = scale * exp.val() - data.GetEigen().matrix();
+
+    arena_t<Eigen::VectorXd> x = Solve(r);
+    return make_callback_var(r.dot(x), [exp, x, scale](auto& vi) mutable
+    {
+      exp.adj() += (2 * scale * vi.adj()) * x;
+    });
+  }
+}
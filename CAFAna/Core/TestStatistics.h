@@ -0,0 +1,76 @@
+#pragma once
+
+#include "CAFAna/Core/Hist.h"
+#include "CAFAna/Core/UtilsExt.h"
+
+#include <Eigen/Dense>
+
+namespace ana
+{
+  class Spectrum;
+
+  /// \brief -2 log of the Poisson likelihood ratio, summed over bins
+  ///
+  /// 2(e-o+o*ln(o/e)) per bin, which is chi²-distributed in the asymptotic
+  /// limit. Empty data bins contribute 2e, and a non-positive expectation
+  /// with events observed is heavily penalized.
+  double LogLikelihood(const Eigen::ArrayXd& exp, const Eigen::ArrayXd& obs);
+  /// The gradient with respect to \a exp is attached as a single node
+  stan::math::var LogLikelihood(const StanVector& exp, const Eigen::ArrayXd& obs);
+
+  /// Pearson chi², (e-o)²/e summed over the bins with e > 0
+  double PearsonChi2(const Eigen::ArrayXd& exp, const Eigen::ArrayXd& obs);
+  stan::math::var PearsonChi2(const StanVector& exp, const Eigen::ArrayXd& obs);
+
+  /// Neyman chi², (e-o)²/o. Empty data bins are given a variance of one
+  double NeymanChi2(const Eigen::ArrayXd& exp, const Eigen::ArrayXd& obs);
+  stan::math::var NeymanChi2(const StanVector& exp, const Eigen::ArrayXd& obs);
+
+  /// \name Spectrum versions
+  ///
+  /// The prediction is scaled to the exposure of the data. The Stan versions
+  /// require a prediction with autodiff contents (\ref Spectrum::HasStan)
+  /// @{
+  double LogLikelihood(const Spectrum& pred, const Spectrum& data,
+                       EExposureType expotype = kPOT);
+  stan::math::var LogLikelihoodStan(const Spectrum& pred, const Spectrum& data,
+                                    EExposureType expotype = kPOT);
+
+  double PearsonChi2(const Spectrum& pred, const Spectrum& data,
+                     EExposureType expotype = kPOT);
+  stan::math::var PearsonChi2Stan(const Spectrum& pred, const Spectrum& data,
+                                  EExposureType expotype = kPOT);
+
+  double NeymanChi2(const Spectrum& pred, const Spectrum& data,
+                    EExposureType expotype = kPOT);
+  stan::math::var NeymanChi2Stan(const Spectrum& pred, const Spectrum& data,
+                                 EExposureType expotype = kPOT);
+  /// @}
+
+  /// \brief chi² = (e-o)^T V^-1 (e-o) for a fixed covariance matrix V
+  ///
+  /// The Cholesky decomposition of V is computed once on construction, so
+  /// each evaluation is only a pair of triangular solves.
+  class CovarianceChi2
+  {
+  public:
+    /// \param cov Covariance matrix, in the units of the data spectrum
+    CovarianceChi2(const Eigen::MatrixXd& cov);
+
+    double Chi2(const Eigen::ArrayXd& exp, const Eigen::ArrayXd& obs) const;
+    stan::math::var Chi2(const StanVector& exp, const Eigen::ArrayXd& obs) const;
+
+    double Chi2(const Spectrum& pred, const Spectrum& data,
+                EExposureType expotype = kPOT) const;
+    stan::math::var Chi2Stan(const Spectrum& pred, const Spectrum& data,
+                             EExposureType expotype = kPOT) const;
+
+    int NBins() const {return fLLT.rows();}
+
+  protected:
+    /// Solve V x = r
+    Eigen::VectorXd Solve(const Eigen::VectorXd& r) const;
+
+    Eigen::LLT<Eigen::MatrixXd> fLLT;
+  };
+}
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <mutex>
 #include <thread>
 #include <shared_mutex>
 #include <unordered_map>
+#include <utility>
 
 namespace ana
 {
@@ -13,6 +17,8 @@ namespace ana
   template<class T> class ThreadLocal
   {
   public:
+    ThreadLocal() : fSerial(NextSerial()) {}
+
     ~ThreadLocal()
     {
       // No good way to know a thread exited, so we can't cleanup until here
@@ -20,6 +26,35 @@ namespace ana
     }
 
     T* operator->()
+    {
+      // Each thread remembers which value it was handed by recent
+      // ThreadLocals, so that the common case doesn't touch the shared mutex
+      // at all (which would serialize all the threads on one cache line). A
+      // thread can't be told when a ThreadLocal is deleted, so this is a fixed
+      // number of slots, indexed by serial number, rather than anything that
+      // could grow. Serial numbers are never reused, so a stale slot can't be
+      // mistaken for a live one.
+      thread_local std::array<std::pair<long, T*>, kCacheSize> cache = MakeCache();
+      std::pair<long, T*>& slot = cache[fSerial % kCacheSize];
+      if(slot.first == fSerial) return slot.second;
+
+      T* val = Lookup();
+      slot = std::make_pair(fSerial, val);
+      return val;
+    }
+
+    /// \brief Call \a f on the value belonging to each thread
+    ///
+    /// For example, to combine the per-thread results at the end of a
+    /// calculation. Don't call while other threads are still making changes.
+    template<class F> void ForEach(F&& f)
+    {
+      std::unique_lock lock(fMutex);
+      for(auto it: fVals) f(*it.second);
+    }
+
+  protected:
+    T* Lookup()
     {
       const std::thread::id id = std::this_thread::get_id();
 
@@ -41,8 +76,24 @@ namespace ana
       return val;
     }
 
-  protected:
+    /// Enough for a thread to work with this many ThreadLocals at once
+    static constexpr int kCacheSize = 64;
+
+    static std::array<std::pair<long, T*>, kCacheSize> MakeCache()
+    {
+      std::array<std::pair<long, T*>, kCacheSize> ret;
+      ret.fill(std::make_pair(-1, nullptr));
+      return ret;
+    }
+
+    static long NextSerial()
+    {
+      static std::atomic<long> next(0);
+      return next++;
+    }
+
     std::unordered_map<std::thread::id, T*> fVals;
     std::shared_mutex fMutex;
+    const long fSerial;
   };
 }
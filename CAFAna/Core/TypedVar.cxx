@@ -0,0 +1,12 @@
+#include "CAFAna/Core/TypedVar.h"
+
+#include <iostream>
+
+namespace ana
+{
+  //----------------------------------------------------------------------
+  void TypedComparisonNaNWarning(double a, const char* op, double b)
+  {
+    std::cout << "Warning: Cut compares " << a << " " << op << " " << b << std::endl;
+  }
+}
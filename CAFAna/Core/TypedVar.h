@@ -0,0 +1,230 @@
+#pragma once
+
+// Opt-in alternative to composing _Var and _Cut objects directly. See
+// TypedVar() and TypedCut() below.
+
+#include "CAFAna/Core/Var.h"
+
+#include <cmath>
+#include <functional>
+#include <vector>
+
+namespace ana
+{
+  /// Print the same warning as a regular Cut comparing a NaN
+  void TypedComparisonNaNWarning(double a, const char* op, double b);
+
+  /// Building blocks of typed expressions. Each is a callable taking const T*
+  namespace typedexpr
+  {
+    struct Const
+    {
+      double c;
+      template<class T> double operator()(const T*) const {return c;}
+    };
+
+    template<class A, class B, class Op> struct Arith
+    {
+      A a; B b;
+      template<class T> double operator()(const T* rec) const
+      {
+        return Op()(a(rec), b(rec));
+      }
+    };
+
+    /// Same as VarBase::operator/, zero where the denominator is
+    template<class A, class B> struct Divide
+    {
+      A a; B b;
+      template<class T> double operator()(const T* rec) const
+      {
+        const double denom = b(rec);
+        return (denom != 0) ? a(rec) / denom : 0.0;
+      }
+    };
+
+    template<class A, class B, class Op> struct Compare
+    {
+      A a; B b; const char* name;
+      template<class T> bool operator()(const T* rec) const
+      {
+        const double va = a(rec);
+        const double vb = b(rec);
+        if(std::isnan(va) || std::isnan(vb)) TypedComparisonNaNWarning(va, name, vb);
+        return Op()(va, vb);
+      }
+    };
+
+    template<class A, class B> struct And
+    {
+      A a; B b;
+      template<class T> bool operator()(const T* rec) const {return a(rec) && b(rec);}
+    };
+
+    template<class A, class B> struct Or
+    {
+      A a; B b;
+      template<class T> bool operator()(const T* rec) const {return a(rec) || b(rec);}
+    };
+
+    template<class A> struct Not
+    {
+      A a;
+      template<class T> bool operator()(const T* rec) const {return !a(rec);}
+    };
+  }
+
+  template<class T, class F> class _TypedCut;
+
+  /// \brief A Var whose whole expression tree is known at compile time
+  ///
+  /// Combining these with arithmetic and comparison operators keeps the
+  /// concrete type of every operand, so the compiler can inline the entire
+  /// expression into a single function. The type is only erased once, when
+  /// the result is converted to an ordinary _Var to give to a loader or
+  /// Spectrum. The evaluated values are the same as for the equivalent
+  /// composition of _Var objects.
+  ///
+  /// Make these with \ref TypedVar. The results are new Vars, with their own
+  /// IDs, so this trades away sharing of common sub-expressions by ID.
+  template<class T, class F> class _TypedVar
+  {
+  public:
+    explicit _TypedVar(const F& f) : fFunc(f) {}
+
+    double operator()(const T* rec) const {return fFunc(rec);}
+
+    const F& Func() const {return fFunc;}
+
+    /// Erase the type. Also provides a batch implementation with the whole
+    /// expression inlined into the loop
+    operator _Var<T>() const
+    {
+      const F f = fFunc;
+      return _Var<T>(f, [f](const T* const* recs, int n, double* out)
+                     {
+                       for(int i = 0; i < n; ++i) out[i] = f(recs[i]);
+                     });
+    }
+
+  protected:
+    F fFunc;
+  };
+
+  /// \brief A Cut whose whole expression tree is known at compile time
+  ///
+  /// See \ref _TypedVar. Conversion to an ordinary _Cut happens once, at the
+  /// point of use. Cuts needing POT or livetime functions have to be made as
+  /// ordinary _Cut objects.
+  template<class T, class F> class _TypedCut
+  {
+  public:
+    explicit _TypedCut(const F& f) : fFunc(f) {}
+
+    bool operator()(const T* rec) const {return fFunc(rec);}
+
+    const F& Func() const {return fFunc;}
+
+    operator _Cut<T>() const {return _Cut<T>(fFunc);}
+
+  protected:
+    F fFunc;
+  };
+
+  /// \brief Start a typed expression from any callable double(const T*)
+  ///
+  /// eg auto kE = TypedVar<caf::SRProxy>([](const caf::SRProxy* sr){...});
+  ///
+  /// Existing _Var objects can be wrapped too, at the cost of one indirect
+  /// call each.
+  template<class T, class F> _TypedVar<T, F> TypedVar(F f)
+  {
+    return _TypedVar<T, F>(f);
+  }
+
+  /// Start a typed expression from any callable bool(const T*)
+  template<class T, class F> _TypedCut<T, F> TypedCut(F f)
+  {
+    return _TypedCut<T, F>(f);
+  }
+
+  // Arithmetic
+
+#define TYPEDVAR_ARITH(OP, FUNCTOR)                                     \
+  template<class T, class F, class G>                                   \
+  _TypedVar<T, typedexpr::Arith<F, G, FUNCTOR>>                         \
+  operator OP(const _TypedVar<T, F>& a, const _TypedVar<T, G>& b)       \
+  {                                                                     \
+    return _TypedVar<T, typedexpr::Arith<F, G, FUNCTOR>>({a.Func(), b.Func()}); \
+  }                                                                     \
+  void dummy_typedvar_arith() // trick to require a semicolon
+
+  TYPEDVAR_ARITH(+, std::plus<double>);
+  TYPEDVAR_ARITH(-, std::minus<double>);
+  TYPEDVAR_ARITH(*, std::multiplies<double>);
+
+#undef TYPEDVAR_ARITH
+
+  template<class T, class F, class G>
+  _TypedVar<T, typedexpr::Divide<F, G>>
+  operator/(const _TypedVar<T, F>& a, const _TypedVar<T, G>& b)
+  {
+    return _TypedVar<T, typedexpr::Divide<F, G>>({a.Func(), b.Func()});
+  }
+
+  // Comparisons, with another typed Var or a constant on either side
+
+#define TYPEDVAR_COMPARISON(OP, FUNCTOR)                                \
+  template<class T, class F, class G>                                   \
+  _TypedCut<T, typedexpr::Compare<F, G, FUNCTOR>>                       \
+  operator OP(const _TypedVar<T, F>& a, const _TypedVar<T, G>& b)       \
+  {                                                                     \
+    return _TypedCut<T, typedexpr::Compare<F, G, FUNCTOR>>({a.Func(), b.Func(), #OP}); \
+  }                                                                     \
+                                                                        \
+  template<class T, class F>                                            \
+  _TypedCut<T, typedexpr::Compare<F, typedexpr::Const, FUNCTOR>>        \
+  operator OP(const _TypedVar<T, F>& a, double c)                       \
+  {                                                                     \
+    return _TypedCut<T, typedexpr::Compare<F, typedexpr::Const, FUNCTOR>>({a.Func(), {c}, #OP}); \
+  }                                                                     \
+                                                                        \
+  template<class T, class F>                                            \
+  _TypedCut<T, typedexpr::Compare<typedexpr::Const, F, FUNCTOR>>        \
+  operator OP(double c, const _TypedVar<T, F>& b)                       \
+  {                                                                     \
+    return _TypedCut<T, typedexpr::Compare<typedexpr::Const, F, FUNCTOR>>({{c}, b.Func(), #OP}); \
+  }                                                                     \
+  void dummy_typedvar_comparison() // trick to require a semicolon
+
+  TYPEDVAR_COMPARISON(>,  std::greater<double>);
+  TYPEDVAR_COMPARISON(>=, std::greater_equal<double>);
+  TYPEDVAR_COMPARISON(<,  std::less<double>);
+  TYPEDVAR_COMPARISON(<=, std::less_equal<double>);
+  TYPEDVAR_COMPARISON(==, std::equal_to<double>);
+  TYPEDVAR_COMPARISON(!=, std::not_equal_to<double>);
+
+#undef TYPEDVAR_COMPARISON
+
+  // Logic
+
+  template<class T, class F, class G>
+  _TypedCut<T, typedexpr::And<F, G>>
+  operator&&(const _TypedCut<T, F>& a, const _TypedCut<T, G>& b)
+  {
+    return _TypedCut<T, typedexpr::And<F, G>>({a.Func(), b.Func()});
+  }
+
+  template<class T, class F, class G>
+  _TypedCut<T, typedexpr::Or<F, G>>
+  operator||(const _TypedCut<T, F>& a, const _TypedCut<T, G>& b)
+  {
+    return _TypedCut<T, typedexpr::Or<F, G>>({a.Func(), b.Func()});
+  }
+
+  template<class T, class F>
+  _TypedCut<T, typedexpr::Not<F>> operator!(const _TypedCut<T, F>& a)
+  {
+    return _TypedCut<T, typedexpr::Not<F>>({a.Func()});
+  }
+}
@@ -33,6 +33,23 @@ namespace ana
       FuncPT fFunc;
     };
 
+    /// Likewise for batch functions
+    template<class FuncT, class ArgT> struct AddBatchType
+    {
+      static_assert(std::is_invocable_v<FuncT, const ArgT* const*, int, double*>);
+
+      typedef typename std::conditional_t<std::is_function_v<FuncT>,
+                                          typename std::add_pointer_t<FuncT>,
+                                          FuncT> FuncPT;
+
+      AddBatchType(const FuncT& f) : fFunc(f) {}
+      void operator()(const void* const* xs, int n, double* out)
+      {
+        fFunc((const ArgT* const*)xs, n, out);
+      }
+      FuncPT fFunc;
+    };
+
     /// std::function can wrap a real function, function object, or lambda
     _Var(const std::function<VarFunc_t>& func)
       : VarBase(AddType<decltype(func), T>(func))
@@ -44,6 +61,17 @@ namespace ana
     {
     }
 
+    /// \brief Variable that can also be evaluated for many records at once
+    ///
+    /// \a batchfunc is called as batchfunc(recs, n, out), with \a recs an
+    /// array of n const T*, and must fill \a out with the same values that \a
+    /// func would give.
+    template<class FuncT, class BatchFuncT> _Var(const FuncT& func,
+                                                 const BatchFuncT& batchfunc)
+      : VarBase(AddType<FuncT, T>(func), AddBatchType<BatchFuncT, T>(batchfunc), -1)
+    {
+    }
+
     /// \brief Variable formed from two input variables
     ///
     /// The binning of each variable has to be given to allow conversion into a
@@ -77,10 +105,37 @@ namespace ana
     {
     }
 
+    /// \brief Variable formed from any number of input variables
+    ///
+    /// Flattened the same way as \ref LabelsAndBins::FindBin
+    _Var(const std::vector<_Var>& vars, const std::vector<Binning>& bins)
+      : VarBase(BasePtrs(vars), bins)
+    {
+    }
+
     /// Allows a variable to be called with double value = myVar(rec) syntax
     double operator()(const T* rec) const
     {
-      return fFunc(rec);
+      return VarBase::operator()(rec);
+    }
+
+    /// \brief Bin of \a bins that the value for \a rec falls in
+    ///
+    /// Memoized inside a \ref VarCacheScope, see there for when that needs
+    /// invalidating
+    int FindBin(const Binning& bins, const T* rec) const
+    {
+      return VarBase::FindBin(bins, rec);
+    }
+
+    /// \brief Evaluate for many records at once
+    ///
+    /// Composite Vars combine the results of their components a whole batch
+    /// at a time. \a out is resized to match \a recs.
+    void Eval(const std::vector<const T*>& recs, std::vector<double>& out) const
+    {
+      out.resize(recs.size());
+      EvalBatch((const void* const*)recs.data(), recs.size(), out.data());
     }
 
     /// Vars with the same definition will have the same ID
@@ -107,7 +162,16 @@ namespace ana
     _Var operator-(const _Var& v) const {return VarBase::operator-(v);}
 
   protected:
+    friend class ExprProgram;
+
     _Var(const VarBase& v) : VarBase(v) {}
+
+    static std::vector<const VarBase*> BasePtrs(const std::vector<_Var>& vars)
+    {
+      std::vector<const VarBase*> ret;
+      for(const _Var& v: vars) ret.push_back(&v);
+      return ret;
+    }
   };
 
   // Variants of the comparisons with the constant on the LHS
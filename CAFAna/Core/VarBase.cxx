@@ -1,22 +1,89 @@
 #include "CAFAna/Core/VarBase.h"
 
 #include "CAFAna/Core/DepMan.h"
+#include "CAFAna/Core/LabelsAndBins.h"
+
+#include <Eigen/Dense>
 
 #include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <iostream>
-#include <map>
+#include <utility>
+
+namespace
+{
+  /// Values memoized inside VarCacheScope, for one thread
+  struct VarCache
+  {
+    /// Incremented for each new record, making all the old entries stale
+    unsigned int gen = 0;
+
+    /// Indexed by Var ID. Entries are only valid if their stamp is gen
+    std::vector<double> vals;
+    std::vector<unsigned int> valStamps;
+
+    /// (binning, bin) results of FindBin(), indexed by Var ID
+    std::vector<std::vector<std::pair<const ana::Binning*, int>>> bins;
+    std::vector<unsigned int> binStamps;
+
+    void NewRecord()
+    {
+      if(++gen == 0){
+        // Wrapped around. Make sure no ancient entries can match
+        std::fill(valStamps.begin(), valStamps.end(), 0);
+        std::fill(binStamps.begin(), binStamps.end(), 0);
+        gen = 1;
+      }
+    }
+  };
+
+  thread_local VarCache gVarCache;
+}
 
 namespace ana
 {
   //----------------------------------------------------------------------
   VarBase::VarBase(const std::function<VoidVarFunc_t>& func, int id)
-    : fFunc(func), fID((id >= 0) ? id : fgNextID++)
+    : fFunc(func), fID((id >= 0) ? id : InternID({ExprGraph::kLeaf, -1, -1, 0}))
   {
     DepMan<VarBase>::Instance().RegisterConstruction(this);
   }
 
+  //----------------------------------------------------------------------
+  VarBase::VarBase(const std::function<VoidVarFunc_t>& func,
+                   const std::function<VoidBatchVarFunc_t>& batchfunc,
+                   int id)
+    : fFunc(func), fBatchFunc(batchfunc),
+      fID((id >= 0) ? id : InternID({ExprGraph::kLeaf, -1, -1, 0}))
+  {
+    DepMan<VarBase>::Instance().RegisterConstruction(this);
+  }
+
+  //----------------------------------------------------------------------
+  VarBase::VarBase(const std::function<VoidVarFunc_t>& func,
+                   const std::function<VoidBatchVarFunc_t>& batchfunc,
+                   const ExprGraph::Node& node)
+    : fFunc(func), fBatchFunc(batchfunc), fID(InternID(node))
+  {
+    DepMan<VarBase>::Instance().RegisterConstruction(this);
+  }
+
+  //----------------------------------------------------------------------
+  int VarBase::InternID(const ExprGraph::Node& node)
+  {
+    return ExprGraph::Instance().InternVar(node, fgNextID);
+  }
+
+  //----------------------------------------------------------------------
+  ExprGraph::Node VarBase::Composite(ExprGraph::EOp op, int a, int b)
+  {
+    // A Var copied from one that isn't statically constructed yet has no ID
+    // yet. The result can't be related to anything else.
+    if(a < 0 || b < 0) return {ExprGraph::kLeaf, -1, -1, 0};
+    return {op, a, b, 0};
+  }
+
   //----------------------------------------------------------------------
   VarBase::~VarBase()
   {
@@ -25,12 +92,13 @@ namespace ana
 
   //----------------------------------------------------------------------
   VarBase::VarBase(const VarBase& v)
-    : fFunc(0), fID(-1)
+    : fFunc(0), fBatchFunc(0), fID(-1)
   {
     if(&v == this) return;
 
     if(v.fFunc){
       fFunc = v.fFunc;
+      fBatchFunc = v.fBatchFunc;
       fID = v.fID;
 
       DepMan<VarBase>::Instance().RegisterConstruction(this);
@@ -50,12 +118,14 @@ namespace ana
 
     if(v.fFunc){
       fFunc = v.fFunc;
+      fBatchFunc = v.fBatchFunc;
       fID = v.fID;
 
       DepMan<VarBase>::Instance().RegisterConstruction(this);
     }
     else{
       fFunc = 0;
+      fBatchFunc = 0;
       fID = -1;
 
       // If we are copying from a Var with NULL func, that is probably because
@@ -93,53 +163,219 @@ namespace ana
     }
   }
 
+  // Batch equivalents of the warnings from ValHelper
+  static void WarnNaNs(const std::vector<double>& vals, const std::string& op, double c)
+  {
+    for(double val: vals){
+      if(std::isnan(val)){
+        std::cout << "Warning: Cut compares NaN " << op << " " << c << std::endl;
+      }
+    }
+  }
+
+  static void WarnNaNs(const std::vector<double>& as, const std::vector<double>& bs,
+                       const std::string& op)
+  {
+    for(unsigned int i = 0; i < as.size(); ++i){
+      if(std::isnan(as[i]) || std::isnan(bs[i])){
+        std::cout << "Warning: Cut compares " << as[i] << " " << op << " " << bs[i] << std::endl;
+      }
+    }
+  }
+
+  //----------------------------------------------------------------------
+  void VarBase::EvalBatch(const void* const* recs, int n, double* out) const
+  {
+    if(fBatchFunc){
+      fBatchFunc(recs, n, out);
+    }
+    else{
+      for(int i = 0; i < n; ++i) out[i] = (*this)(recs[i]);
+    }
+  }
+
+  //----------------------------------------------------------------------
+  /// Comparison of a Var with a constant
+  template<class CmpT> struct VarBase::CompareConst
+  {
+    VarBase v; double c;
+    bool operator()(const void* rec) const
+    {
+      return CmpT()(ValHelper(v, CmpT::kName, c, rec), c);
+    }
+    void operator()(const void* const* recs, int n, char* pass) const
+    {
+      std::vector<double> vals(n);
+      v.EvalBatch(recs, n, vals.data());
+      WarnNaNs(vals, CmpT::kName, c);
+      for(int i = 0; i < n; ++i) pass[i] = CmpT()(vals[i], c);
+    }
+  };
+
+  //----------------------------------------------------------------------
+  /// Comparison of a Var with another Var
+  template<class CmpT> struct VarBase::Compare
+  {
+    VarBase a, b;
+    bool operator()(const void* rec) const
+    {
+      double va, vb;
+      ValHelper(a, b, CmpT::kName, rec, va, vb);
+      return CmpT()(va, vb);
+    }
+    void operator()(const void* const* recs, int n, char* pass) const
+    {
+      std::vector<double> vas(n), vbs(n);
+      a.EvalBatch(recs, n, vas.data());
+      b.EvalBatch(recs, n, vbs.data());
+      WarnNaNs(vas, vbs, CmpT::kName);
+      for(int i = 0; i < n; ++i) pass[i] = CmpT()(vas[i], vbs[i]);
+    }
+  };
 
   // These comparison operators are extremely rote. Use a macro
 
-#define COMPARISON(OP, OPNAME)                                          \
-  /* Comparison of a Var with a constant */                             \
-  CutBase VarBase::                                                     \
-  operator OP(double c) const                                           \
+#define COMPARISON(OP, OPNAME, EOP)                                     \
+  namespace                                                             \
   {                                                                     \
     struct OPNAME                                                       \
     {                                                                   \
-      VarBase v; double c;                                              \
-      bool operator()(const void* rec)                                  \
-      {                                                                 \
-        return ValHelper(v, #OP, c, rec) OP c;                          \
-      }                                                                 \
+      static constexpr const char* kName = #OP;                         \
+      bool operator()(double a, double b) const {return a OP b;}        \
     };                                                                  \
+  }                                                                     \
                                                                         \
-    return CutBase(OPNAME{*this, c}, 0, 0, -1);                         \
+  /* Comparison of a Var with a constant */                             \
+  CutBase VarBase::                                                     \
+  operator OP(double c) const                                           \
+  {                                                                     \
+    const CompareConst<OPNAME> f{*this, c};                             \
+    const ExprGraph::Node node = (ID() >= 0) ?                          \
+      ExprGraph::Node{ExprGraph::EOP, ID(), -1, c} :                    \
+      ExprGraph::Node{ExprGraph::kLeaf, -1, -1, 0};                     \
+    return CutBase(f, f, 0, 0, node);                                   \
   }                                                                     \
                                                                         \
   /* Comparison of a Var with another Var */                            \
   CutBase VarBase::                                                     \
   operator OP(const VarBase& v) const                                   \
   {                                                                     \
-    struct OPNAME                                                       \
-    {                                                                   \
-      VarBase a, b;                                                     \
-      bool operator()(const void* rec)                                  \
-      {                                                                 \
-        double va, vb;                                                  \
-        ValHelper(a, b, #OP, rec, va, vb);                              \
-        return va OP vb;                                                \
-      }                                                                 \
-    };                                                                  \
-                                                                        \
-    return CutBase(OPNAME{*this, v}, 0, 0, -1);                         \
+    const Compare<OPNAME> f{*this, v};                                  \
+    return CutBase(f, f, 0, 0, Composite(ExprGraph::EOP, ID(), v.ID())); \
   }                                                                     \
   void dummy() // trick to require a semicolon
 
-  COMPARISON(>,  Greater);
-  COMPARISON(>=, GreaterEquals);
-  COMPARISON(<,  Less);
-  COMPARISON(<=, LessEquals);
-  COMPARISON(==, Equals);
-  COMPARISON(!=, NotEquals);
+  COMPARISON(>,  Greater,       kGreater);
+  COMPARISON(>=, GreaterEquals, kGreaterEquals);
+  COMPARISON(<,  Less,          kLess);
+  COMPARISON(<=, LessEquals,    kLessEquals);
+  COMPARISON(==, Equals,        kEquals);
+  COMPARISON(!=, NotEquals,     kNotEquals);
+
+  //----------------------------------------------------------------------
+  bool VarBase::Operands(const CutBase& c, const VarBase*& a, const VarBase*& b)
+  {
+    // Try each kind of comparison in turn
+    auto find = [&c, &a, &b](auto cmp)
+    {
+      typedef decltype(cmp) CmpT;
+      if(const auto* f = c.fFunc.target<CompareConst<CmpT>>()){
+        a = &f->v;
+        b = 0;
+        return true;
+      }
+      if(const auto* f = c.fFunc.target<Compare<CmpT>>()){
+        a = &f->a;
+        b = &f->b;
+        return true;
+      }
+      return false;
+    };
+
+    return (find(Greater()) || find(GreaterEquals()) ||
+            find(Less()) || find(LessEquals()) ||
+            find(Equals()) || find(NotEquals()));
+  }
+
+  std::atomic<int> VarBase::fgNextID(0);
+
+  thread_local const void* VarBase::fgCacheRec = 0;
+
+  //----------------------------------------------------------------------
+  double VarBase::CachedValue(const void* rec) const
+  {
+    VarCache& cache = gVarCache;
+    if(fID >= int(cache.vals.size())){
+      const int n = std::max(fID, MaxID())+1;
+      cache.vals.resize(n);
+      cache.valStamps.resize(n, 0);
+    }
+
+    if(cache.valStamps[fID] == cache.gen) return cache.vals[fID];
+
+    // Can evaluate other Vars, and so resize the cache. Don't hold any
+    // references into it over this call.
+    const double val = fFunc(rec);
+    cache.vals[fID] = val;
+    cache.valStamps[fID] = cache.gen;
+    return val;
+  }
+
+  //----------------------------------------------------------------------
+  int VarBase::FindBin(const Binning& bins, const void* rec) const
+  {
+    if(!rec || rec != fgCacheRec || fID < 0) return bins.FindBin(fFunc(rec));
+
+    VarCache& cache = gVarCache;
+    if(fID < int(cache.bins.size()) && cache.binStamps[fID] == cache.gen){
+      for(const auto& it: cache.bins[fID]) if(it.first == &bins) return it.second;
+    }
+
+    const int bin = bins.FindBin(CachedValue(rec));
+
+    if(fID >= int(cache.bins.size())){
+      const int n = std::max(fID, MaxID())+1;
+      cache.bins.resize(n);
+      cache.binStamps.resize(n, 0);
+    }
+    if(cache.binStamps[fID] != cache.gen){
+      cache.bins[fID].clear();
+      cache.binStamps[fID] = cache.gen;
+    }
+    cache.bins[fID].emplace_back(&bins, bin);
+    return bin;
+  }
+
+  //----------------------------------------------------------------------
+  void VarBase::SetCacheRecord(const void* rec)
+  {
+    fgCacheRec = rec;
+    gVarCache.NewRecord();
+  }
+
+  //----------------------------------------------------------------------
+  VarCacheScope::VarCacheScope(const void* rec)
+    : fPrevRec(VarBase::fgCacheRec), fCuts(rec)
+  {
+    VarBase::SetCacheRecord(rec);
+  }
+
+  //----------------------------------------------------------------------
+  VarCacheScope::~VarCacheScope()
+  {
+    // The inner record may have overwritten the outer one's values, or been
+    // a shifted version of the same record, so they all have to be
+    // recomputed
+    VarBase::SetCacheRecord(fPrevRec);
+  }
 
-  int VarBase::fgNextID = 0;
+  //----------------------------------------------------------------------
+  void VarCacheScope::Invalidate()
+  {
+    // Covers the FindBin() results too
+    gVarCache.NewRecord();
+    fCuts.Invalidate();
+  }
 
   //----------------------------------------------------------------------
   Var2DMapper::Var2DMapper(const Binning& binsa, const Binning& binsb)
@@ -151,7 +387,7 @@ namespace ana
   {
     // Since there are no overflow/underflow bins, check the range
     if(va < fBinsA.Min() || vb < fBinsB.Min()) return -1;
-    if(va > fBinsA.Max() || vb > fBinsB.Max()) return fBinsA.NBins() * fBinsB.NBins();
+    if(va >= fBinsA.Max() || vb >= fBinsB.Max()) return fBinsA.NBins() * fBinsB.NBins();
 
     // FindBin uses root convention, first bin is bin 1, bin 0 is underflow
     const int ia = fBinsA.FindBin(va) - 1;
@@ -173,25 +409,6 @@ namespace ana
     return ret;
   }
 
-  /// Helper for 2D VarBase constructor
-  class Var2DFunc : protected Var2DMapper
-  {
-  public:
-    Var2DFunc(const VarBase& a, const Binning& binsa,
-              const VarBase& b, const Binning& binsb)
-      : Var2DMapper(binsa, binsb), fA(a), fB(b)
-    {
-    }
-
-    double operator()(const void* rec) const
-    {
-      return Map(fA(rec), fB(rec));
-    }
-
-  protected:
-    const VarBase fA, fB;
-  };
-
 
   Var3DMapper::Var3DMapper(const Binning& binsa, const Binning& binsb, const Binning& binsc)
     : fBinsA(binsa), fBinsB(binsb), fBinsC(binsc)
@@ -205,7 +422,7 @@ namespace ana
       return -1.0;
     }
 
-    if(va > fBinsA.Max() || vb > fBinsB.Max() || vc > fBinsC.Max()){
+    if(va >= fBinsA.Max() || vb >= fBinsB.Max() || vc >= fBinsC.Max()){
       return fBinsA.NBins() * fBinsB.NBins() * fBinsC.NBins();
     }
 
@@ -229,30 +446,83 @@ namespace ana
     return ret;
   }
 
-  /// Helper for 3D VarBase constructor
-  class Var3DFunc : protected Var3DMapper
+  /// Helper for multi-dimensional VarBase constructors
+  class VarNDFunc
   {
   public:
-    Var3DFunc(const VarBase& a, const Binning& binsa,
-              const VarBase& b, const Binning& binsb,
-              const VarBase& c, const Binning& binsc)
-      : Var3DMapper(binsa, binsb, binsc), fA(a), fB(b),	fC(c)
+    VarNDFunc(const std::vector<const VarBase*>& vars,
+              const std::vector<Binning>& bins)
+      : fAxis(std::vector<std::string>(bins.size()), bins)
     {
+      assert(vars.size() == bins.size());
+      fVars.reserve(vars.size());
+      for(const VarBase* v: vars) fVars.emplace_back(*v);
     }
 
     double operator()(const void* rec) const
     {
-      return Map(fA(rec), fB(rec), fC(rec));
+      const int bin = fAxis.FindBinWith([this, rec](int i){return fVars[i](rec);});
+      // Return the bin center, which maps back to the same bin in
+      // GetBins1D(). Keep the traditional -1 for underflow.
+      return (bin == 0) ? -1 : bin-.5;
+    }
+
+    void operator()(const void* const* recs, int n, double* out) const
+    {
+      // Evaluate each coordinate for all the records, then bin them
+      std::vector<std::vector<double>> coords(fVars.size(), std::vector<double>(n));
+      for(unsigned int i = 0; i < fVars.size(); ++i){
+        fVars[i].EvalBatch(recs, n, coords[i].data());
+      }
+
+      for(int j = 0; j < n; ++j){
+        const int bin = fAxis.FindBinWith([&coords, j](int i){return coords[i][j];});
+        out[j] = (bin == 0) ? -1 : bin-.5;
+      }
+    }
+
+    /// \brief Structure of the Var this makes, for the ExprGraph
+    ///
+    /// Identical if the input Vars and the binnings are, so that eg every
+    /// call to _HistAxis::GetVar1D() gives the same ID
+    static ExprGraph::Node Node(const std::vector<const VarBase*>& vars,
+                                const std::vector<Binning>& bins)
+    {
+      ExprGraph::Node node{ExprGraph::kMapND, -1, -1, 0};
+      for(const VarBase* v: vars){
+        // Not constructed yet, so nothing to identify it by
+        if(v->ID() < 0) return {ExprGraph::kLeaf, -1, -1, 0};
+        node.args.push_back(v->ID());
+      }
+      for(const Binning& b: bins){
+        // Probably one not statically constructed yet, so nothing to
+        // identify it by
+        if(b.NBins() == 0) return {ExprGraph::kLeaf, -1, -1, 0};
+        // Simple binnings are found arithmetically, others by search. They
+        // should agree, but don't rely on it.
+        node.args.push_back(b.IsSimple());
+        node.args.push_back(b.Edges().size());
+        node.args.insert(node.args.end(), b.Edges().begin(), b.Edges().end());
+      }
+      return node;
     }
 
   protected:
-    const VarBase fA, fB, fC;
+    /// VarBase's copy constructor isn't public, so can't go in a std::vector
+    /// directly
+    struct VarCopy: public VarBase
+    {
+      VarCopy(const VarBase& v) : VarBase(v) {}
+    };
+
+    std::vector<VarCopy> fVars;
+    const LabelsAndBins fAxis;
   };
 
   //----------------------------------------------------------------------
   VarBase::VarBase(const VarBase& a, const Binning& binsa,
                    const VarBase& b, const Binning& binsb)
-    : VarBase(Var2DFunc(a, binsa, b, binsb))
+    : VarBase({&a, &b}, {binsa, binsb})
   {
   }
 
@@ -260,78 +530,127 @@ namespace ana
   VarBase::VarBase(const VarBase& a, const Binning& binsa,
                    const VarBase& b, const Binning& binsb,
                    const VarBase& c, const Binning& binsc)
-    : VarBase(Var3DFunc(a, binsa, b, binsb, c, binsc))
+    : VarBase({&a, &b, &c}, {binsa, binsb, binsc})
   {
   }
 
   //----------------------------------------------------------------------
-  VarBase VarBase::operator*(const VarBase& v) const
+  VarBase::VarBase(const std::vector<const VarBase*>& vars,
+                   const std::vector<Binning>& bins)
+    : VarBase(VarNDFunc(vars, bins), VarNDFunc(vars, bins),
+              VarNDFunc::Node(vars, bins))
   {
-    static std::map<std::pair<int, int>, int> ids;
-    const std::pair<int, int> key(ID(), v.ID());
+  }
 
-    struct Times
+  //----------------------------------------------------------------------
+  struct VarBase::Times
+  {
+    const VarBase a, b;
+    double operator()(const void* rec) const {return a(rec) * b(rec);}
+    void operator()(const void* const* recs, int n, double* out) const
     {
-      const VarBase a, b;
-      double operator()(const void* rec) const {return a(rec) * b(rec);}
-    };
+      Eigen::ArrayXd vb(n);
+      a.EvalBatch(recs, n, out);
+      b.EvalBatch(recs, n, vb.data());
+      Eigen::Map<Eigen::ArrayXd>(out, n) *= vb;
+    }
+  };
 
-    if(ids.count(key) == 0) ids[key] = fgNextID++;
-    return VarBase(Times{*this, v});
+  //----------------------------------------------------------------------
+  VarBase VarBase::operator*(const VarBase& v) const
+  {
+    const Times f{*this, v};
+    return VarBase(f, f, Composite(ExprGraph::kTimes, ID(), v.ID()));
   }
 
   //----------------------------------------------------------------------
-  VarBase VarBase::operator/(const VarBase& v) const
+  struct VarBase::Divide
   {
-    static std::map<std::pair<int, int>, int> ids;
-    const std::pair<int, int> key(ID(), v.ID());
-
-    struct Divide
+    const VarBase a, b;
+    double operator()(const void* rec) const
+    {
+      const double denom = b(rec);
+      if(denom != 0)
+        return a(rec) / denom;
+      else
+        return 0.0;
+    }
+    void operator()(const void* const* recs, int n, double* out) const
     {
-      const VarBase a, b;
-      double operator()(const void* rec) const
-      {
-        const double denom = b(rec);
-        if(denom != 0)
-          return a(rec) / denom;
-        else
-          return 0.0;
+      // As above, the numerator is only needed where the denominator is
+      // non-zero
+      Eigen::ArrayXd denom(n);
+      b.EvalBatch(recs, n, denom.data());
+
+      std::vector<const void*> sub;
+      sub.reserve(n);
+      for(int i = 0; i < n; ++i) if(denom[i] != 0) sub.push_back(recs[i]);
+
+      std::vector<double> num(sub.size());
+      a.EvalBatch(sub.data(), sub.size(), num.data());
+
+      for(int i = 0, j = 0; i < n; ++i){
+        out[i] = (denom[i] != 0) ? num[j++] / denom[i] : 0.0;
       }
-    };
+    }
+  };
 
-    if(ids.count(key) == 0) ids[key] = fgNextID++;
-    return VarBase(Divide{*this, v}, ids[key]);
+  //----------------------------------------------------------------------
+  VarBase VarBase::operator/(const VarBase& v) const
+  {
+    const Divide f{*this, v};
+    return VarBase(f, f, Composite(ExprGraph::kDivide, ID(), v.ID()));
   }
 
   //----------------------------------------------------------------------
-  VarBase VarBase::operator+(const VarBase& v) const
+  struct VarBase::Plus
   {
-    static std::map<std::pair<int, int>, int> ids;
-    const std::pair<int, int> key(ID(), v.ID());
-
-    struct Plus
+    const VarBase a, b;
+    double operator()(const void* rec) const {return a(rec) + b(rec);}
+    void operator()(const void* const* recs, int n, double* out) const
     {
-      const VarBase a, b;
-      double operator()(const void* rec) const {return a(rec) + b(rec);}
-    };
+      Eigen::ArrayXd vb(n);
+      a.EvalBatch(recs, n, out);
+      b.EvalBatch(recs, n, vb.data());
+      Eigen::Map<Eigen::ArrayXd>(out, n) += vb;
+    }
+  };
 
-    if(ids.count(key) == 0) ids[key] = fgNextID++;
-    return VarBase(Plus{*this, v}, ids[key]);
+  //----------------------------------------------------------------------
+  VarBase VarBase::operator+(const VarBase& v) const
+  {
+    const Plus f{*this, v};
+    return VarBase(f, f, Composite(ExprGraph::kPlus, ID(), v.ID()));
   }
 
   //----------------------------------------------------------------------
-  VarBase VarBase::operator-(const VarBase& v) const
+  struct VarBase::Minus
   {
-    static std::map<std::pair<int, int>, int> ids;
-    const std::pair<int, int> key(ID(), v.ID());
-
-    struct Minus
+    const VarBase a, b;
+    double operator()(const void* rec) const {return a(rec) - b(rec);}
+    void operator()(const void* const* recs, int n, double* out) const
     {
-      const VarBase a, b;
-      double operator()(const void* rec) const {return a(rec) - b(rec);}
-    };
+      Eigen::ArrayXd vb(n);
+      a.EvalBatch(recs, n, out);
+      b.EvalBatch(recs, n, vb.data());
+      Eigen::Map<Eigen::ArrayXd>(out, n) -= vb;
+    }
+  };
 
-    if(ids.count(key) == 0) ids[key] = fgNextID++;
-    return VarBase(Minus{*this, v}, ids[key]);
+  //----------------------------------------------------------------------
+  VarBase VarBase::operator-(const VarBase& v) const
+  {
+    const Minus f{*this, v};
+    return VarBase(f, f, Composite(ExprGraph::kMinus, ID(), v.ID()));
+  }
+
+  //----------------------------------------------------------------------
+  bool VarBase::Operands(const VarBase& v, const VarBase*& a, const VarBase*& b)
+  {
+    if(const Times* f = v.fFunc.target<Times>()){a = &f->a; b = &f->b; return true;}
+    if(const Divide* f = v.fFunc.target<Divide>()){a = &f->a; b = &f->b; return true;}
+    if(const Plus* f = v.fFunc.target<Plus>()){a = &f->a; b = &f->b; return true;}
+    if(const Minus* f = v.fFunc.target<Minus>()){a = &f->a; b = &f->b; return true;}
+    return false;
   }
 } // namespace
@@ -2,8 +2,11 @@
 
 #include "CAFAna/Core/Binning.h"
 #include "CAFAna/Core/CutBase.h"
+#include "CAFAna/Core/ExprGraph.h"
 
+#include <atomic>
 #include <functional>
+#include <vector>
 
 namespace ana
 {
@@ -14,10 +17,13 @@ namespace ana
   {
   public:
     typedef double (VoidVarFunc_t)(const void* rec);
+    /// Evaluate for \a n records at once, writing the results to \a out
+    typedef void (VoidBatchVarFunc_t)(const void* const* recs, int n, double* out);
 
     friend class DepMan<VarBase>;
-    friend class Var2DFunc;
-    friend class Var3DFunc;
+    friend class VarNDFunc;
+    friend class VarCacheScope;
+    friend class ExprProgram;
 
     friend double ValHelper(const VarBase&, const std::string&, double c, const void*);
     friend void ValHelper(const VarBase&, const VarBase&, const std::string&, const void*, double&, double&);
@@ -27,6 +33,17 @@ namespace ana
   protected:
     VarBase(const std::function<VoidVarFunc_t>& func, int id = -1);
 
+    /// \param batchfunc Optional faster implementation of \a func for many
+    ///                  records at once
+    VarBase(const std::function<VoidVarFunc_t>& func,
+            const std::function<VoidBatchVarFunc_t>& batchfunc,
+            int id);
+
+    /// A composite, given the same ID as any other with the same \a node
+    VarBase(const std::function<VoidVarFunc_t>& func,
+            const std::function<VoidBatchVarFunc_t>& batchfunc,
+            const ExprGraph::Node& node);
+
     VarBase(const VarBase& v);
 
     VarBase(const VarBase& a, const Binning& binsa,
@@ -36,14 +53,32 @@ namespace ana
             const VarBase& b, const Binning& binsb,
             const VarBase& c, const Binning& binsc);
 
+    /// Any number of dimensions, flattened as \ref LabelsAndBins::FindBin
+    VarBase(const std::vector<const VarBase*>& vars,
+            const std::vector<Binning>& bins);
+
     VarBase& operator=(const VarBase& v);
 
     /// Allows a variable to be called with double value = myVar(rec) syntax
     double operator()(const void* rec) const
     {
+      if(rec && rec == fgCacheRec && fID >= 0) return CachedValue(rec);
       return fFunc(rec);
     }
 
+    /// \brief Bin of \a bins that the value for \a rec falls in
+    ///
+    /// Memoized inside a \ref VarCacheScope, which must be invalidated if
+    /// the record changes. \a bins is identified by its address, so must not
+    /// be destroyed before the end of the record.
+    int FindBin(const Binning& bins, const void* rec) const;
+
+    /// \brief Evaluate for \a n records at once, into \a out
+    ///
+    /// Uses the batch implementation if there is one, otherwise evaluates
+    /// each record in turn.
+    void EvalBatch(const void* const* recs, int n, double* out) const;
+
     /// Vars with the same definition will have the same ID
     int ID() const {return fID;}
 
@@ -68,11 +103,85 @@ namespace ana
     VarBase operator+(const VarBase& v) const;
     VarBase operator-(const VarBase& v) const;
 
+    /// Lookup or evaluate the value for the record of the current scope
+    double CachedValue(const void* rec) const;
+
+    /// Start memoizing values for \a rec (or stop, if null) on this thread
+    static void SetCacheRecord(const void* rec);
+
+    /// \brief ID for a Var with structure \a node
+    ///
+    /// The existing ID if there is one, otherwise a new one, recorded in the
+    /// \ref ExprGraph. Threadsafe.
+    static int InternID(const ExprGraph::Node& node);
+
+    /// The result of composite operation \a op, unless the operands' IDs are
+    /// unknown (they're yet to be constructed) when it has to be opaque
+    static ExprGraph::Node Composite(ExprGraph::EOp op, int a, int b);
+
+    // Functors of the composites made by the operators above. They have
+    // names so that ExprProgram can find their operands.
+    struct Times;
+    struct Divide;
+    struct Plus;
+    struct Minus;
+    template<class CmpT> struct CompareConst;
+    template<class CmpT> struct Compare;
+
+    /// \brief Operands of \a v, if it was made by one of the arithmetic
+    /// operators, for \ref ExprProgram
+    ///
+    /// False for anything else.
+    static bool Operands(const VarBase& v, const VarBase*& a, const VarBase*& b);
+
+    /// \brief Operands of \a c, if it was made by one of the comparisons
+    ///
+    /// \a b is null for a comparison to a constant. False for anything else.
+    static bool Operands(const CutBase& c, const VarBase*& a, const VarBase*& b);
+
     std::function<VoidVarFunc_t> fFunc;
+    std::function<VoidBatchVarFunc_t> fBatchFunc; ///< May be empty
 
     int fID;
     /// The next ID that hasn't yet been assigned
-    static int fgNextID;
+    static std::atomic<int> fgNextID;
+
+    /// Record of the innermost \ref VarCacheScope on this thread, if any
+    static thread_local const void* fgCacheRec;
+  };
+
+  /// \brief Evaluate each distinct Var only once per record
+  ///
+  /// While one of these exists, calls on the same thread to any Var (or its
+  /// FindBin()) with \a rec are memoized by Var ID. Vars shared between many
+  /// spectra, or used inside several composite Vars and Cuts, are then only
+  /// computed once. Loaders should create one around all the filling for
+  /// each record. Outside of any scope Vars are simply evaluated every time.
+  ///
+  /// Values, and FindBin() results, are keyed on the record's address alone.
+  /// So a loader that applies systematic shifts to the record in place must
+  /// open a new scope, or call \ref Invalidate, every time it applies a
+  /// shift, and again once the record is restored.
+  ///
+  /// Also opens a \ref CutCacheScope, so that Cuts are memoized too.
+  class VarCacheScope
+  {
+  public:
+    VarCacheScope(const void* rec);
+    ~VarCacheScope();
+
+    /// Forget all the values (and Cut results) so far, because the record
+    /// has changed. O(1)
+    void Invalidate();
+
+    VarCacheScope(const VarCacheScope&) = delete;
+    VarCacheScope& operator=(const VarCacheScope&) = delete;
+
+  protected:
+    /// Restored on destruction, to allow nesting
+    const void* fPrevRec;
+
+    CutCacheScope fCuts;
   };
 
   class Var2DMapper
@@ -11,10 +11,17 @@ namespace ana
   {
   public:
     template<class FuncT> _Weight(const FuncT& func) : _Var<T>(func) {}
+    /// With a batch implementation, see \ref _Var
+    template<class FuncT, class BatchFuncT> _Weight(const FuncT& func,
+                                                    const BatchFuncT& batchfunc)
+      : _Var<T>(func, batchfunc)
+    {
+    }
 
     _Weight operator*(const _Weight& w) const {return _Weight((_Var<T>&)(*this) * (_Var<T>&)w);}
 
     using _Var<T>::operator();
+    using _Var<T>::Eval;
     using _Var<T>::ID;
     using _Var<T>::MaxID;
 
@@ -0,0 +1,90 @@
+// Reweighting a sparse ReweightableSpectrum must include fills that are still
+// pending in its buffer, and give the same answer as dense storage
+
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Core/LabelsAndBins.h"
+#include "CAFAna/Core/ReweightableSpectrum.h"
+
+#include <cmath>
+#include <iostream>
+#include <string>
+
+using namespace ana;
+
+namespace
+{
+  //----------------------------------------------------------------------
+  /// Dense storage turns empty rows or columns scaled by an infinite ratio
+  /// into NaN, where sparse storage keeps zero. Only compare the other cells
+  int Compare(const std::string& what, const Eigen::MatrixXd& m, const Eigen::MatrixXd& ref)
+  {
+    bool ok = m.rows() == ref.rows() && m.cols() == ref.cols();
+    for(int i = 0; ok && i < m.rows(); ++i){
+      for(int j = 0; ok && j < m.cols(); ++j){
+        if(std::isnan(m(i, j))) ok = false;
+        if(std::isfinite(ref(i, j)) && std::abs(m(i, j)-ref(i, j)) > 1e-9) ok = false;
+      }
+    }
+
+    if(!ok){
+      std::cout << what << ": got" << std::endl << m << std::endl
+                << "expected" << std::endl << ref << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+}
+
+int main()
+{
+  const LabelsAndBins axis("x", Binning::Simple(4, 0, 4));
+  const int n = 6; // including underflow and overflow
+
+  const Spectrum trueTarget(Eigen::ArrayXd(Eigen::ArrayXd::Constant(n, 2)), axis, 1, 0);
+  const Spectrum recoTarget(Eigen::ArrayXd(Eigen::ArrayXd::Constant(n, 3)), axis, 1, 0);
+
+  ReweightableSpectrum sparse(Eigen::SparseMatrix<double>(n, n), axis, axis, 1, 0);
+  ReweightableSpectrum dense(Eigen::MatrixXd(Eigen::MatrixXd::Zero(n, n)), axis, axis, 1, 0);
+
+  int nfail = 0;
+
+  if(!sparse.IsSparse()){
+    std::cout << "Expected sparse storage" << std::endl;
+    return 1;
+  }
+
+  for(ReweightableSpectrum* rw: {&sparse, &dense}){
+    rw->Fill(1.5, 1.5);
+    rw->Fill(2.5, 2.5);
+  }
+
+  // Reading the pending fills mustn't lose them
+  nfail += Compare("Pending fills", sparse.GetEigen(1), dense.GetEigen(1));
+  nfail += Compare("Projection", sparse.WeightingVariable().GetEigen(1).matrix(),
+                   dense.WeightingVariable().GetEigen(1).matrix());
+
+  // One more fill after the projection was cached
+  for(ReweightableSpectrum* rw: {&sparse, &dense}) rw->Fill(2.5, 1.5);
+
+  for(ReweightableSpectrum* rw: {&sparse, &dense}) rw->ReweightToTrueSpectrum(trueTarget);
+  nfail += Compare("ReweightToTrueSpectrum", sparse.GetEigen(1), dense.GetEigen(1));
+  // Two filled true bins, each scaled to the target
+  if(std::abs(sparse.GetEigen(1).sum() - 4) > 1e-9){
+    std::cout << "ReweightToTrueSpectrum total " << sparse.GetEigen(1).sum()
+              << " expected 4" << std::endl;
+    ++nfail;
+  }
+
+  for(ReweightableSpectrum* rw: {&sparse, &dense}) rw->Fill(2.5, 2.5);
+
+  for(ReweightableSpectrum* rw: {&sparse, &dense}) rw->ReweightToRecoSpectrum(recoTarget);
+  nfail += Compare("ReweightToRecoSpectrum", sparse.GetEigen(1), dense.GetEigen(1));
+  // Two filled reco bins, each scaled to the target
+  if(std::abs(sparse.GetEigen(1).sum() - 6) > 1e-9){
+    std::cout << "ReweightToRecoSpectrum total " << sparse.GetEigen(1).sum()
+              << " expected 6" << std::endl;
+    ++nfail;
+  }
+
+  return nfail ? 1 : 0;
+}
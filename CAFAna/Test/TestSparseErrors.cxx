@@ -0,0 +1,78 @@
+// Errors of sparse Hist::Multiply() and Hist::Divide() must match the same
+// operations on dense storage, without ever producing NaNs
+
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Core/Hist.h"
+
+#include <cmath>
+#include <iostream>
+
+using namespace ana;
+
+namespace
+{
+  const int kNBins = 1000;
+
+  //----------------------------------------------------------------------
+  /// Weighted fills, so the errors aren't just sqrt of the contents. \a off
+  /// moves the filled bins, so only some of them overlap between operands
+  Hist MakeHist(bool sparse, int off)
+  {
+    const Binning bins = Binning::Simple(kNBins, 0, kNBins);
+    Hist h = sparse ? Hist::ZeroSparse(kNBins) : Hist::Zero(kNBins);
+    for(int i = 0; i < 40; ++i) h.Fill(bins, (i*7+off)%300, 1+i%3);
+    return h;
+  }
+}
+
+int main()
+{
+  int nfail = 0;
+
+  for(const bool divide: {false, true}){
+    for(const bool zeroOverZero: {false, true}){
+      if(!divide && zeroOverZero) continue;
+
+      for(const bool rhsSparse: {false, true}){
+        Hist h = MakeHist(true, 0);
+        Hist ref = MakeHist(false, 0);
+        const Hist rhs = MakeHist(rhsSparse, 3);
+        const Hist refRhs = MakeHist(false, 3);
+
+        if(divide){
+          h.Divide(rhs, zeroOverZero);
+          ref.Divide(refRhs, zeroOverZero);
+        }
+        else{
+          h.Multiply(rhs);
+          ref.Multiply(refRhs);
+        }
+
+        for(int i = 0; i < kNBins+2; ++i){
+          const double err = h.GetBinError(i);
+          const double refErr = ref.GetBinError(i);
+
+          if(std::isnan(err)){
+            std::cout << "NaN error in bin " << i << std::endl;
+            ++nfail;
+            continue;
+          }
+
+          // Dense storage gets x/0 wrong, skip those bins
+          if(!std::isfinite(refErr)) continue;
+
+          if(std::abs(err-refErr) > 1e-9*(1+refErr)){
+            std::cout << (divide ? "Divide" : "Multiply")
+                      << (zeroOverZero ? " (0/0 = 0)" : "")
+                      << (rhsSparse ? " by sparse" : " by dense")
+                      << ": bin " << i << " error " << err
+                      << " expected " << refErr << std::endl;
+            ++nfail;
+          }
+        }
+      }
+    }
+  }
+
+  return nfail ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+// SpectrumExpr must give the same answers as the regular Spectrum operators,
+// and mustn't make any of those operators ambiguous
+
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Core/Hist.h"
+#include "CAFAna/Core/Ratio.h"
+#include "CAFAna/Core/SpectrumExpr.h"
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <type_traits>
+
+using namespace ana;
+
+namespace
+{
+  const int kNBins = 100;
+  const LabelsAndBins kAxis("x", Binning::Simple(kNBins, 0, kNBins));
+
+  //----------------------------------------------------------------------
+  Spectrum MakeSpectrum(int seed, double pot, double livetime)
+  {
+    Eigen::ArrayXd a(kNBins+2);
+    for(int i = 0; i < kNBins+2; ++i) a[i] = (i*seed) % 13 + seed % 3 + 1;
+    return Spectrum(std::move(a), kAxis, pot, livetime);
+  }
+
+  //----------------------------------------------------------------------
+  /// Filled, so that the errors are tracked, weighted or not
+  Spectrum MakeFilled(Hist&& h, int step, bool weighted, double pot)
+  {
+    Spectrum ret(std::move(h), kAxis, 0, 0);
+    for(int i = 0; i < 1000; ++i) ret.Fill((i*step) % kNBins, (weighted && i%3 == 0) ? 2 : 1);
+    ret.OverridePOT(pot);
+    return ret;
+  }
+
+  //----------------------------------------------------------------------
+  int Compare(const std::string& what, const Spectrum& lazy, const Spectrum& eager)
+  {
+    double lazyErr, eagerErr;
+    const double lazyTot = lazy.Integral(1e20, &lazyErr);
+    const double eagerTot = eager.Integral(1e20, &eagerErr);
+
+    const double diff = (lazy.GetEigen(1e20) - eager.GetEigen(1e20)).abs().maxCoeff();
+
+    if(diff > 1e-9 ||
+       std::abs(lazy.POT() - eager.POT()) > 1e-9*eager.POT() ||
+       lazy.Livetime() != eager.Livetime() ||
+       std::abs(lazyErr - eagerErr) > 1e-9*(1+eagerErr)){
+      std::cout << what << ": total " << lazyTot << " +- " << lazyErr
+                << " expected " << eagerTot << " +- " << eagerErr
+                << ", largest bin difference " << diff << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+}
+
+int main()
+{
+  const Spectrum a = MakeSpectrum(3, 1e20, 0);
+  const Spectrum b = MakeSpectrum(5, 2e20, 0);
+  const Spectrum c = MakeSpectrum(7, 4e20, 10);
+  const Ratio r(b, c), q(c, a);
+
+  // Mixing Spectrum and Ratio must still pick the eager operators
+  static_assert(std::is_same_v<decltype(a * r), Spectrum>);
+  static_assert(std::is_same_v<decltype(a / r), Spectrum>);
+  static_assert(std::is_same_v<decltype(r * a), Spectrum>);
+  static_assert(std::is_same_v<decltype(a * Ratio(b, c)), Spectrum>);
+  static_assert(std::is_same_v<decltype(a / Ratio(b, c)), Spectrum>);
+  static_assert(std::is_same_v<decltype(Ratio(b, c) * a), Spectrum>);
+  static_assert(std::is_same_v<decltype(a + b - c), Spectrum>);
+  // And any SpectrumExpr operand makes the whole thing lazy
+  static_assert(std::is_same_v<decltype(SpectrumExpr(a) + b), SpectrumExpr>);
+  static_assert(std::is_same_v<decltype(a - SpectrumExpr(b)), SpectrumExpr>);
+  static_assert(std::is_same_v<decltype(r * SpectrumExpr(a)), SpectrumExpr>);
+
+  int nfail = 0;
+
+  nfail += Compare("a + b*r - c + a/q",
+                   (SpectrumExpr(a) + SpectrumExpr(b)*r - c + SpectrumExpr(a)/q).Eval(),
+                   a + b*r - c + a/q);
+
+  nfail += Compare("r*(a + b)/q",
+                   (r*(SpectrumExpr(a) + b)/q).Eval(),
+                   r*(a + b)/q);
+
+  nfail += Compare("temporaries",
+                   (SpectrumExpr(Spectrum(a)) + SpectrumExpr(Spectrum(b))*Ratio(b, c)).Eval(),
+                   a + b*r);
+
+  // Filled spectra, with sqrt(N) and weighted errors, in dense and sparse
+  // storage
+  const Spectrum f = MakeFilled(Hist::Zero(kNBins), 7, false, 1e20);
+  const Spectrum g = MakeFilled(Hist::ZeroSparse(kNBins), 11, true, 3e20);
+
+  nfail += Compare("f*r + g - a",
+                   (SpectrumExpr(f)*r + g - a).Eval(),
+                   f*r + g - a);
+
+  nfail += Compare("(f + f)*r",
+                   ((SpectrumExpr(f) + f)*r).Eval(),
+                   (f + f)*r);
+
+  const Spectrum empty(Eigen::ArrayXd(Eigen::ArrayXd::Zero(kNBins+2)), kAxis, 0, 0);
+  nfail += Compare("a + empty*r",
+                   (SpectrumExpr(a) + SpectrumExpr(empty)*r).Eval(),
+                   a + empty*r);
+
+  return nfail ? 1 : 0;
+}